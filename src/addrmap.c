@@ -0,0 +1,107 @@
+#include <stdlib.h>     /* for calloc, free */
+#include <string.h>     /* for memset */
+
+#include "addrmap.h"
+
+#define INITIAL_SLOTS 64
+
+struct addr_entry {
+  uintptr_t key;        /* Zero for empty slots. */
+  uintptr_t value;
+};
+
+struct addr_map {
+  struct addr_entry *slots;
+  size_t nslots;
+  size_t len;
+};
+
+static size_t hash_addr(uintptr_t key, size_t nslots) {
+  /* Addresses are aligned, so mix the low bits in from elsewhere. */
+  uint64_t hash = (uint64_t) key * 0x9E3779B97F4A7C15ull;
+  return (size_t) (hash >> 32) & (nslots - 1);
+}
+
+static int resize(struct addr_map *map, size_t nslots) {
+  struct addr_entry *slots = calloc(nslots, sizeof(struct addr_entry));
+  if (!slots) {
+    return -1;
+  }
+  for (size_t i = 0; i < map->nslots; i++) {
+    if (!map->slots[i].key) {
+      continue;
+    }
+    size_t j = hash_addr(map->slots[i].key, nslots);
+    while (slots[j].key) {
+      j = (j + 1) & (nslots - 1);
+    }
+    slots[j] = map->slots[i];
+  }
+  free(map->slots);
+  map->slots = slots;
+  map->nslots = nslots;
+  return 0;
+}
+
+struct addr_map *addrmap_create(void) {
+  struct addr_map *out = calloc(1, sizeof(struct addr_map));
+  if (!out) {
+    return NULL;
+  }
+  if (resize(out, INITIAL_SLOTS) < 0) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+void addrmap_destroy(struct addr_map *map) {
+  if (!map) {
+    return;
+  }
+  free(map->slots);
+  return free(map);
+}
+
+void addrmap_clear(struct addr_map *map) {
+  memset(map->slots, 0, map->nslots * sizeof(struct addr_entry));
+  map->len = 0;
+}
+
+int addrmap_get(struct addr_map *map, uintptr_t key, uintptr_t *value) {
+  size_t i = hash_addr(key, map->nslots);
+  while (map->slots[i].key) {
+    if (map->slots[i].key == key) {
+      *value = map->slots[i].value;
+      return 1;
+    }
+    i = (i + 1) & (map->nslots - 1);
+  }
+  return 0;
+}
+
+int addrmap_put(struct addr_map *map, uintptr_t key, uintptr_t value) {
+  if (!key) {
+    return -1;
+  }
+
+  /* Keep the load factor under 1/2. */
+  if (map->len + 1 > map->nslots / 2 && resize(map, map->nslots * 2) < 0) {
+    return -1;
+  }
+
+  size_t i = hash_addr(key, map->nslots);
+  while (map->slots[i].key && map->slots[i].key != key) {
+    i = (i + 1) & (map->nslots - 1);
+  }
+  if (!map->slots[i].key) {
+    map->len++;
+  }
+  map->slots[i].key = key;
+  map->slots[i].value = value;
+  return 0;
+}
+
+size_t addrmap_size(struct addr_map *map) {
+  return map->len;
+}
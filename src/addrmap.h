@@ -0,0 +1,17 @@
+#ifndef XRPROF_ADDRMAP_H
+#define XRPROF_ADDRMAP_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uintptr_t */
+
+/* A hash map keyed by (non-zero) addresses in the remote process. */
+struct addr_map;
+
+struct addr_map *addrmap_create(void);
+void addrmap_destroy(struct addr_map *map);
+void addrmap_clear(struct addr_map *map);
+int addrmap_get(struct addr_map *map, uintptr_t key, uintptr_t *value);
+int addrmap_put(struct addr_map *map, uintptr_t key, uintptr_t value);
+size_t addrmap_size(struct addr_map *map);
+
+#endif /* XRPROF_ADDRMAP_H */
@@ -0,0 +1,275 @@
+#include <stdlib.h>     /* for calloc, free, realloc, qsort */
+#include <string.h>     /* for memset */
+
+#include "calls.h"
+#include "addrmap.h"
+
+/* Durations are kept in a histogram with this many buckets per doubling,
+   starting from one microsecond. */
+#define CALLS_BUCKETS_PER_OCTAVE 4
+#define CALLS_BUCKETS (40 * CALLS_BUCKETS_PER_OCTAVE)
+
+/* 2^(i / CALLS_BUCKETS_PER_OCTAVE), which avoids needing libm. */
+static const double bucket_steps[CALLS_BUCKETS_PER_OCTAVE] = {
+  1.0, 1.189207, 1.414214, 1.681793
+};
+
+static int duration_bucket(double duration) {
+  double us = duration * 1e6, base = 1;
+  int octave = 0, step = 0;
+  while (octave < CALLS_BUCKETS / CALLS_BUCKETS_PER_OCTAVE - 1 &&
+         us >= 2 * base) {
+    base *= 2;
+    octave++;
+  }
+  while (step < CALLS_BUCKETS_PER_OCTAVE - 1 &&
+         us >= base * bucket_steps[step + 1]) {
+    step++;
+  }
+  return octave * CALLS_BUCKETS_PER_OCTAVE + step;
+}
+
+/* The lower bound of a bucket, in seconds. */
+static double bucket_lower(int bucket) {
+  return (double) (1ULL << (bucket / CALLS_BUCKETS_PER_OCTAVE)) *
+    bucket_steps[bucket % CALLS_BUCKETS_PER_OCTAVE] / 1e6;
+}
+
+/* A call seen in the last sample. */
+struct live_call {
+  struct xrprof_call_id id;
+  int name;
+  double first;         /* When it was first and last seen, in seconds. */
+  double last;
+  unsigned long samples;
+  unsigned long seen;   /* The last sample it was seen in. */
+};
+
+/* Everything we know about the (ended) calls to one function. */
+struct call_stats {
+  int name;
+  unsigned long calls;
+  unsigned long once;   /* Calls seen in only a single sample. */
+  unsigned long samples;
+  double total;         /* Summed estimated durations, in seconds. */
+  double max;
+  unsigned long hist[CALLS_BUCKETS];
+};
+
+struct call_table {
+  struct xrprof_cursor *cursor;
+  double interval;
+  /* Calls on the stack as of the last sample, indexed by context address. */
+  struct live_call *live;
+  int live_len;
+  int live_cap;
+  struct addr_map *live_index;
+  /* Per-function statistics, indexed by frame ID. */
+  struct call_stats *stats;
+  int stats_len;
+  int stats_cap;
+  struct addr_map *stats_index;
+  unsigned long sample;
+  double now;           /* The time of the sample being taken. */
+};
+
+/* Frame IDs start at zero, but addrmap keys must not. */
+#define CALLS_KEY(id) ((uintptr_t) (id) + 1)
+
+struct call_table *calls_create(struct xrprof_cursor *cursor, int freq) {
+  struct call_table *out = calloc(1, sizeof(struct call_table));
+  if (!out) {
+    return NULL;
+  }
+  out->cursor = cursor;
+  out->interval = 1.0 / freq;
+  out->live_index = addrmap_create();
+  out->stats_index = addrmap_create();
+  if (!out->live_index || !out->stats_index) {
+    calls_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void calls_destroy(struct call_table *calls) {
+  if (!calls) {
+    return;
+  }
+  addrmap_destroy(calls->live_index);
+  addrmap_destroy(calls->stats_index);
+  free(calls->live);
+  free(calls->stats);
+  return free(calls);
+}
+
+static struct call_stats *get_stats(struct call_table *calls, int name) {
+  uintptr_t i;
+  if (addrmap_get(calls->stats_index, CALLS_KEY(name), &i)) {
+    return &calls->stats[i];
+  }
+  if (calls->stats_len == calls->stats_cap) {
+    int cap = calls->stats_cap ? 2 * calls->stats_cap : 256;
+    struct call_stats *stats = realloc(calls->stats,
+                                       cap * sizeof(struct call_stats));
+    if (!stats) {
+      return NULL;
+    }
+    calls->stats = stats;
+    calls->stats_cap = cap;
+  }
+  if (addrmap_put(calls->stats_index, CALLS_KEY(name), calls->stats_len) < 0) {
+    return NULL;
+  }
+  struct call_stats *entry = &calls->stats[calls->stats_len++];
+  memset(entry, 0, sizeof(struct call_stats));
+  entry->name = name;
+  return entry;
+}
+
+/* A call seen in n consecutive samples lasted between n - 1 and n + 1
+   intervals, so the estimate is the time between the first and last samples
+   plus one interval. */
+static int end_call(struct call_table *calls, struct live_call *call) {
+  struct call_stats *stats = get_stats(calls, call->name);
+  if (!stats) {
+    return -1;
+  }
+  double duration = call->last - call->first + calls->interval;
+  stats->hist[duration_bucket(duration)]++;
+  stats->calls++;
+  stats->once += call->samples == 1;
+  stats->samples += call->samples;
+  stats->total += duration;
+  if (duration > stats->max) {
+    stats->max = duration;
+  }
+  return 0;
+}
+
+int calls_add_frame(struct call_table *calls) {
+  struct xrprof_call_id id;
+  struct live_call *call;
+  uintptr_t i;
+  int ret, name;
+
+  if ((ret = xrprof_get_call_id(calls->cursor, &id)) <= 0 ||
+      (ret = xrprof_get_fun_id(calls->cursor, &name)) <= 0) {
+    return ret;
+  }
+
+  if (addrmap_get(calls->live_index, id.addr, &i)) {
+    call = &calls->live[i];
+    if (call->id.call == id.call && call->id.cloenv == id.cloenv &&
+        call->id.evaldepth == id.evaldepth && call->name == name) {
+      call->last = calls->now;
+      call->samples++;
+      call->seen = calls->sample;
+      return 0;
+    }
+    /* A different call in the same place, so the old one has ended. */
+    if (end_call(calls, call) < 0) {
+      return -1;
+    }
+  } else {
+    if (calls->live_len == calls->live_cap) {
+      int cap = calls->live_cap ? 2 * calls->live_cap : 256;
+      struct live_call *live = realloc(calls->live,
+                                       cap * sizeof(struct live_call));
+      if (!live) {
+        return -1;
+      }
+      calls->live = live;
+      calls->live_cap = cap;
+    }
+    if (addrmap_put(calls->live_index, id.addr, calls->live_len) < 0) {
+      return -1;
+    }
+    call = &calls->live[calls->live_len++];
+  }
+
+  call->id = id;
+  call->name = name;
+  call->first = calls->now;
+  call->last = calls->now;
+  call->samples = 1;
+  call->seen = calls->sample;
+  return 0;
+}
+
+void calls_start_sample(struct call_table *calls,
+                        const struct timespec *when) {
+  calls->sample++;
+  calls->now = when->tv_sec + when->tv_nsec / 1e9;
+}
+
+int calls_end_sample(struct call_table *calls, int truncated) {
+  int len = 0;
+
+  /* A truncated walk doesn't show which of the outer calls have ended. */
+  if (!truncated) {
+    addrmap_clear(calls->live_index);
+    for (int i = 0; i < calls->live_len; i++) {
+      struct live_call *call = &calls->live[i];
+      if (call->seen != calls->sample) {
+        if (end_call(calls, call) < 0) {
+          return -1;
+        }
+        continue;
+      }
+      calls->live[len] = *call;
+      addrmap_put(calls->live_index, call->id.addr, len);
+      len++;
+    }
+    calls->live_len = len;
+  }
+  return 0;
+}
+
+static int compare_stats(const void *a, const void *b) {
+  const struct call_stats *x = a, *y = b;
+  return (x->total < y->total) - (x->total > y->total);
+}
+
+/* The middle of the bucket containing the qth quantile, in seconds. */
+static double stats_quantile(struct call_stats *stats, double q) {
+  unsigned long seen = 0, target = (unsigned long) (q * stats->calls);
+  for (int i = 0; i < CALLS_BUCKETS; i++) {
+    seen += stats->hist[i];
+    if (seen > target) {
+      double mid = (bucket_lower(i) + bucket_lower(i + 1)) / 2;
+      return mid < stats->max ? mid : stats->max;
+    }
+  }
+  return stats->max;
+}
+
+int calls_report(struct call_table *calls, FILE *out) {
+  for (int i = 0; i < calls->live_len; i++) {
+    if (end_call(calls, &calls->live[i]) < 0) {
+      return -1;
+    }
+  }
+  calls->live_len = 0;
+  addrmap_clear(calls->live_index);
+
+  /* Sorting changes the indices, so the index is no longer valid. */
+  qsort(calls->stats, calls->stats_len, sizeof(struct call_stats),
+        compare_stats);
+  addrmap_clear(calls->stats_index);
+
+  fprintf(out, "# Estimated from %lu samples taken every %gms. Calls shorter than that are\n"
+          "# mostly missed, and durations are only accurate to about one interval.\n",
+          calls->sample, calls->interval * 1000);
+  fprintf(out, "function\tcalls\tonce\tsamples\ttotal_ms\tmean_ms\tp50_ms\tp90_ms\tmax_ms\n");
+  for (int i = 0; i < calls->stats_len; i++) {
+    struct call_stats *stats = &calls->stats[i];
+    fprintf(out, "%s\t%lu\t%lu\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+            xrprof_lookup_name(calls->cursor, stats->name), stats->calls,
+            stats->once, stats->samples, stats->total * 1000,
+            stats->total * 1000 / stats->calls,
+            stats_quantile(stats, 0.5) * 1000,
+            stats_quantile(stats, 0.9) * 1000, stats->max * 1000);
+  }
+  return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef XRPROF_CALLS_H
+#define XRPROF_CALLS_H
+
+#include <stdio.h>  /* for FILE */
+#include <time.h>   /* for timespec */
+#include "cursor.h"
+
+/* Estimates of how many times each function was called and how long those
+   calls took, found by following the identity of each call from one sample to
+   the next. Calls shorter than the sampling interval are mostly missed. */
+struct call_table;
+
+struct call_table *calls_create(struct xrprof_cursor *cursor, int freq);
+void calls_destroy(struct call_table *calls);
+/* Start a sample taken at the given time (on CLOCK_MONOTONIC). */
+void calls_start_sample(struct call_table *calls, const struct timespec *when);
+/* Note the cursor's current frame as part of the sample being taken. */
+int calls_add_frame(struct call_table *calls);
+/* Finish the sample. Calls that are no longer on the stack have ended, unless
+   the walk was truncated. */
+int calls_end_sample(struct call_table *calls, int truncated);
+/* End any calls still in progress and write a tab-separated table of
+   per-function estimates to out. */
+int calls_report(struct call_table *calls, FILE *out);
+
+#endif /* XRPROF_CALLS_H */
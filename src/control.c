@@ -0,0 +1,360 @@
+#ifdef __linux
+#define _GNU_SOURCE     /* for accept4, ppoll */
+#endif
+
+#include <stdarg.h>     /* for va_list, va_start, va_end */
+#include <stdio.h>      /* for fprintf, vsnprintf */
+#include <stdlib.h>     /* for calloc, free, strtol */
+
+#include "control.h"
+
+#ifdef __linux
+#include <errno.h>      /* for errno, EAGAIN, ECONNREFUSED, EINTR */
+#include <poll.h>       /* for ppoll */
+#include <string.h>     /* for memchr, memmove, strcmp, strdup, strlen */
+#include <sys/socket.h>
+#include <sys/stat.h>   /* for lstat, umask */
+#include <sys/un.h>     /* for sockaddr_un */
+#include <unistd.h>     /* for close, unlink */
+
+#define MAX_CLIENTS 16
+#define MAX_LINE 512
+
+struct control_client {
+  int fd;
+  int eof;              /* Commands left to serve after the client is done. */
+  size_t len;
+  char line[MAX_LINE];
+};
+
+struct control {
+  int fd;
+  char *path;
+  struct control_client clients[MAX_CLIENTS];
+  int current;          /* The client that sent the last command. */
+};
+
+/* Whether a socket at this address is left behind by an earlier run, rather
+   than being listened on by some other process. */
+static int is_stale(const struct sockaddr_un *addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  int ret = connect(fd, (const struct sockaddr *) addr,
+                    sizeof(struct sockaddr_un));
+  int stale = ret < 0 && errno == ECONNREFUSED;
+  close(fd);
+  return stale;
+}
+
+struct control *control_create(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: Control socket path is too long.\n");
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  /* Only replace sockets that nothing is listening on. */
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "error: %s exists and is not a socket.\n", path);
+      return NULL;
+    }
+    if (!is_stale(&addr)) {
+      fprintf(stderr, "error: %s is already in use.\n", path);
+      return NULL;
+    }
+    unlink(path);
+  }
+
+  struct control *out = calloc(1, sizeof(struct control));
+  if (!out || !(out->path = strdup(path))) {
+    free(out);
+    return NULL;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    out->clients[i].fd = -1;
+  }
+  out->current = -1;
+
+  out->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (out->fd < 0) {
+    perror("error: Failed to create control socket");
+    free(out->path);
+    free(out);
+    return NULL;
+  }
+
+  /* Create the socket without group or other permissions to begin with,
+     rather than racing to change them afterwards. */
+  mode_t mask = umask(077);
+  int ret = bind(out->fd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(mask);
+  if (ret < 0 || listen(out->fd, MAX_CLIENTS) < 0) {
+    perror("error: Failed to listen on control socket");
+    close(out->fd);
+    if (ret == 0) {
+      unlink(path);
+    }
+    free(out->path);
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+static void drop_client(struct control *control, int i) {
+  close(control->clients[i].fd);
+  control->clients[i].fd = -1;
+  control->clients[i].eof = 0;
+  control->clients[i].len = 0;
+  if (control->current == i) {
+    control->current = -1;
+  }
+}
+
+void control_destroy(struct control *control) {
+  if (!control) {
+    return;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (control->clients[i].fd >= 0) {
+      drop_client(control, i);
+    }
+  }
+  close(control->fd);
+  unlink(control->path);
+  free(control->path);
+  return free(control);
+}
+
+/* Replies are short, so a client that can't take one right away is not
+   keeping up, and is dropped rather than waited for. */
+static int send_line(struct control *control, int i, const char *line,
+                     size_t len) {
+  ssize_t sent = send(control->clients[i].fd, line, len,
+                      MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0 || (size_t) sent < len) {
+    drop_client(control, i);
+    return -1;
+  }
+  return 0;
+}
+
+int control_reply(struct control *control, const char *fmt, ...) {
+  char line[MAX_LINE];
+  va_list args;
+
+  if (control->current < 0) {
+    return -1;
+  }
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line) - 1, fmt, args);
+  va_end(args);
+  if (len < 0) {
+    return -1;
+  }
+  if (len > (int) sizeof(line) - 2) {
+    len = sizeof(line) - 2;
+  }
+  line[len++] = '\n';
+  return send_line(control, control->current, line, len);
+}
+
+/* Parse a line such as "freq 100" into cmd. Returns zero for blank lines. */
+static int parse_command(struct control *control, char *line,
+                         struct control_command *cmd) {
+  char *arg = line, *end;
+
+  while (*arg && *arg != ' ' && *arg != '\t') {
+    arg++;
+  }
+  if (*arg) {
+    *arg++ = '\0';
+    while (*arg == ' ' || *arg == '\t') {
+      arg++;
+    }
+  }
+
+  memset(cmd, 0, sizeof(struct control_command));
+  if (line[0] == '\0') {
+    return 0;
+  } else if (strcmp(line, "start") == 0) {
+    cmd->type = CONTROL_START;
+  } else if (strcmp(line, "stop") == 0) {
+    cmd->type = CONTROL_STOP;
+  } else if (strcmp(line, "flush") == 0) {
+    cmd->type = CONTROL_FLUSH;
+  } else if (strcmp(line, "stats") == 0) {
+    cmd->type = CONTROL_STATS;
+  } else if (strcmp(line, "freq") == 0) {
+    long freq = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || freq <= 0 || freq > 1000000) {
+      control_reply(control, "error: Invalid frequency.");
+      return 0;
+    }
+    cmd->type = CONTROL_FREQ;
+    cmd->freq = freq;
+  } else if (strcmp(line, "rotate") == 0) {
+    if (arg[0] == '\0' || strlen(arg) >= CONTROL_MAX_PATH) {
+      control_reply(control, "error: Invalid path.");
+      return 0;
+    }
+    cmd->type = CONTROL_ROTATE;
+    strcpy(cmd->path, arg);
+  } else {
+    control_reply(control, "error: Unknown command '%.64s'.", line);
+    return 0;
+  }
+  return 1;
+}
+
+/* Take the next complete command from any client's buffer. */
+static int next_command(struct control *control,
+                        struct control_command *cmd) {
+  char line[MAX_LINE];
+
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    struct control_client *client = &control->clients[i];
+    char *nl;
+    while (client->fd >= 0 &&
+           (nl = memchr(client->line, '\n', client->len)) != NULL) {
+      size_t len = nl - client->line;
+      memcpy(line, client->line, len);
+      line[len] = '\0';
+      if (len > 0 && line[len - 1] == '\r') {
+        line[len - 1] = '\0';
+      }
+      client->len -= len + 1;
+      memmove(client->line, nl + 1, client->len);
+      control->current = i;
+      if (parse_command(control, line, cmd)) {
+        return 1;
+      }
+    }
+    if (client->fd >= 0 && client->eof) {
+      drop_client(control, i);
+    }
+  }
+  return 0;
+}
+
+static void accept_clients(struct control *control) {
+  int fd;
+  while ((fd = accept4(control->fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    int i = 0;
+    while (i < MAX_CLIENTS && control->clients[i].fd >= 0) {
+      i++;
+    }
+    if (i == MAX_CLIENTS) {
+      const char *msg = "error: Too many clients.\n";
+      send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+    control->clients[i].fd = fd;
+  }
+}
+
+static void read_client(struct control *control, int i) {
+  struct control_client *client = &control->clients[i];
+  ssize_t n = recv(client->fd, client->line + client->len,
+                   MAX_LINE - client->len, MSG_DONTWAIT);
+  if (n == 0) {
+    client->eof = 1;
+    return;
+  } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    drop_client(control, i);
+    return;
+  }
+  if (n > 0) {
+    client->len += n;
+  }
+  if (client->len == MAX_LINE && !memchr(client->line, '\n', MAX_LINE)) {
+    control->current = i;
+    control_reply(control, "error: Command is too long.");
+    if (client->fd >= 0) {
+      drop_client(control, i);
+    }
+  }
+}
+
+int control_wait(struct control *control, const struct timespec *deadline,
+                 struct control_command *cmd) {
+  struct pollfd pfds[MAX_CLIENTS + 1];
+  int idx[MAX_CLIENTS + 1];
+  struct timespec now, timeout;
+
+  while (!next_command(control, cmd)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+    timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_sec--;
+      timeout.tv_nsec += 1000000000L;
+    }
+    if (timeout.tv_sec < 0) {
+      return 0;
+    }
+
+    int n = 0;
+    pfds[n].fd = control->fd;
+    pfds[n].events = POLLIN;
+    idx[n++] = -1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      if (control->clients[i].fd >= 0 && !control->clients[i].eof) {
+        pfds[n].fd = control->clients[i].fd;
+        pfds[n].events = POLLIN;
+        idx[n++] = i;
+      }
+    }
+    int ready = ppoll(pfds, n, &timeout, NULL);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        return -1;
+      }
+      /* Sleep through the rest of the interval rather than spin. */
+      perror("error: Failed to wait on control socket");
+      nanosleep(&timeout, NULL);
+      return 0;
+    }
+    for (int j = 0; j < n && ready > 0; j++) {
+      if (!pfds[j].revents) {
+        continue;
+      }
+      ready--;
+      if (idx[j] < 0) {
+        accept_clients(control);
+      } else {
+        read_client(control, idx[j]);
+      }
+    }
+  }
+  return 1;
+}
+#else
+struct control *control_create(const char *path) {
+  fprintf(stderr, "error: Control sockets are not supported on this platform.\n");
+  return NULL;
+}
+
+void control_destroy(struct control *control) {
+  return;
+}
+
+int control_wait(struct control *control, const struct timespec *deadline,
+                 struct control_command *cmd) {
+  return -1;
+}
+
+int control_reply(struct control *control, const char *fmt, ...) {
+  return -1;
+}
+#endif
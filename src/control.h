@@ -0,0 +1,42 @@
+#ifndef XRPROF_CONTROL_H
+#define XRPROF_CONTROL_H
+
+#include <time.h> /* for timespec */
+
+/* Commands read by control_wait(). */
+#define CONTROL_START 1
+#define CONTROL_STOP 2
+#define CONTROL_FREQ 3    /* With a new frequency in freq. */
+#define CONTROL_FLUSH 4
+#define CONTROL_ROTATE 5  /* With a new output file in path. */
+#define CONTROL_STATS 6
+
+#define CONTROL_MAX_PATH 256
+
+struct control_command {
+  int type;
+  int freq;
+  char path[CONTROL_MAX_PATH];
+};
+
+/* A local (Unix-domain) socket that accepts one command per line, so that a
+   running profiler can be driven by other programs. It is only ever served
+   while the tracee is running, and never blocks on slow clients. */
+struct control;
+
+/* Listen at path, replacing any stale socket there (but not one in use). Only
+   the current user can connect. */
+struct control *control_create(const char *path);
+/* Stop listening and remove the socket. */
+void control_destroy(struct control *control);
+/* Serve clients until a command is read or the (CLOCK_MONOTONIC) deadline
+   passes. Returns 1 with a command, which must be answered with
+   control_reply(); 0 at the deadline; or -1 when interrupted by a signal.
+   Malformed commands are answered here. */
+int control_wait(struct control *control, const struct timespec *deadline,
+                 struct control_command *cmd);
+/* Send a one-line reply to the client that sent the last command. */
+int control_reply(struct control *control, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#endif /* XRPROF_CONTROL_H */
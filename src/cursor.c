@@ -1,30 +1,117 @@
 #include <stdlib.h>     /* for malloc, free */
 #include <stdio.h>      /* for fprintf */
+#include <string.h>     /* for memcpy, strcmp, strdup, strrchr, strstr */
+#include <time.h>       /* for time, clock_gettime */
 
 #include "cursor.h"
 #include "rdefs.h"
+#include "addrmap.h"
+#include "intern.h"
 #include "locate.h"
 #include "memory.h"
 
+#define TRUNCATED_NAME "<Truncated>"
+#define OTHER_NAME "<Other>"
+
+/* A frame from a walk of the context stack. */
+struct xrprof_frame {
+  void *addr;           /* The context's address, or NULL for promises. */
+  void *nextcontext;
+  void *call;
+  void *cloenv;
+  int evaldepth;
+  int name;             /* Interned name, or -1 at the top level. */
+};
+
+/* The frames of a walk, innermost first. */
+struct xrprof_stack {
+  struct xrprof_frame *frames;
+  int len;
+  int cap;
+};
+
 struct xrprof_cursor {
-  void *rcxt_ptr;
   RCNTXT *cptr;
   struct libR_globals globals;
   phandle pid;
-  int depth;
+  int flags;
+  struct intern_table *names;
+  /* The current and previous walks, the latter of which is reused. */
+  struct xrprof_stack stack;
+  struct xrprof_stack prev;
+  int pos;
+  struct rcntxt_layout layout;
+  int have_layout;
+  int layout_tries;     /* Walks cut short while detecting the layout. */
+  /* Namespace environments, mapped to their interned names. */
+  struct addr_map *namespaces;
+  time_t namespaces_scanned;
+  /* A scan of the registry in progress, and where it will pick up. */
+  struct addr_map *namespaces_next;
+  size_t namespaces_bucket;
+  /* Values bound in namespaces and the global environment, mapped to their
+     symbols, and when each environment was read. */
+  struct addr_map *bindings;
+  struct addr_map *bindings_scanned;
+  /* The environment being read into bindings, if any, and where it will
+     pick up. */
+  uintptr_t bindings_env;
+  size_t bindings_bucket;
+  /* The same for the values of symbols, which is where base binds them. The
+     symbol table is read in steps: its buckets, and then the nodes at each
+     depth of their lists. */
+  struct addr_map *symbols;
+  int symbols_scanned;
+  void **symbol_nodes;
+  size_t symbol_buckets;
+  size_t symbol_len;
+  size_t symbol_pos;
+  size_t symbol_next;
+  int symbol_depth;
+  /* Closures mapped to their interned names, and to their bodies, which tell
+     us when an address has been reused. */
+  struct addr_map *closures;
+  struct addr_map *closure_bodies;
+  struct timespec deadline;
+  int have_deadline;
+  int truncated;        /* Whether the last walk was cut short. */
+  /* The variable whose value tags samples, and its binding, once found. */
+  char *tag_name;
+  char *tag_package;    /* NULL for the global environment. */
+  uintptr_t tag_cell;
+  uintptr_t tag_sym;
+  time_t tag_searched;
+  /* A search in progress: the environment (once known) and the bucket. */
+  int tag_searching;
+  uintptr_t tag_env;
+  size_t tag_bucket;
 };
 
-struct xrprof_cursor *xrprof_create(phandle pid) {
+struct xrprof_cursor *xrprof_create(phandle pid, int flags) {
   /* Find the symbols and addresses we need. */
-  struct libR_globals globals;
+  struct libR_globals globals = {0};
   if (locate_libR_globals(pid, &globals) < 0) return NULL;
 
-  struct xrprof_cursor *out = malloc(sizeof(struct xrprof_cursor));
-  out->rcxt_ptr = NULL;
-  out->cptr = malloc(sizeof(RCNTXT));
+  struct xrprof_cursor *out = calloc(1, sizeof(struct xrprof_cursor));
+  out->cptr = calloc(1, sizeof(RCNTXT));
   out->pid = pid;
   out->globals = globals;
-  out->depth = 0;
+  out->flags = flags;
+  out->names = intern_create();
+  /* Reserved, so that these are never lost to the bound on names. */
+  intern_string(out->names, TRUNCATED_NAME);
+  intern_string(out->names, OTHER_NAME);
+  out->namespaces = addrmap_create();
+  out->namespaces_scanned = 0;
+  if (flags & XRPROF_CLOSURES) {
+    out->bindings = addrmap_create();
+    out->bindings_scanned = addrmap_create();
+    out->symbols = addrmap_create();
+    out->closures = addrmap_create();
+    out->closure_bodies = addrmap_create();
+  }
+  out->pos = 0;
+  out->have_layout = 0;
 
   return out;
 }
@@ -36,26 +123,131 @@ void xrprof_destroy(struct xrprof_cursor *cursor) {
   if (cursor->cptr) {
     free(cursor->cptr);
   }
+  free(cursor->stack.frames);
+  free(cursor->prev.frames);
+  intern_destroy(cursor->names);
+  addrmap_destroy(cursor->namespaces);
+  addrmap_destroy(cursor->namespaces_next);
+  free(cursor->symbol_nodes);
+  if (cursor->closures) {
+    addrmap_destroy(cursor->bindings);
+    addrmap_destroy(cursor->bindings_scanned);
+    addrmap_destroy(cursor->symbols);
+    addrmap_destroy(cursor->closures);
+    addrmap_destroy(cursor->closure_bodies);
+  }
+  free(cursor->tag_name);
+  free(cursor->tag_package);
   return free(cursor);
 }
 
 #define MAX_SYM_LEN 128
+#define MAX_FRAME_SEARCH 64
+#define MAX_PROMISE_DEPTH 64
+#define MAX_STACK_DEPTH 16384
+#define MAX_ENCLOS_DEPTH 16
+#define MAX_HASH_BUCKETS 65536
+#define MAX_BUCKET_LEN 64
+#define MAX_ATTRIBS 16
+/* Bounds on the memory used to name closures. */
+#define MAX_BINDINGS 262144
+#define MAX_CLOSURES 65536
+#define MAX_SYMBOL_REQS 16
+#define SYMBOL_TABLE_SIZE 49157 /* HSIZE in R's Defn.h. */
+#define SYMBOL_CHUNK 4096
+/* Detecting the layout of contexts reads the whole stack, and once it has
+   been cut short by the deadline this many times, it is allowed to run over
+   rather than hold up sampling forever. */
+#define MAX_LAYOUT_TRIES 16
+/* Returned by scans that stopped at the deadline, to carry on in later walks. */
+#define SCAN_PAUSED -3
+/* How often an environment may be read again to look for new bindings. */
+#define BINDINGS_RESCAN_SECS 10
+/* Names are kept for as long as the cursor is, so their number is bounded.
+   Past that, new names are all given the same one, so that existing IDs stay
+   valid. */
+#define MAX_NAMES 65536
 
-int xrprof_get_fun_name(struct xrprof_cursor *cursor, char *buff, size_t len) {
+static int intern_name(struct xrprof_cursor *cursor, const char *name) {
+  int id = intern_find(cursor->names, name);
+  if (id >= 0) {
+    return id;
+  }
+  return intern_string(cursor->names, intern_size(cursor->names) < MAX_NAMES ?
+                       name : OTHER_NAME);
+}
+
+void xrprof_set_deadline(struct xrprof_cursor *cursor,
+                         const struct timespec *deadline) {
+  cursor->have_deadline = deadline != NULL;
+  if (deadline) {
+    cursor->deadline = *deadline;
+  }
+}
+
+static int past_deadline(struct xrprof_cursor *cursor) {
+  struct timespec now;
+  if (!cursor->have_deadline) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > cursor->deadline.tv_sec ||
+    (now.tv_sec == cursor->deadline.tv_sec &&
+     now.tv_nsec >= cursor->deadline.tv_nsec);
+}
+
+/* Find the name of the argument a promise was bound to by searching the frame
+   of the closure that forced it. Falls back on the promise's code when that is
+   just a symbol. */
+static int get_promise_name(struct xrprof_cursor *cursor, RCNTXT *cptr,
+                            void *promise, char *buff, size_t len) {
+  SEXPREC env, node, sym;
+
+  /* Only closures have a frame the promise might belong to. */
+  if (cptr->callflag & CTXT_FUNCTION &&
+      copy_sexp(cursor->pid, (void *) cptr->cloenv, &env) == 0 &&
+      TYPEOF(&env) == ENVSXP) {
+    void *next = (void *) FRAME(&env);
+    for (int i = 0; i < MAX_FRAME_SEARCH && next; i++) {
+      if (copy_sexp(cursor->pid, next, &node) < 0 || TYPEOF(&node) != LISTSXP) {
+        /* The end of the frame is R_NilValue, which is not a LISTSXP. */
+        break;
+      }
+      if ((void *) CAR(&node) == promise) {
+        if (copy_sexp(cursor->pid, (void *) TAG(&node), &sym) < 0 ||
+            TYPEOF(&sym) != SYMSXP) {
+          break;
+        }
+        return copy_char(cursor->pid, (void *) PRINTNAME(&sym), buff, len);
+      }
+      next = (void *) CDR(&node);
+    }
+  }
+
+  SEXPREC prom;
+  if (copy_sexp(cursor->pid, promise, &prom) == 0 && TYPEOF(&prom) == PROMSXP &&
+      copy_sexp(cursor->pid, (void *) PRCODE(&prom), &sym) == 0 &&
+      TYPEOF(&sym) == SYMSXP) {
+    return copy_char(cursor->pid, (void *) PRINTNAME(&sym), buff, len);
+  }
+
+  return -1;
+}
+
+/* Determine the name of the function called in a context. Returns zero at the
+   top level. */
+static int get_call_name(struct xrprof_cursor *cursor, RCNTXT *cptr,
+                         char *buff, size_t len) {
   SEXPREC call, fun, cdr, lhs, rhs;
   char lname[MAX_SYM_LEN], rname[MAX_SYM_LEN];
   size_t written;
 
-  if (!cursor || !cursor->cptr) {
-    return -1;
-  }
-
   /* We're at the top level. */
-  if (cursor->cptr->callflag == CTXT_TOPLEVEL) {
+  if (cptr->callflag == CTXT_TOPLEVEL) {
     return 0;
   }
 
-  int ret = copy_sexp(cursor->pid, (void *) cursor->cptr->call, &call);
+  int ret = copy_sexp(cursor->pid, (void *) cptr->call, &call);
   if (ret < 0) {
     fprintf(stderr, "error: Could not read SEXP for current call.\n");
     return ret;
@@ -63,7 +255,7 @@ int xrprof_get_fun_name(struct xrprof_cursor *cursor, char *buff, size_t len) {
 
   /* Adapted from R's eval.c code for Rprof. */
 
-  if (cursor->cptr->callflag & (CTXT_FUNCTION | CTXT_BUILTIN | CTXT_CCODE) &&
+  if (cptr->callflag & (CTXT_FUNCTION | CTXT_BUILTIN | CTXT_CCODE) &&
       TYPEOF(&call) == LANGSXP) {
     ret = copy_sexp(cursor->pid, (void *) CAR(&call), &fun);
     if (ret < 0) {
@@ -115,43 +307,980 @@ int xrprof_get_fun_name(struct xrprof_cursor *cursor, char *buff, size_t len) {
   return 1;
 }
 
+typedef int (*binding_fn)(struct xrprof_cursor *cursor, void *addr,
+                          SEXPREC *node, void *data);
+
+/* Call fn on each node of a pairlist until it returns non-zero, which is then
+   returned. */
+static int walk_pairlist(struct xrprof_cursor *cursor, void *next, int max,
+                         binding_fn fn, void *data) {
+  SEXPREC node;
+  int ret;
+  for (int i = 0; i < max && next; i++) {
+    /* The end of the list is R_NilValue, which is not a LISTSXP. */
+    if (copy_sexp(cursor->pid, next, &node) < 0 || TYPEOF(&node) != LISTSXP) {
+      break;
+    }
+    if ((ret = fn(cursor, next, &node, data)) != 0) {
+      return ret;
+    }
+    next = (void *) CDR(&node);
+  }
+  return 0;
+}
+
+/* Call fn on each binding in an environment, which may or may not be hashed,
+   until it returns non-zero, which is then returned. Large environments take
+   a while to read, so given somewhere to resume from, a walk stops at the
+   deadline with SCAN_PAUSED and carries on from there the next time. That is
+   reset to zero once the walk is over. */
+static int walk_bindings(struct xrprof_cursor *cursor, void *addr,
+                         binding_fn fn, void *data, size_t *resume) {
+  SEXPREC env;
+  SEXPREC_ALIGN table;
+  size_t start = resume ? *resume : 0;
+  int ret = 0;
+
+  if (resume) {
+    *resume = 0;
+  }
+  if (copy_sexp(cursor->pid, addr, &env) < 0 || TYPEOF(&env) != ENVSXP) {
+    return -1;
+  }
+  void *hashtab = (void *) HASHTAB(&env);
+  if (!hashtab || copy_address(cursor->pid, hashtab, &table,
+                               sizeof(SEXPREC_ALIGN)) < sizeof(SEXPREC_ALIGN)) {
+    return -1;
+  }
+  /* Unhashed environments have R_NilValue here. */
+  if (TYPEOF(&table.s) != VECSXP) {
+    return walk_pairlist(cursor, (void *) FRAME(&env), MAX_FRAME_SEARCH, fn,
+                         data);
+  }
+
+  size_t len = table.s.vecsxp.length;
+  if (len > MAX_HASH_BUCKETS) {
+    len = MAX_HASH_BUCKETS;
+  }
+  /* The table may have been resized since the walk began. */
+  if (start >= len) {
+    return 0;
+  }
+  void **buckets = malloc((len - start) * sizeof(void *));
+  if (!buckets || copy_address(cursor->pid,
+                               (void **) STDVEC_DATAPTR(hashtab) + start,
+                               buckets, (len - start) * sizeof(void *)) <
+      (len - start) * sizeof(void *)) {
+    free(buckets);
+    return -1;
+  }
+  /* Empty buckets are R_NilValue, too. */
+  for (size_t i = start; i < len && ret == 0; i++) {
+    if (resume && i > start && past_deadline(cursor)) {
+      *resume = i;
+      free(buckets);
+      return SCAN_PAUSED;
+    }
+    ret = walk_pairlist(cursor, buckets[i - start], MAX_BUCKET_LEN, fn, data);
+  }
+  free(buckets);
+  return ret;
+}
+
+static int get_symbol_name(struct xrprof_cursor *cursor, void *addr,
+                           char *buff, size_t len) {
+  SEXPREC sym;
+  if (copy_sexp(cursor->pid, addr, &sym) < 0 || TYPEOF(&sym) != SYMSXP) {
+    return -1;
+  }
+  return copy_char(cursor->pid, (void *) PRINTNAME(&sym), buff, len);
+}
+
+/* Functions in lazy-loaded namespaces are bound to promises, which keep
+   their value once forced, so look through those. */
+static uintptr_t get_binding_value(struct xrprof_cursor *cursor,
+                                   SEXPREC *node) {
+  SEXPREC value;
+  if (copy_sexp(cursor->pid, (void *) CAR(node), &value) == 0 &&
+      TYPEOF(&value) == PROMSXP) {
+    return (uintptr_t) PRVALUE(&value);
+  }
+  return (uintptr_t) CAR(node);
+}
+
+static int add_binding(struct xrprof_cursor *cursor, void *addr,
+                       SEXPREC *node, void *data) {
+  if (addrmap_size(cursor->bindings) < MAX_BINDINGS) {
+    addrmap_put(cursor->bindings, get_binding_value(cursor, node),
+                (uintptr_t) TAG(node));
+  }
+  return 0;
+}
+
+struct binding_search {
+  uintptr_t value;
+  const char *name;     /* Search by name instead, when not NULL. */
+  uintptr_t found;
+  uintptr_t cell;       /* The binding itself, when searching by name. */
+};
+
+static int find_binding(struct xrprof_cursor *cursor, void *addr,
+                        SEXPREC *node, void *data) {
+  struct binding_search *search = data;
+  char name[MAX_SYM_LEN];
+  if (search->name) {
+    if (get_symbol_name(cursor, (void *) TAG(node), name, MAX_SYM_LEN) == 0 &&
+        strcmp(name, search->name) == 0) {
+      search->found = (uintptr_t) CAR(node);
+      search->cell = (uintptr_t) addr;
+      return 1;
+    }
+  } else if (get_binding_value(cursor, node) == search->value) {
+    search->found = (uintptr_t) TAG(node);
+    return 1;
+  }
+  return 0;
+}
+
+/* Find the value of an attribute, or zero. */
+static uintptr_t get_attrib(struct xrprof_cursor *cursor, void *attrib,
+                            const char *name) {
+  struct binding_search search = {0, name, 0};
+  walk_pairlist(cursor, attrib, MAX_ATTRIBS, find_binding, &search);
+  return search.found;
+}
+
+/* Whether an environment with these attributes holds the imports of a
+   namespace, which R names "imports:pkg". */
+static int is_imports_env(struct xrprof_cursor *cursor, void *attrib) {
+  SEXPREC_ALIGN vec;
+  void *str;
+  char name[sizeof("imports:")];
+
+  void *value = (void *) get_attrib(cursor, attrib, "name");
+  return value && copy_address(cursor->pid, value, &vec,
+                               sizeof(SEXPREC_ALIGN)) == sizeof(SEXPREC_ALIGN) &&
+    TYPEOF(&vec.s) == STRSXP && vec.s.vecsxp.length > 0 &&
+    copy_address(cursor->pid, STDVEC_DATAPTR(value), &str,
+                 sizeof(void *)) == sizeof(void *) &&
+    copy_char(cursor->pid, str, name, sizeof(name)) == 0 &&
+    strcmp(name, "imports:") == 0;
+}
+
+static int add_namespace(struct xrprof_cursor *cursor, void *addr,
+                         SEXPREC *node, void *data) {
+  char name[MAX_SYM_LEN];
+  if (get_symbol_name(cursor, (void *) TAG(node), name, MAX_SYM_LEN) == 0) {
+    addrmap_put((struct addr_map *) data, (uintptr_t) CAR(node),
+                intern_name(cursor, name));
+  }
+  return 0;
+}
+
+/* Map the address of each namespace environment to its name by reading every
+   binding in R's namespace registry, which is a hashed environment. This may
+   take more than one walk, so the map is only replaced once it is done. */
+static int scan_namespaces(struct xrprof_cursor *cursor) {
+  if (!cursor->namespaces_next) {
+    if (!(cursor->namespaces_next = addrmap_create())) {
+      return -1;
+    }
+    cursor->namespaces_bucket = 0;
+  }
+  int ret = walk_bindings(cursor, (void *) cursor->globals.registry,
+                          add_namespace, cursor->namespaces_next,
+                          &cursor->namespaces_bucket);
+  if (ret == SCAN_PAUSED) {
+    return ret;
+  }
+  addrmap_destroy(cursor->namespaces);
+  cursor->namespaces = cursor->namespaces_next;
+  cursor->namespaces_next = NULL;
+  cursor->namespaces_scanned = time(NULL);
+  return ret < 0 ? -1 : 0;
+}
+
+/* Find the package a closure belongs to by following its environment's
+   enclosures until we reach a namespace. Returns an interned name, or -1. */
+static int get_namespace(struct xrprof_cursor *cursor, RCNTXT *cptr) {
+  SEXPREC fun, env;
+  uintptr_t name;
+
+  if (!(cptr->callflag & CTXT_FUNCTION) || !cursor->globals.registry ||
+      copy_sexp(cursor->pid, (void *) cptr->callfun, &fun) < 0 ||
+      TYPEOF(&fun) != CLOSXP) {
+    return -1;
+  }
+  if (!cursor->namespaces_scanned || cursor->namespaces_next) {
+    scan_namespaces(cursor);
+  }
+
+  void *addr = (void *) CLOENV(&fun);
+  for (int i = 0; i < MAX_ENCLOS_DEPTH && addr; i++) {
+    if ((uintptr_t) addr == cursor->globals.globalenv) {
+      return -1;
+    }
+    if (addrmap_get(cursor->namespaces, (uintptr_t) addr, &name)) {
+      /* Namespaces are enclosed by their imports and then by the base
+         namespace, so arriving there from some imports suggests a namespace
+         loaded since the registry was last read. (Closures defined in base
+         functions arrive there too, but not through imports.) */
+      if (i > 0 && (uintptr_t) addr == cursor->globals.basenamespace &&
+          time(NULL) > cursor->namespaces_scanned &&
+          is_imports_env(cursor, (void *) ATTRIB(&env)) &&
+          scan_namespaces(cursor) != SCAN_PAUSED) {
+        addr = (void *) CLOENV(&fun);
+        i = -1;
+        continue;
+      }
+      return (int) name;
+    }
+    if (copy_sexp(cursor->pid, addr, &env) < 0 || TYPEOF(&env) != ENVSXP) {
+      return -1;
+    }
+    addr = (void *) ENCLOS(&env);
+  }
+
+  return -1;
+}
+
+/* Carry on reading the bindings of the environment being scanned. */
+static int scan_bindings(struct xrprof_cursor *cursor) {
+  int ret = walk_bindings(cursor, (void *) cursor->bindings_env, add_binding,
+                          NULL, &cursor->bindings_bucket);
+  if (ret != SCAN_PAUSED) {
+    cursor->bindings_env = 0;
+  }
+  return ret;
+}
+
+/* Find the name a closure is bound to in the environment it was defined in.
+   Namespaces and the global environment are large and long-lived, so their
+   bindings are read once (and again, now and then, when a closure is missing)
+   and kept; other environments are small and searched directly. */
+static int get_binding_name(struct xrprof_cursor *cursor, void *env,
+                            void *fun, char *buff, size_t len) {
+  uintptr_t sym, scanned;
+
+  /* Until the registry has been read, namespaces can't be told apart from
+     small environments. */
+  if (cursor->globals.registry &&
+      (!cursor->namespaces_scanned || cursor->namespaces_next) &&
+      scan_namespaces(cursor) == SCAN_PAUSED && !cursor->namespaces_scanned) {
+    return SCAN_PAUSED;
+  }
+  if ((uintptr_t) env != cursor->globals.globalenv &&
+      !addrmap_get(cursor->namespaces, (uintptr_t) env, &sym)) {
+    struct binding_search search = {(uintptr_t) fun, NULL, 0};
+    if (walk_bindings(cursor, env, find_binding, &search, NULL) <= 0) {
+      return -1;
+    }
+    return get_symbol_name(cursor, (void *) search.found, buff, len);
+  }
+
+  if (addrmap_get(cursor->bindings, (uintptr_t) fun, &sym)) {
+    return get_symbol_name(cursor, (void *) sym, buff, len);
+  }
+  /* Environments are read one at a time, so finish any other first. */
+  if (cursor->bindings_env && cursor->bindings_env != (uintptr_t) env) {
+    if (scan_bindings(cursor) == SCAN_PAUSED) {
+      return SCAN_PAUSED;
+    }
+    if (addrmap_get(cursor->bindings, (uintptr_t) fun, &sym)) {
+      return get_symbol_name(cursor, (void *) sym, buff, len);
+    }
+  }
+  if (!cursor->bindings_env) {
+    time_t now = time(NULL);
+    if (addrmap_get(cursor->bindings_scanned, (uintptr_t) env, &scanned) &&
+        now < (time_t) scanned + BINDINGS_RESCAN_SECS) {
+      return -1;
+    }
+    addrmap_put(cursor->bindings_scanned, (uintptr_t) env, (uintptr_t) now);
+    cursor->bindings_env = (uintptr_t) env;
+    cursor->bindings_bucket = 0;
+  }
+  if (scan_bindings(cursor) == SCAN_PAUSED) {
+    return SCAN_PAUSED;
+  }
+  if (!addrmap_get(cursor->bindings, (uintptr_t) fun, &sym)) {
+    return -1;
+  }
+  return get_symbol_name(cursor, (void *) sym, buff, len);
+}
+
+/* Map the value of every symbol to the symbol, by reading each one in R's
+   symbol table (a hash table of pairlists). The buckets are read in chunks,
+   and then the nodes at each step of all the lists in batches, and then their
+   symbols. This is slow, so it is only done once, only when the table can be
+   found at all, and a step at a time up to the deadline, carrying on from
+   there in later walks. */
+static int scan_symbol_table(struct xrprof_cursor *cursor) {
+  struct copy_req reqs[MAX_SYMBOL_REQS];
+  SEXPREC node[MAX_SYMBOL_REQS], sym[MAX_SYMBOL_REQS];
+  void *chunk[SYMBOL_CHUNK];
+  int steps = 0;
+
+  if (!cursor->symbol_nodes &&
+      !(cursor->symbol_nodes = malloc(SYMBOL_TABLE_SIZE * sizeof(void *)))) {
+    cursor->symbols_scanned = 1;
+    return -1;
+  }
+  void **nodes = cursor->symbol_nodes;
+
+  while (cursor->symbol_buckets < SYMBOL_TABLE_SIZE) {
+    size_t len = SYMBOL_TABLE_SIZE - cursor->symbol_buckets;
+    if (len > SYMBOL_CHUNK) {
+      len = SYMBOL_CHUNK;
+    }
+    if (steps++ > 0 && past_deadline(cursor)) {
+      return SCAN_PAUSED;
+    }
+    if (copy_address(cursor->pid, (void **) cursor->globals.symtable +
+                     cursor->symbol_buckets, chunk, len * sizeof(void *)) <
+        len * sizeof(void *)) {
+      goto done;
+    }
+    /* Empty buckets (and the ends of lists) are R_NilValue. */
+    for (size_t i = 0; i < len; i++) {
+      if (chunk[i] && (uintptr_t) chunk[i] != cursor->globals.nilvalue) {
+        nodes[cursor->symbol_len++] = chunk[i];
+      }
+    }
+    cursor->symbol_buckets += len;
+  }
+
+  while (cursor->symbol_depth < MAX_BUCKET_LEN && cursor->symbol_len > 0) {
+    size_t i = cursor->symbol_pos, n = cursor->symbol_len;
+    if (i >= n) {
+      cursor->symbol_len = cursor->symbol_next;
+      cursor->symbol_pos = cursor->symbol_next = 0;
+      cursor->symbol_depth++;
+      continue;
+    }
+    if (steps++ > 0 && past_deadline(cursor)) {
+      return SCAN_PAUSED;
+    }
+    int batch = n - i < MAX_SYMBOL_REQS ? n - i : MAX_SYMBOL_REQS, found = 0;
+    cursor->symbol_pos += batch;
+    for (int j = 0; j < batch; j++) {
+      reqs[j].addr = nodes[i + j];
+      reqs[j].data = &node[j];
+      reqs[j].len = sizeof(SEXPREC);
+    }
+    if (copy_addresses(cursor->pid, reqs, batch) < 0) {
+      continue;
+    }
+    /* The read is done, so the next nodes can go in the same array. */
+    for (int j = 0; j < batch; j++) {
+      if (TYPEOF(&node[j]) != LISTSXP || !CAR(&node[j])) {
+        continue;
+      }
+      reqs[found].addr = (void *) CAR(&node[j]);
+      reqs[found].data = &sym[found];
+      reqs[found++].len = sizeof(SEXPREC);
+      if (CDR(&node[j]) &&
+          (uintptr_t) CDR(&node[j]) != cursor->globals.nilvalue) {
+        nodes[cursor->symbol_next++] = (void *) CDR(&node[j]);
+      }
+    }
+    if (found == 0 || copy_addresses(cursor->pid, reqs, found) < 0) {
+      continue;
+    }
+    for (int j = 0; j < found; j++) {
+      if (TYPEOF(&sym[j]) == SYMSXP && SYMVALUE(&sym[j]) &&
+          addrmap_size(cursor->symbols) < MAX_BINDINGS) {
+        addrmap_put(cursor->symbols, (uintptr_t) SYMVALUE(&sym[j]),
+                    (uintptr_t) reqs[j].addr);
+      }
+    }
+  }
+
+done:
+  free(cursor->symbol_nodes);
+  cursor->symbol_nodes = NULL;
+  cursor->symbols_scanned = 1;
+  return 0;
+}
+
+/* Find the name of a base function, which is bound in the value slot of a
+   symbol rather than in an environment. It is usually called by that name, so
+   the call's own symbol is checked first. */
+static int get_base_name(struct xrprof_cursor *cursor, RCNTXT *cptr,
+                         char *buff, size_t len) {
+  SEXPREC call, sym;
+  uintptr_t found;
+
+  if (copy_sexp(cursor->pid, (void *) cptr->call, &call) == 0 &&
+      TYPEOF(&call) == LANGSXP &&
+      copy_sexp(cursor->pid, (void *) CAR(&call), &sym) == 0 &&
+      TYPEOF(&sym) == SYMSXP && SYMVALUE(&sym) == cptr->callfun) {
+    return copy_char(cursor->pid, (void *) PRINTNAME(&sym), buff, len);
+  }
+  if (!cursor->globals.symtable) {
+    return -1;
+  }
+  if (!cursor->symbols_scanned) {
+    scan_symbol_table(cursor);
+  }
+  if (!addrmap_get(cursor->symbols, (uintptr_t) cptr->callfun, &found)) {
+    return -1;
+  }
+  return get_symbol_name(cursor, (void *) found, buff, len);
+}
+
+/* Describe an anonymous closure by where it was defined, from its srcref (when
+   R keeps them), as in "<Anonymous:file.R:12>". */
+static int get_srcref_name(struct xrprof_cursor *cursor, SEXPREC *fun,
+                           char *buff, size_t len) {
+  SEXPREC_ALIGN vec;
+  char path[256];
+  int line;
+
+  void *srcref = (void *) get_attrib(cursor, (void *) ATTRIB(fun), "srcref");
+  if (!srcref || copy_address(cursor->pid, srcref, &vec,
+                              sizeof(SEXPREC_ALIGN)) < sizeof(SEXPREC_ALIGN) ||
+      TYPEOF(&vec.s) != INTSXP || vec.s.vecsxp.length < 1 ||
+      copy_address(cursor->pid, STDVEC_DATAPTR(srcref), &line,
+                   sizeof(int)) < sizeof(int)) {
+    return -1;
+  }
+
+  /* The file name is a string in the srcfile environment. */
+  struct binding_search search = {0, "filename", 0};
+  void *srcfile = (void *) get_attrib(cursor, (void *) vec.s.attrib, "srcfile");
+  void *filename;
+  if (srcfile && walk_bindings(cursor, srcfile, find_binding, &search,
+                               NULL) > 0 &&
+      copy_address(cursor->pid, (void *) search.found, &vec,
+                   sizeof(SEXPREC_ALIGN)) == sizeof(SEXPREC_ALIGN) &&
+      TYPEOF(&vec.s) == STRSXP && vec.s.vecsxp.length > 0 &&
+      copy_address(cursor->pid, STDVEC_DATAPTR(search.found), &filename,
+                   sizeof(void *)) == sizeof(void *) &&
+      copy_char(cursor->pid, filename, path, sizeof(path)) == 0 && path[0]) {
+    const char *base = strrchr(path, '/');
+    snprintf(buff, len, "<Anonymous:%.80s:%d>", base ? base + 1 : path, line);
+  } else {
+    snprintf(buff, len, "<Anonymous:%d>", line);
+  }
+  return 0;
+}
+
+/* Name the closure called in a context by the closure itself rather than the
+   call: by the name it is bound to where it was defined, its srcref, or
+   failing those, a hash of its body. Closures created by evaluating the same
+   function expression share a body, so that last is stable for as long as
+   the code is loaded. Base functions have neither bindings in an environment
+   nor srcrefs, so they fall back on the call instead. Returns an interned
+   name, or -1 to use the call's name. */
+static int get_closure_name(struct xrprof_cursor *cursor, RCNTXT *cptr) {
+  SEXPREC fun;
+  uintptr_t name, body;
+  char buff[MAX_SYM_LEN];
+  int ret;
+
+  if (!(cptr->callflag & CTXT_FUNCTION) ||
+      copy_sexp(cursor->pid, (void *) cptr->callfun, &fun) < 0 ||
+      TYPEOF(&fun) != CLOSXP) {
+    return -1;
+  }
+  if (addrmap_get(cursor->closures, (uintptr_t) cptr->callfun, &name) &&
+      addrmap_get(cursor->closure_bodies, (uintptr_t) cptr->callfun, &body) &&
+      body == (uintptr_t) BODY(&fun)) {
+    return (int) name;
+  }
+
+  if ((uintptr_t) CLOENV(&fun) == cursor->globals.basenamespace) {
+    if (get_base_name(cursor, cptr, buff, sizeof(buff)) < 0) {
+      return -1;
+    }
+  } else if ((ret = get_binding_name(cursor, (void *) CLOENV(&fun),
+                                     (void *) cptr->callfun, buff,
+                                     sizeof(buff))) == SCAN_PAUSED) {
+    /* Use the call for now, rather than keep a worse name. */
+    return -1;
+  } else if (ret < 0 && get_srcref_name(cursor, &fun, buff, sizeof(buff)) < 0) {
+    uint32_t hash = (uint32_t) (((uint64_t) (uintptr_t) BODY(&fun) >> 3) *
+                                0x9E3779B97F4A7C15ULL >> 32);
+    snprintf(buff, sizeof(buff), "<Anonymous:%08x>", hash);
+  }
+  int id = intern_name(cursor, buff);
+
+  if (addrmap_size(cursor->closures) >= MAX_CLOSURES) {
+    addrmap_clear(cursor->closures);
+    addrmap_clear(cursor->closure_bodies);
+  }
+  addrmap_put(cursor->closures, (uintptr_t) cptr->callfun, id);
+  addrmap_put(cursor->closure_bodies, (uintptr_t) cptr->callfun,
+              (uintptr_t) BODY(&fun));
+  return id;
+}
+
+int xrprof_set_tag(struct xrprof_cursor *cursor, const char *var) {
+  const char *sep = strstr(var, "::");
+  const char *name = sep ? sep + 2 : var;
+
+  /* Internal variables ("pkg:::var") live in the namespace, too. */
+  if (sep && *name == ':') {
+    name++;
+  }
+  if (!*name || sep == var || strlen(var) >= MAX_SYM_LEN) {
+    fprintf(stderr, "error: Invalid variable name '%s'.\n", var);
+    return -1;
+  }
+  if (sep ? !cursor->globals.registry : !cursor->globals.globalenv) {
+    fprintf(stderr, "error: Failed to locate the %s.\n",
+            sep ? "namespace registry" : "global environment");
+    return -1;
+  }
+
+  free(cursor->tag_name);
+  free(cursor->tag_package);
+  cursor->tag_name = strdup(name);
+  cursor->tag_package = NULL;
+  if (sep && (cursor->tag_package = malloc(sep - var + 1))) {
+    memcpy(cursor->tag_package, var, sep - var);
+    cursor->tag_package[sep - var] = '\0';
+  }
+  cursor->tag_cell = 0;
+  cursor->tag_searched = 0;
+  cursor->tag_searching = 0;
+  return cursor->tag_name && (!sep || cursor->tag_package) ? 0 : -1;
+}
+
+/* Find the binding of the tag variable. Environments can be large, so while
+   it is missing (perhaps because it has yet to be set) they are only searched
+   again now and then, and a search may stop at the deadline and carry on in
+   later walks. */
+static int find_tag(struct xrprof_cursor *cursor) {
+  SEXPREC cell;
+  int ret;
+
+  if (!cursor->tag_searching) {
+    time_t now = time(NULL);
+    if (now < cursor->tag_searched + BINDINGS_RESCAN_SECS) {
+      return -1;
+    }
+    cursor->tag_searched = now;
+    cursor->tag_searching = 1;
+    cursor->tag_env = cursor->tag_package ? 0 : cursor->globals.globalenv;
+    cursor->tag_bucket = 0;
+  }
+  if (!cursor->tag_env) {
+    struct binding_search search = {0, cursor->tag_package, 0, 0};
+    ret = walk_bindings(cursor, (void *) cursor->globals.registry,
+                        find_binding, &search, &cursor->tag_bucket);
+    if (ret == SCAN_PAUSED) {
+      return -1;
+    }
+    if (ret <= 0) {
+      cursor->tag_searching = 0;
+      return -1;
+    }
+    cursor->tag_env = search.found;
+  }
+
+  struct binding_search search = {0, cursor->tag_name, 0, 0};
+  ret = walk_bindings(cursor, (void *) cursor->tag_env, find_binding, &search,
+                      &cursor->tag_bucket);
+  if (ret == SCAN_PAUSED) {
+    return -1;
+  }
+  cursor->tag_searching = 0;
+  if (ret <= 0 || copy_sexp(cursor->pid, (void *) search.cell, &cell) < 0) {
+    return -1;
+  }
+  cursor->tag_cell = search.cell;
+  cursor->tag_sym = (uintptr_t) TAG(&cell);
+  return 0;
+}
+
+int xrprof_get_tag(struct xrprof_cursor *cursor, char *buff, size_t len) {
+  SEXPREC cell;
+  /* A string's first element comes right after its header, so it can be read
+     along with it, in the space a symbol takes. */
+  union {
+    SEXPREC sym;
+    struct {
+      SEXPREC_ALIGN vec;
+      void *elt;
+    } str;
+  } value;
+  void *chars;
+
+  if (!cursor->tag_name || (!cursor->tag_cell && find_tag(cursor) < 0)) {
+    return 0;
+  }
+  /* Assigning to the variable replaces the value in its binding, which stays
+     put until the variable is removed. */
+  if (copy_sexp(cursor->pid, (void *) cursor->tag_cell, &cell) < 0 ||
+      TYPEOF(&cell) != LISTSXP || (uintptr_t) TAG(&cell) != cursor->tag_sym) {
+    cursor->tag_cell = 0;
+    return 0;
+  }
+  if (copy_address(cursor->pid, (void *) CAR(&cell), &value,
+                   sizeof(value)) < sizeof(value)) {
+    return 0;
+  }
+  if (TYPEOF(&value.sym) == SYMSXP) {
+    chars = (void *) PRINTNAME(&value.sym);
+  } else if (TYPEOF(&value.str.vec.s) == STRSXP &&
+             !ALTREP(&value.str.vec.s) && value.str.vec.s.vecsxp.length > 0) {
+    chars = value.str.elt;
+  } else {
+    return 0;
+  }
+  if (copy_char(cursor->pid, chars, buff, len) < 0) {
+    return 0;
+  }
+  /* Keep the output parseable, whatever the value. Semicolons would split
+     the tag into more than one frame in the folded format. */
+  for (char *c = buff; *c; c++) {
+    if (*c == '"' || *c == ';' || (unsigned char) *c < ' ') {
+      *c = '_';
+    }
+  }
+  return 1;
+}
+
+/* Known layouts of RCNTXT, newest first, as shifts from the one in rdefs.h
+   (used by R 3.5 and 3.6). R 4.0.0 added relpc ahead of prstack and bcprottop
+   ahead of srcref; R 4.4.0 added bcframe ahead of srcref. */
+static const struct {
+  const char *versions;
+  ptrdiff_t prstack;
+  ptrdiff_t srcref;
+} known_layouts[] = {
+  {"4.4 or later", sizeof(void *), 3 * sizeof(void *)},
+  {"4.0 to 4.3", sizeof(void *), 2 * sizeof(void *)},
+  {"3.5 or 3.6", 0, 0}
+};
+
+/* Work out which layout of RCNTXT the tracee uses. The outermost context is
+   always R_Toplevel, and setup_Rmainloop() sets its srcref to R_NilValue,
+   which is unlikely to be found at the wrong offset. Reaching it may take
+   longer than a pause allows, in which case this returns SCAN_PAUSED to try
+   again in a later walk. */
+static int detect_layout(struct xrprof_cursor *cursor, void *context) {
+  void *addr = context, *next = NULL;
+
+  for (int i = 0; i < MAX_STACK_DEPTH && cursor->globals.nilvalue; i++) {
+    if (i > 0 && cursor->layout_tries < MAX_LAYOUT_TRIES &&
+        past_deadline(cursor)) {
+      return SCAN_PAUSED;
+    }
+    if (copy_address(cursor->pid, addr, &next, sizeof(void *)) < sizeof(void *)) {
+      break;
+    }
+    if (!next) {
+      break;
+    }
+    addr = next;
+  }
+
+  for (int i = 0; !next && cursor->globals.nilvalue &&
+         i < sizeof(known_layouts) / sizeof(known_layouts[0]); i++) {
+    uintptr_t srcref;
+    copy_context_layout(&cursor->layout, known_layouts[i].prstack,
+                        known_layouts[i].srcref);
+    if (copy_address(cursor->pid, (char *) addr + cursor->layout.srcref,
+                     &srcref, sizeof(uintptr_t)) == sizeof(uintptr_t) &&
+        srcref == cursor->globals.nilvalue) {
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "warning: Unrecognized R context layout. Is this a supported version of R?\n");
+  copy_context_layout(&cursor->layout, 0, 0);
+  return 0;
+}
+
+static struct xrprof_frame *push_frame(struct xrprof_stack *stack) {
+  if (stack->len == stack->cap) {
+    int cap = stack->cap ? 2 * stack->cap : 64;
+    struct xrprof_frame *frames = realloc(stack->frames,
+                                          cap * sizeof(struct xrprof_frame));
+    if (!frames) {
+      return NULL;
+    }
+    stack->frames = frames;
+    stack->cap = cap;
+  }
+  return &stack->frames[stack->len++];
+}
+
+/* Stand in for the frames left out of a walk that was cut short. */
+static int push_truncated(struct xrprof_cursor *cursor) {
+  struct xrprof_frame *frame = push_frame(&cursor->stack);
+  if (!frame) {
+    return -1;
+  }
+  frame->addr = NULL;
+  frame->nextcontext = NULL;
+  frame->call = NULL;
+  frame->cloenv = NULL;
+  frame->evaldepth = 0;
+  frame->name = intern_name(cursor, TRUNCATED_NAME);
+  cursor->truncated = 1;
+  return 1;
+}
+
+/* Add frames for the promises in the RPRSTACK starting with the (already read)
+   entry at prstack that are not also pending in the context just read into
+   cursor->cptr, i.e. those that were forced between the two contexts. */
+static int push_promises(struct xrprof_cursor *cursor, void *prstack,
+                         RPRSTACK *entry) {
+  char name[MAX_SYM_LEN], buff[MAX_SYM_LEN + 16];
+  void *end = (void *) cursor->cptr->prstack;
+
+  for (int i = 0; i < MAX_PROMISE_DEPTH && prstack && prstack != end; i++) {
+    if (get_promise_name(cursor, cursor->cptr, (void *) entry->promise, name,
+                         MAX_SYM_LEN) < 0) {
+      snprintf(buff, sizeof(buff), "<Promise>");
+    } else {
+      snprintf(buff, sizeof(buff), "<Promise:%s>", name);
+    }
+
+    struct xrprof_frame *frame = push_frame(&cursor->stack);
+    if (!frame) {
+      return -1;
+    }
+    frame->addr = NULL;
+    frame->nextcontext = NULL;
+    frame->call = NULL;
+    frame->cloenv = NULL;
+    frame->evaldepth = 0;
+    frame->name = intern_name(cursor, buff);
+
+    prstack = (void *) entry->next;
+    if (prstack && prstack != end &&
+        copy_address(cursor->pid, prstack, entry, sizeof(RPRSTACK)) < sizeof(RPRSTACK)) {
+      return -2;
+    }
+  }
+  return 0;
+}
+
 int xrprof_init(struct xrprof_cursor *cursor) {
-  uintptr_t context_ptr;
-  ssize_t bytes = copy_address(cursor->pid, (void *)cursor->globals.context_addr,
-                               &context_ptr, sizeof(uintptr_t));
-  if (bytes < sizeof(uintptr_t)) {
-    /* copy_address() will have already printed an error. */
+  uintptr_t context_ptr, pending = 0;
+  /* Promises being forced since the innermost context began are only pending
+     in R itself, so the head of that stack is read along with the context. */
+  struct copy_req globals[] = {
+    {(void *) cursor->globals.context_addr, &context_ptr, sizeof(uintptr_t)},
+    {(void *) cursor->globals.pendingpromises, &pending, sizeof(uintptr_t)}
+  };
+  if (copy_addresses(cursor->pid, globals,
+                     cursor->flags & XRPROF_PROMISES &&
+                     cursor->globals.pendingpromises ? 2 : 1) < 0) {
+    /* copy_addresses() will have already printed an error. */
     return -1;
   }
 
-  cursor->rcxt_ptr = (void *) context_ptr;
-  cursor->depth = 0;
+  /* The last walk becomes the one we compare against. */
+  struct xrprof_stack tmp = cursor->prev;
+  cursor->prev = cursor->stack;
+  cursor->stack = tmp;
+  cursor->stack.len = 0;
+  cursor->pos = 0;
 
-  int ret = copy_context(cursor->pid, (void *) context_ptr, cursor->cptr);
-  if (ret < 0) {
+  void *addr = (void *) context_ptr;
+  if (!cursor->have_layout && addr) {
+    if (detect_layout(cursor, addr) == SCAN_PAUSED) {
+      cursor->layout_tries++;
+      return push_truncated(cursor);
+    }
+    cursor->have_layout = 1;
+  }
+
+  int ret;
+  if (pending && addr) {
+    RPRSTACK entry;
+    struct copy_req reqs[MAX_CONTEXT_REQS + 1];
+    int n = copy_context_reqs(addr, &cursor->layout, cursor->cptr, reqs);
+    reqs[n].addr = (void *) pending;
+    reqs[n].data = &entry;
+    reqs[n].len = sizeof(RPRSTACK);
+    if (copy_addresses(cursor->pid, reqs, n + 1) < 0) {
+      return -2;
+    }
+    if ((ret = push_promises(cursor, (void *) pending, &entry)) < 0) {
+      return ret;
+    }
+  } else if ((ret = copy_context(cursor->pid, addr, &cursor->layout,
+                                 cursor->cptr)) < 0) {
     return ret;
   }
 
+  char buff[256];
+  struct xrprof_frame *prev = cursor->prev.frames, *frame;
+  int prev_len = cursor->prev.len, k = 0, pushed = cursor->stack.len;
+
+  /* A truncated walk is missing the outermost frames, so it can't be reused. */
+  if (cursor->truncated) {
+    prev_len = 0;
+    cursor->truncated = 0;
+  }
+
+  while (cursor->stack.len < MAX_STACK_DEPTH) {
+    RCNTXT *cptr = cursor->cptr;
+
+    /* Contexts live on the C stack, so they are in address order. Any
+       previous ones below this address have since been popped. */
+    while (k < prev_len && (!prev[k].addr || prev[k].addr < addr)) {
+      k++;
+    }
+
+    /* Once a context is unchanged, so is the rest of the stack above it. */
+    if (k < prev_len && prev[k].addr == addr &&
+        prev[k].nextcontext == (void *) cptr->nextcontext &&
+        prev[k].call == (void *) cptr->call &&
+        prev[k].cloenv == (void *) cptr->cloenv &&
+        prev[k].evaldepth == cptr->evaldepth) {
+      for (; k < prev_len; k++) {
+        if (!(frame = push_frame(&cursor->stack))) {
+          return -1;
+        }
+        *frame = prev[k];
+      }
+      break;
+    }
+
+    /* Give up on the rest of the stack rather than go over the deadline. */
+    if (cursor->stack.len > pushed && past_deadline(cursor)) {
+      return push_truncated(cursor);
+    }
+
+    if ((ret = get_call_name(cursor, cptr, buff, sizeof(buff))) < 0) {
+      return ret;
+    }
+    int name = ret == 0 ? -1 : intern_name(cursor, buff), ns, closure;
+    if (cursor->flags & XRPROF_CLOSURES && ret > 0 &&
+        (closure = get_closure_name(cursor, cptr)) >= 0) {
+      name = closure;
+      snprintf(buff, sizeof(buff), "%s", intern_lookup(cursor->names, name));
+    }
+    if (cursor->flags & XRPROF_NAMESPACES && ret > 0 && !strstr(buff, "::") &&
+        (ns = get_namespace(cursor, cptr)) >= 0) {
+      /* Stay within the length of unqualified names. */
+      char qualified[sizeof(buff)];
+      snprintf(qualified, sizeof(qualified), "%.100s::%.150s",
+               intern_lookup(cursor->names, ns), buff);
+      name = intern_name(cursor, qualified);
+    }
+    if (!(frame = push_frame(&cursor->stack))) {
+      return -1;
+    }
+    frame->addr = addr;
+    frame->nextcontext = (void *) cptr->nextcontext;
+    frame->call = (void *) cptr->call;
+    frame->cloenv = (void *) cptr->cloenv;
+    frame->evaldepth = cptr->evaldepth;
+    frame->name = name;
+
+    /* We're at the top level. */
+    if (cptr->callflag == CTXT_TOPLEVEL) {
+      break;
+    }
+
+    addr = (void *) cptr->nextcontext;
+
+    /* Promises pending in this context but not the next one were forced in
+       between, so the next context and the first of them are read together. */
+    void *prstack = (void *) cptr->prstack;
+    if (cursor->flags & XRPROF_PROMISES && prstack) {
+      RPRSTACK entry;
+      struct copy_req reqs[MAX_CONTEXT_REQS + 1];
+      int n = copy_context_reqs(addr, &cursor->layout, cursor->cptr, reqs);
+      reqs[n].addr = prstack;
+      reqs[n].data = &entry;
+      reqs[n].len = sizeof(RPRSTACK);
+      if (!addr || copy_addresses(cursor->pid, reqs, n + 1) < 0) {
+        return -2;
+      }
+      if ((ret = push_promises(cursor, prstack, &entry)) < 0) {
+        return ret;
+      }
+    } else if ((ret = copy_context(cursor->pid, addr, &cursor->layout,
+                                   cursor->cptr)) < 0) {
+      return ret;
+    }
+  }
+
   return 0;
 }
 
-int xrprof_step(struct xrprof_cursor *cursor) {
-  if (!cursor || !cursor->cptr) {
+int xrprof_get_fun_name(struct xrprof_cursor *cursor, char *buff, size_t len) {
+  if (!cursor || cursor->pos >= cursor->stack.len) {
     return -1;
   }
 
+  int name = cursor->stack.frames[cursor->pos].name;
+
   /* We're at the top level. */
-  if (cursor->cptr->callflag == CTXT_TOPLEVEL) {
+  if (name < 0) {
     return 0;
   }
 
-  cursor->rcxt_ptr = cursor->cptr->nextcontext;
-  cursor->depth++;
-
-  copy_context(cursor->pid, cursor->rcxt_ptr, cursor->cptr);
-  if (!cursor->cptr) {
+  /* Function name may be too long for the buffer. */
+  if (snprintf(buff, len, "%s", intern_lookup(cursor->names, name)) >= len) {
     return -2;
   }
 
-  return cursor->depth;
+  return 1;
+}
+
+int xrprof_get_fun_id(struct xrprof_cursor *cursor, int *id) {
+  if (!cursor || cursor->pos >= cursor->stack.len) {
+    return -1;
+  }
+
+  *id = cursor->stack.frames[cursor->pos].name;
+
+  /* We're at the top level. */
+  return *id < 0 ? 0 : 1;
+}
+
+const char *xrprof_lookup_name(struct xrprof_cursor *cursor, int id) {
+  return intern_lookup(cursor->names, id);
+}
+
+uintptr_t xrprof_get_frame_addr(struct xrprof_cursor *cursor) {
+  if (!cursor || cursor->pos >= cursor->stack.len) {
+    return 0;
+  }
+  for (int i = cursor->pos; i >= 0; i--) {
+    if (cursor->stack.frames[i].addr) {
+      return (uintptr_t) cursor->stack.frames[i].addr;
+    }
+  }
+  return 0;
+}
+
+int xrprof_get_call_id(struct xrprof_cursor *cursor,
+                       struct xrprof_call_id *out) {
+  if (!cursor || cursor->pos >= cursor->stack.len) {
+    return -1;
+  }
+  struct xrprof_frame *frame = &cursor->stack.frames[cursor->pos];
+  if (!frame->addr || frame->name < 0) {
+    return 0;
+  }
+  out->addr = (uintptr_t) frame->addr;
+  out->call = (uintptr_t) frame->call;
+  out->cloenv = (uintptr_t) frame->cloenv;
+  out->evaldepth = frame->evaldepth;
+  return 1;
+}
+
+int xrprof_step(struct xrprof_cursor *cursor) {
+  if (!cursor) {
+    return -1;
+  }
+
+  if (cursor->pos + 1 >= cursor->stack.len) {
+    return 0;
+  }
+
+  cursor->pos++;
+  return cursor->pos;
 }
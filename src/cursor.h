@@ -1,15 +1,63 @@
 #ifndef XRPROF_CURSOR_H
 #define XRPROF_CURSOR_H
 
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uintptr_t */
+#include <time.h>   /* for timespec */
 #include "process.h"
 
+/* Flags for xrprof_create(). */
+#define XRPROF_PROMISES 0x01 /* Emit frames for promises being forced. */
+#define XRPROF_NAMESPACES 0x02 /* Prefix functions with their package. */
+#define XRPROF_CLOSURES 0x04 /* Name closures by their binding or srcref,
+                                rather than by how they were called. */
+
 struct xrprof_cursor;
 
-struct xrprof_cursor *xrprof_create(phandle pid);
+struct xrprof_cursor *xrprof_create(phandle pid, int flags);
 void xrprof_destroy(struct xrprof_cursor *cursor);
+/* Walk the R stack. Returns 1 if the walk ran past the deadline (if any) and
+   was cut short with a "<Truncated>" frame, 0 if it was not, and a negative
+   value on error. */
 int xrprof_init(struct xrprof_cursor *cursor);
+/* Set a deadline (on CLOCK_MONOTONIC) for walks, or clear it with NULL. */
+void xrprof_set_deadline(struct xrprof_cursor *cursor,
+                         const struct timespec *deadline);
 
 int xrprof_get_fun_name(struct xrprof_cursor *cursor, char *buff, size_t len);
 int xrprof_step(struct xrprof_cursor *cursor);
 
+/* Like xrprof_get_fun_name(), but returns a stable integer ID for the name
+   instead. IDs can be turned back into names with xrprof_lookup_name(). */
+int xrprof_get_fun_id(struct xrprof_cursor *cursor, int *id);
+const char *xrprof_lookup_name(struct xrprof_cursor *cursor, int id);
+
+/* The address of the context behind the current frame, which shows where it
+   lives on the native stack. Promises report the context that forced them. */
+uintptr_t xrprof_get_frame_addr(struct xrprof_cursor *cursor);
+
+/* What identifies a live R call: its context, evaluation depth, call, and
+   environment are the same in every sample it appears in, and (almost
+   certainly) differ from those of any later call. */
+struct xrprof_call_id {
+  uintptr_t addr;
+  uintptr_t call;
+  uintptr_t cloenv;
+  int evaldepth;
+};
+
+/* Get the identity of the call behind the current frame. Returns zero for
+   frames that aren't calls, such as promises and the top level. */
+int xrprof_get_call_id(struct xrprof_cursor *cursor,
+                       struct xrprof_call_id *out);
+
+/* Tag samples with the value of a variable, such as the endpoint or tenant a
+   request is for: "var" in the global environment, or "pkg::var" in a
+   namespace. The variable should hold a string (whose first element is used)
+   or a symbol. */
+int xrprof_set_tag(struct xrprof_cursor *cursor, const char *var);
+/* Read the tag's current value into buff. Returns zero when the variable is
+   not set to a string or symbol. */
+int xrprof_get_tag(struct xrprof_cursor *cursor, char *buff, size_t len);
+
 #endif /* XRPROF_CURSOR_H */
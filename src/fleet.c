@@ -0,0 +1,338 @@
+#ifdef __linux
+#define _GNU_SOURCE     /* for ppoll, __WALL */
+#endif
+
+#include <stdio.h>      /* for fprintf */
+#include <stdlib.h>     /* for calloc, free, strtoull */
+
+#include "fleet.h"
+
+#ifdef __linux
+#include <dirent.h>     /* for opendir, readdir */
+#include <errno.h>      /* for errno, EINTR */
+#include <fcntl.h>      /* for open */
+#include <poll.h>       /* for ppoll */
+#include <string.h>     /* for strchr, strcmp, strdup, strncmp, strrchr, strstr */
+#include <sys/epoll.h>
+#include <sys/syscall.h> /* for SYS_pidfd_open */
+#include <sys/wait.h>   /* for waitpid */
+#include <unistd.h>     /* for read, close, getpid, syscall */
+
+#include "addrmap.h"
+#include "memory.h"
+
+#define MAX_EVENTS 64
+
+struct fleet {
+  char *name;
+  char *cgroup;
+  int flags;
+  char *tag;
+  struct fleet_tracee *tracees;
+  size_t len;
+  size_t cap;
+  /* Processes already considered, so that they are not looked at again, with
+     their start times (plus one). */
+  struct addr_map *seen;
+  int epfd;
+};
+
+/* A pidfd becomes readable when its process exits, which lets us wait for
+   hundreds of processes at once (rather than finding out on the next sample). */
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Read a small file from /proc/<pid>/, NUL-terminated. */
+static ssize_t read_proc_file(pid_t pid, const char *name, char *buff,
+                              size_t len) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t bytes = read(fd, buff, len - 1);
+  close(fd);
+  if (bytes < 0) {
+    return -1;
+  }
+  buff[bytes] = '\0';
+  return bytes;
+}
+
+/* When a process started, in clock ticks since boot, which tells apart the
+   processes that reuse a pid. Returns zero if it can't be read. */
+static unsigned long long start_time(pid_t pid) {
+  char buff[1024];
+  if (read_proc_file(pid, "stat", buff, sizeof(buff)) <= 0) {
+    return 0;
+  }
+  /* This is the 22nd field, counted from the end of the command name (the
+     2nd), which may itself contain spaces. */
+  char *p = strrchr(buff, ')');
+  for (int field = 2; p && field < 22; field++) {
+    p = strchr(p + 1, ' ');
+  }
+  return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+static int maps_libR(pid_t pid) {
+  char path[64], line[1024];
+  int found = 0;
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  while (!found && fgets(line, sizeof(line), file)) {
+    found = strstr(line, "libR.so") != NULL;
+  }
+  fclose(file);
+  return found;
+}
+
+static int fleet_matches(struct fleet *fleet, pid_t pid) {
+  char buff[4096];
+  if (fleet->name) {
+    if (read_proc_file(pid, "comm", buff, sizeof(buff)) <= 0) {
+      return 0;
+    }
+    buff[strcspn(buff, "\n")] = '\0';
+    return strcmp(buff, fleet->name) == 0;
+  }
+  if (fleet->cgroup && (read_proc_file(pid, "cgroup", buff, sizeof(buff)) <= 0 ||
+                        !strstr(buff, fleet->cgroup))) {
+    return 0;
+  }
+  return maps_libR(pid);
+}
+
+struct fleet *fleet_create(const char *filter, int flags, const char *tag) {
+  struct fleet *out = calloc(1, sizeof(struct fleet));
+  if (!out) {
+    return NULL;
+  }
+  out->flags = flags;
+  out->epfd = -1;
+  if (tag && !(out->tag = strdup(tag))) {
+    fleet_destroy(out);
+    return NULL;
+  }
+  if (filter && strncmp(filter, "name=", 5) == 0 && filter[5]) {
+    out->name = strdup(filter + 5);
+  } else if (filter && strncmp(filter, "cgroup=", 7) == 0 && filter[7]) {
+    out->cgroup = strdup(filter + 7);
+  } else if (filter) {
+    fprintf(stderr, "error: Invalid process filter '%s'.\n", filter);
+    fleet_destroy(out);
+    return NULL;
+  }
+  if (!(out->seen = addrmap_create())) {
+    fleet_destroy(out);
+    return NULL;
+  }
+  if ((out->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("error: Failed to create epoll instance");
+    fleet_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+static int fleet_attach(struct fleet *fleet, pid_t pid) {
+  phandle proc;
+  if (proc_create(&proc, (void *) &pid) < 0) {
+    return -1;
+  }
+  struct xrprof_cursor *cursor = xrprof_create(proc, fleet->flags);
+  if (cursor && fleet->tag && xrprof_set_tag(cursor, fleet->tag) < 0) {
+    xrprof_destroy(cursor);
+    cursor = NULL;
+  }
+  if (!cursor) {
+    fprintf(stderr, "warning: Skipping process %d.\n", pid);
+    proc_destroy(proc);
+    return -1;
+  }
+
+  if (fleet->len == fleet->cap) {
+    size_t cap = fleet->cap ? 2 * fleet->cap : 16;
+    struct fleet_tracee *tracees = realloc(fleet->tracees,
+                                           cap * sizeof(struct fleet_tracee));
+    if (!tracees) {
+      xrprof_destroy(cursor);
+      proc_destroy(proc);
+      return -1;
+    }
+    fleet->tracees = tracees;
+    fleet->cap = cap;
+  }
+
+  struct fleet_tracee *tracee = &fleet->tracees[fleet->len++];
+  tracee->pid = proc;
+  tracee->drop = 0;
+  tracee->cursor = cursor;
+  /* Older kernels don't have pidfds; exits are still noticed when the process
+     can't be suspended. */
+  if ((tracee->pidfd = open_pidfd(pid)) >= 0) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = pid;
+    if (epoll_ctl(fleet->epfd, EPOLL_CTL_ADD, tracee->pidfd, &event) < 0) {
+      close(tracee->pidfd);
+      tracee->pidfd = -1;
+    }
+  }
+  fprintf(stderr, "Profiling process %d.\n", pid);
+  return 0;
+}
+
+static void fleet_detach(struct fleet *fleet, size_t i) {
+  struct fleet_tracee *tracee = &fleet->tracees[i];
+  int wstatus;
+
+  if (tracee->pidfd >= 0) {
+    epoll_ctl(fleet->epfd, EPOLL_CTL_DEL, tracee->pidfd, NULL);
+    close(tracee->pidfd);
+  }
+
+  /* Collect the exit status if it has exited. Otherwise it must be stopped
+     before we can detach. */
+  pid_t ret = waitpid(tracee->pid, &wstatus, WNOHANG | __WALL);
+  if (ret == 0) {
+    if (proc_suspend(tracee->pid) == 0) {
+      proc_destroy(tracee->pid);
+    }
+  } else if (ret > 0 && WIFSTOPPED(wstatus)) {
+    proc_destroy(tracee->pid);
+  }
+
+  xrprof_destroy(tracee->cursor);
+  copy_release(tracee->pid);
+  fleet->tracees[i] = fleet->tracees[--fleet->len];
+}
+
+void fleet_destroy(struct fleet *fleet) {
+  if (!fleet) {
+    return;
+  }
+  while (fleet->len > 0) {
+    fleet_detach(fleet, fleet->len - 1);
+  }
+  if (fleet->epfd >= 0) {
+    close(fleet->epfd);
+  }
+  addrmap_destroy(fleet->seen);
+  free(fleet->tracees);
+  free(fleet->name);
+  free(fleet->cgroup);
+  free(fleet->tag);
+  return free(fleet);
+}
+
+int fleet_scan(struct fleet *fleet) {
+  DIR *dir = opendir("/proc");
+  if (!dir) {
+    perror("error: Cannot open /proc");
+    return -1;
+  }
+
+  /* Only processes that still exist are carried over, so that the map doesn't
+     grow without bound. New processes that reuse an old pid before then are
+     told apart by their start time. */
+  struct addr_map *seen = addrmap_create();
+  if (!seen) {
+    closedir(dir);
+    return -1;
+  }
+
+  struct dirent *entry;
+  pid_t self = getpid();
+  int added = 0;
+  while ((entry = readdir(dir))) {
+    char *end;
+    long pid = strtol(entry->d_name, &end, 10);
+    uintptr_t value = 0, start;
+    if (*end != '\0' || pid <= 0 || pid == self) {
+      continue;
+    }
+    start = (uintptr_t) start_time(pid) + 1;
+    if (!addrmap_get(fleet->seen, (uintptr_t) pid, &value) || value != start) {
+      added += fleet_matches(fleet, pid) && fleet_attach(fleet, pid) == 0;
+    }
+    addrmap_put(seen, (uintptr_t) pid, start);
+  }
+  closedir(dir);
+
+  addrmap_destroy(fleet->seen);
+  fleet->seen = seen;
+  return added;
+}
+
+size_t fleet_size(struct fleet *fleet) {
+  return fleet->len;
+}
+
+struct fleet_tracee *fleet_get(struct fleet *fleet, size_t i) {
+  return i < fleet->len ? &fleet->tracees[i] : NULL;
+}
+
+int fleet_wait(struct fleet *fleet, const struct timespec *timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  struct pollfd pfd = {fleet->epfd, POLLIN, 0};
+
+  /* Unlike epoll_wait(), ppoll() (on the epoll instance) takes a timeout with
+     better than millisecond resolution. */
+  if (ppoll(&pfd, 1, timeout, NULL) < 0) {
+    return errno == EINTR ? -1 : 0;
+  }
+
+  int n = epoll_wait(fleet->epfd, events, MAX_EVENTS, 0);
+  for (int i = 0; i < n; i++) {
+    for (size_t j = 0; j < fleet->len; j++) {
+      if (fleet->tracees[j].pid == (pid_t) events[i].data.u64) {
+        fprintf(stderr, "Process %d finished.\n", fleet->tracees[j].pid);
+        fleet->tracees[j].drop = 1;
+        break;
+      }
+    }
+  }
+
+  for (size_t j = fleet->len; j > 0; j--) {
+    if (fleet->tracees[j - 1].drop) {
+      fleet_detach(fleet, j - 1);
+    }
+  }
+  return 0;
+}
+#else
+struct fleet *fleet_create(const char *filter, int flags, const char *tag) {
+  fprintf(stderr, "error: Profiling many processes is not supported on this platform.\n");
+  return NULL;
+}
+
+void fleet_destroy(struct fleet *fleet) {
+  return;
+}
+
+int fleet_scan(struct fleet *fleet) {
+  return -1;
+}
+
+size_t fleet_size(struct fleet *fleet) {
+  return 0;
+}
+
+struct fleet_tracee *fleet_get(struct fleet *fleet, size_t i) {
+  return NULL;
+}
+
+int fleet_wait(struct fleet *fleet, const struct timespec *timeout) {
+  return -1;
+}
+#endif
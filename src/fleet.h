@@ -0,0 +1,38 @@
+#ifndef XRPROF_FLEET_H
+#define XRPROF_FLEET_H
+
+#include <stddef.h> /* for size_t */
+#include <time.h>   /* for timespec */
+#include "cursor.h"
+#include "process.h"
+
+/* How often (in seconds) to look for new processes. */
+#define FLEET_SCAN_INTERVAL 2
+
+/* A process being profiled as part of a fleet. */
+struct fleet_tracee {
+  phandle pid;
+  int pidfd;            /* For noticing when it exits; -1 if unsupported. */
+  int drop;             /* Set to stop tracing it at the next fleet_wait(). */
+  struct xrprof_cursor *cursor;
+};
+
+/* All of the R processes on a host, or those matching a filter. */
+struct fleet;
+
+/* The filter is NULL (any process using libR.so), "name=NAME" (processes whose
+   command name is exactly NAME), or "cgroup=STR" (processes using libR.so in
+   a cgroup whose path contains STR). Flags are passed to xrprof_create(), and
+   the tag variable (if not NULL) to xrprof_set_tag(). */
+struct fleet *fleet_create(const char *filter, int flags, const char *tag);
+void fleet_destroy(struct fleet *fleet);
+/* Look for new matching processes and attach to them. Returns the number
+   added, or a negative value on error. */
+int fleet_scan(struct fleet *fleet);
+size_t fleet_size(struct fleet *fleet);
+struct fleet_tracee *fleet_get(struct fleet *fleet, size_t i);
+/* Sleep for up to timeout, detaching from tracees that exit (or have been
+   dropped) in the meantime. Returns a negative value if interrupted. */
+int fleet_wait(struct fleet *fleet, const struct timespec *timeout);
+
+#endif /* XRPROF_FLEET_H */
@@ -0,0 +1,182 @@
+#include <stdint.h>     /* for uint32_t */
+#include <stdlib.h>     /* for calloc, malloc, realloc, free */
+
+#include "flight.h"
+#include "intern.h"
+
+/* Room for samples this deep on average. Deeper samples shorten the window. */
+#define FLIGHT_AVG_DEPTH 64
+#define MAX_SAMPLE_DEPTH 16384
+/* Names no longer in the ring are dropped once there are at least this many,
+   and then whenever their number doubles. */
+#define MIN_COMPACT_NAMES 4096
+
+/* Samples are stored back to back in a ring of frame IDs, each preceded by its
+   length, so that the oldest can be evicted when a new one doesn't fit. */
+struct flight_recorder {
+  struct intern_table *names;
+  size_t compact_at;
+  uint32_t *words;
+  size_t nwords;
+  size_t head;          /* The oldest sample. */
+  size_t used;          /* Words in use, starting at head. */
+  size_t samples;
+  size_t max_samples;
+  /* The sample being added. */
+  uint32_t *current;
+  size_t current_len;
+  size_t current_cap;
+};
+
+struct flight_recorder *flight_create(size_t max_samples) {
+  struct flight_recorder *out = calloc(1, sizeof(struct flight_recorder));
+  if (!out) {
+    return NULL;
+  }
+  out->max_samples = max_samples;
+  out->compact_at = MIN_COMPACT_NAMES;
+  out->nwords = max_samples * (FLIGHT_AVG_DEPTH + 1);
+  out->words = malloc(out->nwords * sizeof(uint32_t));
+  out->names = intern_create();
+  if (!out->words || !out->names) {
+    flight_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void flight_destroy(struct flight_recorder *flight) {
+  if (!flight) {
+    return;
+  }
+  intern_destroy(flight->names);
+  free(flight->words);
+  free(flight->current);
+  return free(flight);
+}
+
+int flight_add_frame(struct flight_recorder *flight, const char *name) {
+  if (flight->current_len >= MAX_SAMPLE_DEPTH) {
+    return -1;
+  }
+  if (flight->current_len == flight->current_cap) {
+    size_t cap = flight->current_cap ? 2 * flight->current_cap : 256;
+    uint32_t *current = realloc(flight->current, cap * sizeof(uint32_t));
+    if (!current) {
+      return -1;
+    }
+    flight->current = current;
+    flight->current_cap = cap;
+  }
+  int id = intern_string(flight->names, name);
+  if (id < 0) {
+    return -1;
+  }
+  flight->current[flight->current_len++] = id;
+  return 0;
+}
+
+static void flight_evict(struct flight_recorder *flight) {
+  size_t len = flight->words[flight->head] + 1;
+  flight->head = (flight->head + len) % flight->nwords;
+  flight->used -= len;
+  flight->samples--;
+}
+
+/* Replace the names with only those still referenced by samples in the ring,
+   renumbering them, so that their number stays proportional to the
+   size of the ring however long this runs. */
+static void flight_compact(struct flight_recorder *flight) {
+  size_t nnames = intern_size(flight->names);
+  struct intern_table *names = intern_create();
+  int *ids = malloc(nnames * sizeof(int));
+  if (!names || !ids) {
+    intern_destroy(names);
+    free(ids);
+    return;
+  }
+  for (size_t i = 0; i < nnames; i++) {
+    ids[i] = -1;
+  }
+
+  /* Intern the names still in use first, so that running out of memory part
+     of the way through leaves the ring as it was. */
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < flight->used; i++) {
+      size_t pos = (flight->head + i) % flight->nwords;
+      size_t len = flight->words[pos];
+      for (size_t j = 0; j < len; j++) {
+        uint32_t *word = &flight->words[(pos + 1 + j) % flight->nwords];
+        if (pass == 1) {
+          *word = ids[*word];
+        } else if (ids[*word] < 0) {
+          ids[*word] = intern_string(names,
+                                     intern_lookup(flight->names, *word));
+          if (ids[*word] < 0) {
+            intern_destroy(names);
+            free(ids);
+            return;
+          }
+        }
+      }
+      i += len;
+    }
+  }
+
+  intern_destroy(flight->names);
+  flight->names = names;
+  free(ids);
+  flight->compact_at = 2 * intern_size(names);
+  if (flight->compact_at < MIN_COMPACT_NAMES) {
+    flight->compact_at = MIN_COMPACT_NAMES;
+  }
+}
+
+int flight_end_sample(struct flight_recorder *flight) {
+  size_t len = flight->current_len;
+  flight->current_len = 0;
+  /* Keep the innermost frames of samples too deep for the whole ring. */
+  if (len + 1 > flight->nwords) {
+    len = flight->nwords - 1;
+  }
+
+  while (flight->samples > 0 && (flight->samples >= flight->max_samples ||
+                                 flight->used + len + 1 > flight->nwords)) {
+    flight_evict(flight);
+  }
+
+  size_t tail = (flight->head + flight->used) % flight->nwords;
+  flight->words[tail] = len;
+  for (size_t i = 0; i < len; i++) {
+    flight->words[(tail + 1 + i) % flight->nwords] = flight->current[i];
+  }
+  flight->used += len + 1;
+  flight->samples++;
+  return 0;
+}
+
+void flight_tick(struct flight_recorder *flight) {
+  if (intern_size(flight->names) >= flight->compact_at) {
+    flight_compact(flight);
+  }
+}
+
+size_t flight_size(struct flight_recorder *flight) {
+  return flight->samples;
+}
+
+int flight_dump(struct flight_recorder *flight, struct output *out) {
+  size_t pos = flight->head;
+  for (size_t i = 0; i < flight->samples; i++) {
+    size_t len = flight->words[pos];
+    for (size_t j = 0; j < len; j++) {
+      int id = flight->words[(pos + 1 + j) % flight->nwords];
+      output_printf(out, "\"%s\" ", intern_lookup(flight->names, id));
+    }
+    if (output_write(out, "\n", 1) < 0) {
+      return -1;
+    }
+    pos = (pos + len + 1) % flight->nwords;
+  }
+  return 0;
+}
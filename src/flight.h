@@ -0,0 +1,25 @@
+#ifndef XRPROF_FLIGHT_H
+#define XRPROF_FLIGHT_H
+
+#include <stddef.h> /* for size_t */
+#include "output.h"
+
+/* A "flight recorder" that keeps the most recent samples in a fixed-size ring
+   in memory, so that they can be written out after the fact. */
+struct flight_recorder;
+
+struct flight_recorder *flight_create(size_t max_samples);
+void flight_destroy(struct flight_recorder *flight);
+/* Add a frame to the current sample, innermost first. */
+int flight_add_frame(struct flight_recorder *flight, const char *name);
+/* Finish the current sample, evicting the oldest ones to make room. */
+int flight_end_sample(struct flight_recorder *flight);
+/* Drop names no longer in the ring once enough have built up. This reads the
+   whole ring, so it belongs between samples rather than while the tracee is
+   stopped. */
+void flight_tick(struct flight_recorder *flight);
+size_t flight_size(struct flight_recorder *flight);
+/* Write the recorded samples out, oldest first, in the Rprof.out format. */
+int flight_dump(struct flight_recorder *flight, struct output *out);
+
+#endif /* XRPROF_FLIGHT_H */
@@ -0,0 +1,392 @@
+#include <stdint.h>     /* for uint64_t */
+#include <stdlib.h>     /* for calloc, malloc, realloc, free, qsort */
+#include <string.h>     /* for memcpy, strcmp, strlen */
+
+#include "heavy.h"
+#include "intern.h"
+
+#define MAX_SAMPLE_DEPTH 16384
+/* Longer stacks lose their outermost frames. */
+#define MAX_STACK_LEN 4096
+#define TRUNCATED_PREFIX "<Truncated>;"
+/* Functions beyond the first MAX_FUNCTIONS are all counted as one. */
+#define MAX_FUNCTIONS 65536
+#define OTHER_NAME "<Other>"
+
+/* A stack being counted. Its count is at most error more than its true
+   count, since it may have taken over a slot from other stacks. */
+struct heavy_slot {
+  uint64_t hash;
+  unsigned long count;
+  unsigned long error;
+  size_t pos;           /* Its position in the heap. */
+  char *stack;          /* Folded, outermost first. */
+};
+
+struct heavy_table {
+  struct heavy_slot *slots;
+  size_t k;
+  size_t len;
+  /* Slots ordered as a min-heap on count, so the one to evict is on top. */
+  size_t *heap;
+  /* Open addressing on the hash, holding slot indices plus one. */
+  size_t *index;
+  size_t index_mask;
+  unsigned long samples;
+  /* Exact counts per function, indexed by name ID. */
+  struct intern_table *names;
+  unsigned long *self;
+  unsigned long *total;
+  unsigned long *seen;  /* The last sample (plus one) counted in total. */
+  size_t counts_cap;
+  /* The sample being added, innermost first. */
+  int *current;
+  size_t current_len;
+  size_t current_cap;
+  char folded[MAX_STACK_LEN];
+};
+
+struct heavy_table *heavy_create(size_t k) {
+  struct heavy_table *out = calloc(1, sizeof(struct heavy_table));
+  if (!out) {
+    return NULL;
+  }
+  size_t index_len = 1;
+  while (index_len < 2 * k) {
+    index_len *= 2;
+  }
+  out->k = k;
+  out->index_mask = index_len - 1;
+  out->slots = calloc(k, sizeof(struct heavy_slot));
+  out->heap = calloc(k, sizeof(size_t));
+  out->index = calloc(index_len, sizeof(size_t));
+  out->names = intern_create();
+  if (!out->slots || !out->heap || !out->index || !out->names) {
+    heavy_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void heavy_destroy(struct heavy_table *heavy) {
+  if (!heavy) {
+    return;
+  }
+  if (heavy->slots) {
+    for (size_t i = 0; i < heavy->len; i++) {
+      free(heavy->slots[i].stack);
+    }
+  }
+  free(heavy->slots);
+  free(heavy->heap);
+  free(heavy->index);
+  intern_destroy(heavy->names);
+  free(heavy->self);
+  free(heavy->total);
+  free(heavy->seen);
+  free(heavy->current);
+  return free(heavy);
+}
+
+int heavy_add_frame(struct heavy_table *heavy, const char *name) {
+  if (heavy->current_len >= MAX_SAMPLE_DEPTH) {
+    return -1;
+  }
+  if (heavy->current_len == heavy->current_cap) {
+    size_t cap = heavy->current_cap ? 2 * heavy->current_cap : 256;
+    int *current = realloc(heavy->current, cap * sizeof(int));
+    if (!current) {
+      return -1;
+    }
+    heavy->current = current;
+    heavy->current_cap = cap;
+  }
+  int id = intern_find(heavy->names, name);
+  if (id < 0) {
+    id = intern_string(heavy->names,
+                       intern_size(heavy->names) < MAX_FUNCTIONS - 1 ?
+                       name : OTHER_NAME);
+  }
+  if (id < 0) {
+    return -1;
+  }
+  heavy->current[heavy->current_len++] = id;
+  return 0;
+}
+
+static int count_functions(struct heavy_table *heavy) {
+  size_t needed = intern_size(heavy->names);
+  if (needed > heavy->counts_cap) {
+    size_t cap = heavy->counts_cap ? 2 * heavy->counts_cap : 1024;
+    while (cap < needed) {
+      cap *= 2;
+    }
+    unsigned long *self = realloc(heavy->self, cap * sizeof(unsigned long));
+    if (self) {
+      heavy->self = self;
+    }
+    unsigned long *total = realloc(heavy->total, cap * sizeof(unsigned long));
+    if (total) {
+      heavy->total = total;
+    }
+    unsigned long *seen = realloc(heavy->seen, cap * sizeof(unsigned long));
+    if (seen) {
+      heavy->seen = seen;
+    }
+    if (!self || !total || !seen) {
+      return -1;
+    }
+    size_t grown = (cap - heavy->counts_cap) * sizeof(unsigned long);
+    memset(heavy->self + heavy->counts_cap, 0, grown);
+    memset(heavy->total + heavy->counts_cap, 0, grown);
+    memset(heavy->seen + heavy->counts_cap, 0, grown);
+    heavy->counts_cap = cap;
+  }
+
+  /* Recursive functions count once towards their total. */
+  heavy->self[heavy->current[0]]++;
+  for (size_t i = 0; i < heavy->current_len; i++) {
+    int id = heavy->current[i];
+    if (heavy->seen[id] != heavy->samples) {
+      heavy->seen[id] = heavy->samples;
+      heavy->total[id]++;
+    }
+  }
+  return 0;
+}
+
+/* Write the current sample in the folded format, keeping the innermost frames
+   if it doesn't fit. */
+static void fold_stack(struct heavy_table *heavy) {
+  size_t len = 0, n = 0, prefix = 0;
+  while (n < heavy->current_len) {
+    size_t name_len = strlen(intern_lookup(heavy->names, heavy->current[n]));
+    if (len + name_len + 1 > MAX_STACK_LEN - sizeof(TRUNCATED_PREFIX)) {
+      break;
+    }
+    len += name_len + 1;
+    n++;
+  }
+  if (n < heavy->current_len) {
+    prefix = sizeof(TRUNCATED_PREFIX) - 1;
+    memcpy(heavy->folded, TRUNCATED_PREFIX, prefix);
+  }
+
+  char *p = heavy->folded + prefix;
+  for (size_t i = n; i > 0; i--) {
+    const char *name = intern_lookup(heavy->names, heavy->current[i - 1]);
+    size_t name_len = strlen(name);
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (i > 1) {
+      *p++ = ';';
+    }
+  }
+  *p = '\0';
+}
+
+/* FNV-1a. */
+static uint64_t hash_stack(const char *stack) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *p = stack; *p; p++) {
+    hash ^= (unsigned char) *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void heap_swap(struct heavy_table *heavy, size_t i, size_t j) {
+  size_t tmp = heavy->heap[i];
+  heavy->heap[i] = heavy->heap[j];
+  heavy->heap[j] = tmp;
+  heavy->slots[heavy->heap[i]].pos = i;
+  heavy->slots[heavy->heap[j]].pos = j;
+}
+
+/* New slots start at the bottom of the heap with the smallest count. */
+static void heap_sift_up(struct heavy_table *heavy, size_t i) {
+  while (i > 0 && heavy->slots[heavy->heap[i]].count <
+         heavy->slots[heavy->heap[(i - 1) / 2]].count) {
+    heap_swap(heavy, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+/* Otherwise counts only ever increase, so slots only ever move down. */
+static void heap_sift_down(struct heavy_table *heavy, size_t i) {
+  while (1) {
+    size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < heavy->len && heavy->slots[heavy->heap[left]].count <
+        heavy->slots[heavy->heap[smallest]].count) {
+      smallest = left;
+    }
+    if (right < heavy->len && heavy->slots[heavy->heap[right]].count <
+        heavy->slots[heavy->heap[smallest]].count) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    heap_swap(heavy, i, smallest);
+    i = smallest;
+  }
+}
+
+static size_t *index_find(struct heavy_table *heavy, uint64_t hash,
+                          const char *stack) {
+  size_t i = hash & heavy->index_mask;
+  while (heavy->index[i]) {
+    struct heavy_slot *slot = &heavy->slots[heavy->index[i] - 1];
+    if (slot->hash == hash && strcmp(slot->stack, stack) == 0) {
+      break;
+    }
+    i = (i + 1) & heavy->index_mask;
+  }
+  return &heavy->index[i];
+}
+
+/* Remove a slot from the index, moving later entries back to fill the gap so
+   that lookups never stop short. */
+static void index_remove(struct heavy_table *heavy, size_t slot) {
+  size_t i = heavy->slots[slot].hash & heavy->index_mask, j, home;
+  while (heavy->index[i] != slot + 1) {
+    i = (i + 1) & heavy->index_mask;
+  }
+  j = i;
+  while (1) {
+    j = (j + 1) & heavy->index_mask;
+    if (!heavy->index[j]) {
+      break;
+    }
+    home = heavy->slots[heavy->index[j] - 1].hash & heavy->index_mask;
+    /* Move the entry back unless its home lies cyclically in (i, j]. */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      heavy->index[i] = heavy->index[j];
+      i = j;
+    }
+  }
+  heavy->index[i] = 0;
+}
+
+static int count_stack(struct heavy_table *heavy) {
+  uint64_t hash = hash_stack(heavy->folded);
+  size_t *entry = index_find(heavy, hash, heavy->folded), slot;
+  if (*entry) {
+    slot = *entry - 1;
+    heavy->slots[slot].count++;
+    heap_sift_down(heavy, heavy->slots[slot].pos);
+    return 0;
+  }
+
+  char *stack = strdup(heavy->folded);
+  if (!stack) {
+    return -1;
+  }
+  if (heavy->len < heavy->k) {
+    slot = heavy->len++;
+    heavy->heap[slot] = slot;
+    heavy->slots[slot].hash = hash;
+    heavy->slots[slot].stack = stack;
+    heavy->slots[slot].pos = slot;
+    heavy->slots[slot].count = 1;
+    heavy->slots[slot].error = 0;
+    *entry = slot + 1;
+    heap_sift_up(heavy, slot);
+    return 0;
+  }
+
+  /* Take over the least common stack's slot, along with its count, which
+     bounds how much this one may have been seen without being counted. */
+  slot = heavy->heap[0];
+  index_remove(heavy, slot);
+  free(heavy->slots[slot].stack);
+  entry = index_find(heavy, hash, stack);
+  heavy->slots[slot].hash = hash;
+  heavy->slots[slot].stack = stack;
+  heavy->slots[slot].error = heavy->slots[slot].count;
+  heavy->slots[slot].count++;
+  *entry = slot + 1;
+  heap_sift_down(heavy, heavy->slots[slot].pos);
+  return 0;
+}
+
+int heavy_end_sample(struct heavy_table *heavy) {
+  if (heavy->current_len == 0) {
+    return 0;
+  }
+  heavy->samples++;
+  fold_stack(heavy);
+  int ret = count_functions(heavy) < 0 || count_stack(heavy) < 0 ? -1 : 0;
+  heavy->current_len = 0;
+  return ret;
+}
+
+static int compare_slots(const void *a, const void *b) {
+  const struct heavy_slot *x = *(struct heavy_slot **) a,
+    *y = *(struct heavy_slot **) b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+struct function_counts {
+  int id;
+  unsigned long self;
+  unsigned long total;
+};
+
+static int compare_functions(const void *a, const void *b) {
+  const struct function_counts *x = a, *y = b;
+  return (x->total < y->total) - (x->total > y->total);
+}
+
+int heavy_report(struct heavy_table *heavy, struct output *out) {
+  size_t nnames = intern_size(heavy->names), nfunctions = 0;
+  struct heavy_slot **slots = malloc((heavy->len + 1) * sizeof(struct heavy_slot *));
+  struct function_counts *functions = malloc((nnames + 1) * sizeof(struct function_counts));
+  if (!slots || !functions) {
+    free(slots);
+    free(functions);
+    return -1;
+  }
+
+  for (size_t i = 0; i < heavy->len; i++) {
+    slots[i] = &heavy->slots[i];
+  }
+  qsort(slots, heavy->len, sizeof(struct heavy_slot *), compare_slots);
+  output_printf(out, "# %lu samples, %lu of %lu stacks tracked. Counts may be overestimated by up\n"
+                "# to their error, and every stack seen in more than %lu samples is listed.\n",
+                heavy->samples, (unsigned long) heavy->len,
+                (unsigned long) heavy->k,
+                (unsigned long) (heavy->samples / heavy->k));
+  output_printf(out, "count\terror\tstack\n");
+  for (size_t i = 0; i < heavy->len; i++) {
+    output_printf(out, "%lu\t%lu\t%s\n", slots[i]->count, slots[i]->error,
+                  slots[i]->stack);
+  }
+
+  for (size_t id = 0; id < nnames && id < heavy->counts_cap; id++) {
+    if (heavy->total[id]) {
+      functions[nfunctions].id = id;
+      functions[nfunctions].self = heavy->self[id];
+      functions[nfunctions].total = heavy->total[id];
+      nfunctions++;
+    }
+  }
+  qsort(functions, nfunctions, sizeof(struct function_counts),
+        compare_functions);
+  if (nnames < MAX_FUNCTIONS) {
+    output_printf(out, "\n# Exact counts per function.\n");
+  } else {
+    output_printf(out, "\n# Exact counts per function, for the first %d seen. Any others are\n"
+                  "# counted together as %s.\n", MAX_FUNCTIONS - 1, OTHER_NAME);
+  }
+  output_printf(out, "function\tself\ttotal\n");
+  for (size_t i = 0; i < nfunctions; i++) {
+    output_printf(out, "%s\t%lu\t%lu\n",
+                  intern_lookup(heavy->names, functions[i].id),
+                  functions[i].self, functions[i].total);
+  }
+
+  free(slots);
+  free(functions);
+  return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef XRPROF_HEAVY_H
+#define XRPROF_HEAVY_H
+
+#include <stddef.h> /* for size_t */
+#include "output.h"
+
+/* Aggregation of samples in a fixed amount of memory, for captures that run
+   for days. The most common stacks are kept in a "space-saving" sketch of k
+   slots, so that their counts are approximate (with known error bounds),
+   while self and total counts per function are exact for a bounded number of
+   functions. */
+struct heavy_table;
+
+struct heavy_table *heavy_create(size_t k);
+void heavy_destroy(struct heavy_table *heavy);
+/* Add a frame to the current sample, innermost first. */
+int heavy_add_frame(struct heavy_table *heavy, const char *name);
+/* Finish the current sample, counting its stack and functions. */
+int heavy_end_sample(struct heavy_table *heavy);
+/* Write out the stacks and functions, most common first, as tab-separated
+   tables. */
+int heavy_report(struct heavy_table *heavy, struct output *out);
+
+#endif /* XRPROF_HEAVY_H */
@@ -0,0 +1,125 @@
+#include <stdint.h>     /* for uint32_t */
+#include <stdlib.h>     /* for malloc, calloc, free */
+#include <string.h>     /* for strcmp, strdup */
+
+#include "intern.h"
+
+#define INITIAL_SLOTS 256
+
+struct intern_table {
+  char **strings;       /* Indexed by ID. */
+  size_t len;
+  int *slots;           /* Open addressing; -1 for empty slots. */
+  size_t nslots;
+};
+
+static uint32_t hash_string(const char *str) {
+  /* FNV-1a. */
+  uint32_t hash = 2166136261u;
+  for (; *str; str++) {
+    hash ^= (unsigned char) *str;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int alloc_slots(struct intern_table *table, size_t nslots) {
+  int *slots = malloc(nslots * sizeof(int));
+  if (!slots) {
+    return -1;
+  }
+  for (size_t i = 0; i < nslots; i++) {
+    slots[i] = -1;
+  }
+  /* Rehash the existing strings, if any. */
+  for (size_t id = 0; id < table->len; id++) {
+    size_t i = hash_string(table->strings[id]) & (nslots - 1);
+    while (slots[i] >= 0) {
+      i = (i + 1) & (nslots - 1);
+    }
+    slots[i] = id;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->nslots = nslots;
+
+  char **strings = realloc(table->strings, nslots / 2 * sizeof(char *));
+  if (!strings) {
+    return -1;
+  }
+  table->strings = strings;
+  return 0;
+}
+
+struct intern_table *intern_create(void) {
+  struct intern_table *out = calloc(1, sizeof(struct intern_table));
+  if (!out) {
+    return NULL;
+  }
+  if (alloc_slots(out, INITIAL_SLOTS) < 0) {
+    intern_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void intern_destroy(struct intern_table *table) {
+  if (!table) {
+    return;
+  }
+  for (size_t id = 0; id < table->len; id++) {
+    free(table->strings[id]);
+  }
+  free(table->strings);
+  free(table->slots);
+  return free(table);
+}
+
+int intern_string(struct intern_table *table, const char *str) {
+  size_t i = hash_string(str) & (table->nslots - 1);
+  while (table->slots[i] >= 0) {
+    if (strcmp(table->strings[table->slots[i]], str) == 0) {
+      return table->slots[i];
+    }
+    i = (i + 1) & (table->nslots - 1);
+  }
+
+  /* Keep the load factor under 1/2. */
+  if (table->len + 1 > table->nslots / 2) {
+    if (alloc_slots(table, table->nslots * 2) < 0) {
+      return -1;
+    }
+    return intern_string(table, str);
+  }
+
+  char *copy = strdup(str);
+  if (!copy) {
+    return -1;
+  }
+  int id = table->len++;
+  table->strings[id] = copy;
+  table->slots[i] = id;
+  return id;
+}
+
+int intern_find(struct intern_table *table, const char *str) {
+  size_t i = hash_string(str) & (table->nslots - 1);
+  while (table->slots[i] >= 0) {
+    if (strcmp(table->strings[table->slots[i]], str) == 0) {
+      return table->slots[i];
+    }
+    i = (i + 1) & (table->nslots - 1);
+  }
+  return -1;
+}
+
+const char *intern_lookup(struct intern_table *table, int id) {
+  if (id < 0 || id >= table->len) {
+    return NULL;
+  }
+  return table->strings[id];
+}
+
+size_t intern_size(struct intern_table *table) {
+  return table->len;
+}
@@ -0,0 +1,17 @@
+#ifndef XRPROF_INTERN_H
+#define XRPROF_INTERN_H
+
+#include <stddef.h> /* for size_t */
+
+/* A table of unique strings, each identified by a small integer ID. */
+struct intern_table;
+
+struct intern_table *intern_create(void);
+void intern_destroy(struct intern_table *table);
+int intern_string(struct intern_table *table, const char *str);
+/* The ID of a string already in the table, or -1. */
+int intern_find(struct intern_table *table, const char *str);
+const char *intern_lookup(struct intern_table *table, int id);
+size_t intern_size(struct intern_table *table);
+
+#endif /* XRPROF_INTERN_H */
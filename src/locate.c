@@ -7,12 +7,16 @@
 #include <stddef.h>     /* for ptrdiff_t */
 #include <stdlib.h>     /* for malloc */
 #include <string.h>     /* for strstr, strndup */
+#include <sys/stat.h>   /* for stat */
+#include <time.h>       /* for nanosleep */
 
 #include <elf.h>
 #include <libelf.h>
 #include <gelf.h>
 
 #define MAX_LIBR_PATH_LEN 128
+#define LOCATE_POLL_NS 1000000L // One millisecond.
+#define LOCATE_TIMEOUT_SECS 60
 
 static int find_libR(pid_t pid, char **path, uintptr_t *addr) {
   char maps_file[32];
@@ -65,33 +69,87 @@ static int find_libR(pid_t pid, char **path, uintptr_t *addr) {
 }
 
 
-int locate_libR_globals(phandle pid, struct libR_globals *out) {
-  /* Open the same libR.so in the tracer so we can determine the symbol offsets
-     to read memory at in the tracee. */
+static uintptr_t read_symbol_value(pid_t pid, uintptr_t addr) {
+  uintptr_t value;
+  if (!addr) {
+    return 0;
+  }
+  /* copy_address() will print its own errors. */
+  ssize_t bytes = copy_address(pid, (void *) addr, &value, sizeof(uintptr_t));
+  return bytes < sizeof(uintptr_t) ? 0 : value;
+}
 
+/* The symbols we need, in the order their offsets are cached below. The first
+   few are required and (for historical reasons) matched as prefixes. */
+static const struct {
+  const char *name;
+  int prefix;
+} symbols[] = {
+  {"R_GlobalContext", 1},
+  {"R_DoubleColonSymbol", 1},
+  {"R_TripleColonSymbol", 1},
+  {"R_DollarSymbol", 1},
+  {"R_BracketSymbol", 1},
+  /* Symbols whose values are only needed by some features. */
+  {"R_NilValue", 0},
+  {"R_GlobalEnv", 0},
+  {"R_BaseNamespace", 0},
+  {"R_NamespaceRegistry", 0},
+  {"R_SymbolTable", 0},
+  {"R_PendingPromises", 0}
+};
+#define NUM_SYMBOLS (sizeof(symbols) / sizeof(symbols[0]))
+
+/* Symbol offsets for each libR.so (or R executable) we have seen, identified
+   by its inode and modification time, so that profiling many processes using
+   the same R only parses it once. */
+struct symbol_offsets {
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  uintptr_t offsets[NUM_SYMBOLS];
+  struct symbol_offsets *next;
+};
+
+static struct symbol_offsets *offsets_cache = NULL;
+
+/* Fill in the offsets of any symbols not already found in this table. */
+static void read_symbols(Elf *elf, Elf_Scn *scn, Elf64_Shdr *shdr,
+                         uintptr_t *offsets) {
+  Elf_Data *data = elf_getdata(scn, NULL);
+  Elf64_Sym sym;
+  char *symbol;
+  for (int i = 0; data && i < shdr->sh_size / shdr->sh_entsize; i++) {
+    gelf_getsym(data, i, &sym);
+    symbol = elf_strptr(elf, shdr->sh_link, sym.st_name);
+    if (!symbol) {
+      continue;
+    }
+    for (int j = 0; j < NUM_SYMBOLS; j++) {
+      if (symbols[j].prefix ?
+          strncmp(symbols[j].name, symbol, strlen(symbols[j].name)) == 0 :
+          strcmp(symbols[j].name, symbol) == 0) {
+        if (!offsets[j]) {
+          offsets[j] = sym.st_value;
+        }
+        break;
+      }
+    }
+  }
+}
+
+static int read_symbol_offsets(const char *path, uintptr_t *offsets) {
   if (elf_version(EV_CURRENT) == EV_NONE) {
     fprintf(stderr, "error: Can't set the ELF version. %s\n",
             elf_errmsg(elf_errno()));
     return -1;
   }
 
-  char *path = NULL;
-  uintptr_t remote = 0;
-  if (find_libR(pid, &path, &remote) < 0) {
-    /* Try finding the symbols in the executable directly. */
-    path = calloc(MAX_LIBR_PATH_LEN, 1);
-    snprintf(path, MAX_LIBR_PATH_LEN, "/proc/%d/exe", pid);
-  }
-
-  /* if (verbose) fprintf(stderr, "Found %s at %p in pid %d.\n", path, */
-  /*                      (void *) addr, pid); */
-
   int fd = open(path, O_RDONLY);
   if (fd < 0) {
     char msg[64];
     snprintf(msg, 64, "error: Cannot open %s", path);
     perror(msg);
-    free(path);
     return -1;
   }
 
@@ -100,7 +158,6 @@ int locate_libR_globals(phandle pid, struct libR_globals *out) {
     fprintf(stderr, "error: %s is not a valid ELF file. %s\n", path,
             elf_errmsg(elf_errno()));
     close(fd);
-    free(path);
     return -1;
   }
 
@@ -111,7 +168,6 @@ int locate_libR_globals(phandle pid, struct libR_globals *out) {
             elf_errmsg(elf_errno()));
     elf_end(elf);
     close(fd);
-    free(path);
     return -1;
   }
 
@@ -127,46 +183,169 @@ int locate_libR_globals(phandle pid, struct libR_globals *out) {
     fprintf(stderr, "error: Can't find the symbol table in %s.\n", path);
     elf_end(elf);
     close(fd);
-    free(path);
     return -1;
   }
+  read_symbols(elf, scn, &shdr, offsets);
 
-  Elf_Data *data = elf_getdata(scn, NULL);
-  Elf64_Sym sym;
-  char *symbol;
-  uintptr_t value;
-  ssize_t bytes;
-  for (int i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
-    gelf_getsym(data, i, &sym);
-    symbol = elf_strptr(elf, shdr.sh_link, sym.st_name);
-
-    if (strncmp("R_GlobalContext", symbol, 15) == 0) {
-      /* The R_GlobalContext value will change, so we only want the address to
-         read the value from. */
-      out->context_addr = remote + sym.st_value;
-    } else if (strncmp("R_DoubleColonSymbol", symbol, 19) == 0) {
-      /* copy_address() will print its own errors. */
-      bytes = copy_address(pid, (void *)remote + sym.st_value, &value,
-                           sizeof(uintptr_t));
-      out->doublecolon = bytes < sizeof(uintptr_t) ? 0 : value;
-    } else if (strncmp("R_TripleColonSymbol", symbol, 19) == 0) {
-      bytes = copy_address(pid, (void *)remote + sym.st_value, &value,
-                           sizeof(uintptr_t));
-      out->triplecolon = bytes < sizeof(uintptr_t) ? 0 : value;
-    } else if (strncmp("R_DollarSymbol", symbol, 14) == 0) {
-      bytes = copy_address(pid, (void *)remote + sym.st_value, &value,
-                           sizeof(uintptr_t));
-      out->dollar = bytes < sizeof(uintptr_t) ? 0 : value;
-    } else if (strncmp("R_BracketSymbol", symbol, 15) == 0) {
-      bytes = copy_address(pid, (void *)remote + sym.st_value, &value,
-                           sizeof(uintptr_t));
-      out->bracket = bytes < sizeof(uintptr_t) ? 0 : value;
+  /* Hidden symbols are only in the static symbol table, which is usually
+     stripped. */
+  scn = NULL;
+  while ((scn = elf_nextscn(elf, scn)) != NULL) {
+    gelf_getshdr(scn, &shdr);
+    if (shdr.sh_type == SHT_SYMTAB) {
+      read_symbols(elf, scn, &shdr, offsets);
+      break;
     }
   }
 
   elf_end(elf);
   close(fd);
+  return 0;
+}
+
+static const uintptr_t *get_symbol_offsets(const char *path) {
+  struct stat info;
+  if (stat(path, &info) < 0) {
+    char msg[64];
+    snprintf(msg, 64, "error: Cannot open %s", path);
+    perror(msg);
+    return NULL;
+  }
+  for (struct symbol_offsets *entry = offsets_cache; entry;
+       entry = entry->next) {
+    if (entry->dev == info.st_dev && entry->ino == info.st_ino &&
+        entry->mtime == info.st_mtime) {
+      return entry->offsets;
+    }
+  }
+
+  struct symbol_offsets *entry = calloc(1, sizeof(struct symbol_offsets));
+  if (!entry) {
+    return NULL;
+  }
+  if (read_symbol_offsets(path, entry->offsets) < 0) {
+    free(entry);
+    return NULL;
+  }
+  entry->dev = info.st_dev;
+  entry->ino = info.st_ino;
+  entry->mtime = info.st_mtime;
+  entry->next = offsets_cache;
+  offsets_cache = entry;
+  return entry->offsets;
+}
+
+int locate_wait_for_R(phandle pid) {
+  struct timespec interval = {0, LOCATE_POLL_NS}, start, now;
+  char *path = NULL, exe[MAX_LIBR_PATH_LEN];
+  uintptr_t remote = 0, context = 0;
+  const uintptr_t *offsets = NULL;
+  struct stat info;
+  dev_t exe_dev = 0;
+  ino_t exe_ino = 0;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  snprintf(exe, sizeof(exe), "/proc/%d/exe", pid);
+
+  /* Polling is done with the process suspended, which works with all memory
+     backends and also notices when it has exited. */
+  while (!context) {
+    if ((ret = proc_suspend(pid)) < 0) {
+      return ret;
+    }
+    /* The program might exec() a few times first, as Rscript does. libR.so is
+       mapped by the dynamic loader after the last of these. */
+    if (!offsets && find_libR(pid, &path, &remote) == 0) {
+      offsets = get_symbol_offsets(path);
+      free(path);
+      if (!offsets || !offsets[0]) {
+        proc_resume(pid);
+        return -1;
+      }
+    } else if (!offsets && stat(exe, &info) == 0 &&
+               (info.st_dev != exe_dev || info.st_ino != exe_ino)) {
+      /* R may not use libR.so at all, in which case its symbols are in the
+         program itself. Each program is only checked once. */
+      const uintptr_t *exe_offsets = get_symbol_offsets(exe);
+      exe_dev = info.st_dev;
+      exe_ino = info.st_ino;
+      if (exe_offsets && exe_offsets[0]) {
+        offsets = exe_offsets;
+      }
+    }
+    /* R_GlobalContext is set once R's internals have been initialized, and
+       before any R code has run. */
+    if (offsets && copy_address(pid, (void *) (remote + offsets[0]), &context,
+                                sizeof(uintptr_t)) < sizeof(uintptr_t)) {
+      proc_resume(pid);
+      return -1;
+    }
+    if ((ret = proc_resume(pid)) < 0) {
+      return ret;
+    }
+    if (!offsets) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec - start.tv_sec >= LOCATE_TIMEOUT_SECS) {
+        fprintf(stderr, "error: Process %d has not loaded R after %d seconds.\n",
+                pid, LOCATE_TIMEOUT_SECS);
+        return -1;
+      }
+    }
+    if (!context) {
+      nanosleep(&interval, NULL);
+    }
+  }
+  return 0;
+}
+
+int locate_libR_globals(phandle pid, struct libR_globals *out) {
+  /* Open the same libR.so in the tracer so we can determine the symbol offsets
+     to read memory at in the tracee. */
+
+  char *path = NULL;
+  uintptr_t remote = 0;
+  if (find_libR(pid, &path, &remote) < 0) {
+    /* Try finding the symbols in the executable directly. */
+    path = calloc(MAX_LIBR_PATH_LEN, 1);
+    snprintf(path, MAX_LIBR_PATH_LEN, "/proc/%d/exe", pid);
+  }
+
+  /* if (verbose) fprintf(stderr, "Found %s at %p in pid %d.\n", path, */
+  /*                      (void *) addr, pid); */
+
+  const uintptr_t *offsets = get_symbol_offsets(path);
   free(path);
+  if (!offsets) {
+    return -1;
+  }
+
+  uintptr_t addrs[NUM_SYMBOLS];
+  for (int j = 0; j < NUM_SYMBOLS; j++) {
+    addrs[j] = offsets[j] ? remote + offsets[j] : 0;
+  }
+  /* These change as R runs, so it is their addresses that are kept. */
+  out->context_addr = addrs[0];
+  out->pendingpromises = addrs[NUM_SYMBOLS - 1];
+
+  /* Where the values of the symbols in between go, in the same order. */
+  uintptr_t *values[] = {
+    &out->doublecolon, &out->triplecolon, &out->dollar, &out->bracket,
+    &out->nilvalue, &out->globalenv, &out->basenamespace, &out->registry,
+    &out->symtable
+  };
+
+  /* Some memory backends can only read from a stopped process. */
+  int ret = proc_suspend(pid);
+  if (ret < 0) {
+    return ret;
+  }
+  for (int j = 1; j < NUM_SYMBOLS - 1; j++) {
+    *values[j - 1] = read_symbol_value(pid, addrs[j]);
+  }
+  if ((ret = proc_resume(pid)) < 0) {
+    return ret;
+  }
 
   if (!out->doublecolon || !out->triplecolon || !out->dollar || !out->bracket ||
       !out->context_addr) {
@@ -295,6 +474,41 @@ int locate_libR_globals(phandle pid, struct libR_globals *out) {
       out->bracket = bytes < sizeof(uintptr_t) ? 0 : value;
     }
 
+    /* Symbols whose values are only needed by some features. */
+    struct {
+      char *name;
+      uintptr_t *value;
+    } optional[] = {
+      {"R_NilValue", &out->nilvalue},
+      {"R_GlobalEnv", &out->globalenv},
+      {"R_BaseNamespace", &out->basenamespace},
+      {"R_NamespaceRegistry", &out->registry},
+      {"R_SymbolTable", &out->symtable}
+    };
+    for (int j = 0; j < sizeof(optional) / sizeof(optional[0]); j++) {
+      if (!SymFromName(pid, optional[j].name, &info.info)) {
+        if (GetLastError() != 123) {
+          fprintf(stderr, "error: Failed to lookup symbol: %ld.\n", GetLastError());
+          goto error;
+        }
+      } else {
+        bytes = copy_address(pid, (void *) info.info.Address, &value,
+                             sizeof(uintptr_t));
+        *optional[j].value = bytes < sizeof(uintptr_t) ? 0 : value;
+      }
+    }
+
+    /* Like R_GlobalContext, this changes as R runs. */
+    sym = "R_PendingPromises";
+    if (!SymFromName(pid, sym, &info.info)) {
+      if (GetLastError() != 123) {
+        fprintf(stderr, "error: Failed to lookup symbol: %ld.\n", GetLastError());
+        goto error;
+      }
+    } else {
+      out->pendingpromises = info.info.Address;
+    }
+
     if (!SymUnloadModule64(pid, base)) {
       fprintf(stderr, "error: Failed to unload symbols for %s (0x%p): %ld.\n",
               mpath, mods[i], GetLastError());
@@ -317,12 +531,22 @@ remote process's memory. Are you sure it is an R program?\n");
   proc_resume(pid);
   return -1;
 }
+int locate_wait_for_R(phandle pid) {
+  fprintf(stderr, "error: Starting programs is not supported on Windows.\n");
+  return -1;
+}
 #elif defined(__MACH__) // macOS support.
 int locate_libR_globals(phandle pid, struct libR_globals *out)
 {
     fprintf(stderr, "error: macOS is not yet supported.\n");
     return -1;
 }
+
+int locate_wait_for_R(phandle pid)
+{
+    fprintf(stderr, "error: macOS is not yet supported.\n");
+    return -1;
+}
 #else
 #error "No support for this platform."
 #endif
@@ -10,8 +10,19 @@ struct libR_globals {
   uintptr_t triplecolon;
   uintptr_t dollar;
   uintptr_t bracket;
+  /* These are optional, and zero when not found. */
+  uintptr_t nilvalue;
+  uintptr_t globalenv;
+  uintptr_t basenamespace;
+  uintptr_t registry;
+  /* Hidden, so these are only found when R's static symbols are available. */
+  uintptr_t symtable;
+  uintptr_t pendingpromises;    /* The address of the variable. */
 };
 
 int locate_libR_globals(phandle pid, struct libR_globals *out);
+/* Wait for a newly-started process to load and initialize R. Returns -2 if it
+   exits first. */
+int locate_wait_for_R(phandle pid);
 
 #endif /* XRPROF_LOCATE_H */
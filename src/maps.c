@@ -0,0 +1,162 @@
+#include <stdio.h>      /* for fprintf */
+#include <stdlib.h>     /* for malloc, free */
+
+#include "maps.h"
+
+#ifdef __linux
+#include <string.h>     /* for strdup, strrchr */
+#include <time.h>       /* for clock_gettime */
+
+/* Don't re-read the maps file more often than this on lookup misses, since an
+   address might simply be unmapped. */
+#define MAPS_REFRESH_INTERVAL_NS 250000000L
+
+struct proc_maps {
+  phandle pid;
+  struct proc_map *entries;
+  size_t len;
+  size_t cap;
+  struct timespec refreshed;
+};
+
+static void maps_clear(struct proc_maps *maps) {
+  for (size_t i = 0; i < maps->len; i++) {
+    free(maps->entries[i].path);
+  }
+  maps->len = 0;
+}
+
+struct proc_maps *maps_create(phandle pid) {
+  struct proc_maps *out = calloc(1, sizeof(struct proc_maps));
+  if (!out) {
+    return NULL;
+  }
+  out->pid = pid;
+  if (maps_refresh(out) < 0) {
+    maps_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void maps_destroy(struct proc_maps *maps) {
+  if (!maps) {
+    return;
+  }
+  maps_clear(maps);
+  free(maps->entries);
+  return free(maps);
+}
+
+int maps_refresh(struct proc_maps *maps) {
+  char maps_file[32];
+  snprintf(maps_file, sizeof(maps_file), "/proc/%d/maps", maps->pid);
+  FILE *file = fopen(maps_file, "r");
+  if (!file) {
+    char msg[51]; // 19 for the message + 32 for the buffer above.
+    snprintf(msg, 51, "error: Cannot open %s", maps_file);
+    perror(msg);
+    return -1;
+  }
+
+  maps_clear(maps);
+  clock_gettime(CLOCK_MONOTONIC, &maps->refreshed);
+
+  char buffer[1024];
+  while (fgets(buffer, sizeof(buffer), file)) {
+    unsigned long start, end, offset;
+    char perms[5];
+    int path_start = 0;
+    if (sscanf(buffer, "%lx-%lx %4s %lx %*s %*s %n", &start, &end, perms,
+               &offset, &path_start) < 4) {
+      continue;
+    }
+
+    if (maps->len == maps->cap) {
+      size_t cap = maps->cap ? 2 * maps->cap : 256;
+      struct proc_map *entries = realloc(maps->entries,
+                                         cap * sizeof(struct proc_map));
+      if (!entries) {
+        fclose(file);
+        return -1;
+      }
+      maps->entries = entries;
+      maps->cap = cap;
+    }
+
+    struct proc_map *entry = &maps->entries[maps->len++];
+    entry->start = (uintptr_t) start;
+    entry->end = (uintptr_t) end;
+    entry->offset = (uintptr_t) offset;
+    entry->exec = perms[2] == 'x';
+    entry->path = NULL;
+    entry->name = "[anon]";
+
+    /* Remove the trailing '\n'. */
+    char *linebreak = strchr(buffer, '\n');
+    if (linebreak) {
+      *linebreak = '\0';
+    }
+    if (path_start > 0 && buffer[path_start] != '\0') {
+      entry->path = strdup(buffer + path_start);
+      char *slash = strrchr(entry->path, '/');
+      entry->name = slash ? slash + 1 : entry->path;
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
+
+static const struct proc_map *maps_search(struct proc_maps *maps,
+                                          uintptr_t addr) {
+  /* The kernel lists mappings in address order, so binary search works. */
+  size_t lo = 0, hi = maps->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (addr < maps->entries[mid].start) {
+      hi = mid;
+    } else if (addr >= maps->entries[mid].end) {
+      lo = mid + 1;
+    } else {
+      return &maps->entries[mid];
+    }
+  }
+  return NULL;
+}
+
+const struct proc_map *maps_find(struct proc_maps *maps, uintptr_t addr) {
+  const struct proc_map *out = maps_search(maps, addr);
+  if (out) {
+    return out;
+  }
+
+  /* An address we don't know about may mean that new code has been mapped in
+     since the last refresh, e.g. from a call to dyn.load(). */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - maps->refreshed.tv_sec) * 1000000000L +
+    (now.tv_nsec - maps->refreshed.tv_nsec);
+  if (elapsed < MAPS_REFRESH_INTERVAL_NS || maps_refresh(maps) < 0) {
+    return NULL;
+  }
+  return maps_search(maps, addr);
+}
+#else
+struct proc_maps *maps_create(phandle pid) {
+  fprintf(stderr, "error: Memory maps are not supported on this platform.\n");
+  return NULL;
+}
+
+void maps_destroy(struct proc_maps *maps) {
+  return;
+}
+
+int maps_refresh(struct proc_maps *maps) {
+  return -1;
+}
+
+const struct proc_map *maps_find(struct proc_maps *maps, uintptr_t addr) {
+  return NULL;
+}
+#endif
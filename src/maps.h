@@ -0,0 +1,25 @@
+#ifndef XRPROF_MAPS_H
+#define XRPROF_MAPS_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uintptr_t */
+#include "process.h"
+
+/* A single entry in /proc/<pid>/maps. */
+struct proc_map {
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t offset;     /* Offset into the mapped file. */
+  int exec;             /* Whether the mapping is executable. */
+  char *path;           /* NULL for anonymous mappings. */
+  const char *name;     /* The basename of path, or e.g. "[vdso]". */
+};
+
+struct proc_maps;
+
+struct proc_maps *maps_create(phandle pid);
+void maps_destroy(struct proc_maps *maps);
+int maps_refresh(struct proc_maps *maps);
+const struct proc_map *maps_find(struct proc_maps *maps, uintptr_t addr);
+
+#endif /* XRPROF_MAPS_H */
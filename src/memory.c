@@ -7,8 +7,20 @@
 #include "memory.h"
 #include "rdefs.h"
 
+static struct copy_stats stats = {0, 0};
+
+void copy_get_stats(struct copy_stats *out) {
+  *out = stats;
+}
+
 #ifdef __linux
-#include <sys/uio.h> /* for iovec, process_vm_readv */
+#include <errno.h>     /* for errno, EPERM, ENOSYS */
+#include <fcntl.h>     /* for open */
+#include <stdint.h>    /* for uintptr_t */
+#include <string.h>    /* for memcpy, strcmp */
+#include <sys/ptrace.h>
+#include <sys/uio.h>   /* for iovec, process_vm_readv */
+#include <unistd.h>    /* for pread, close */
 
 /* No-op on Linux. */
 int phandle_init(phandle *out, void *data) {
@@ -17,16 +29,171 @@ int phandle_init(phandle *out, void *data) {
   return 0;
 }
 
-ssize_t copy_address(phandle pid, void *addr, void *data, size_t len) {
-  struct iovec local[1];
-  local[0].iov_base = data;
-  local[0].iov_len = len;
+#define MAX_COPY_REQS 16
+
+/* Each backend reads a batch of addresses and returns the number of bytes
+   read, or -1 with errno set if nothing could be read at all. */
+
+static ssize_t copy_vm(phandle pid, struct copy_req *reqs, int n) {
+  struct iovec local[MAX_COPY_REQS];
+  struct iovec remote[MAX_COPY_REQS];
+
+  for (int i = 0; i < n; i++) {
+    local[i].iov_base = reqs[i].data;
+    local[i].iov_len = reqs[i].len;
+    remote[i].iov_base = reqs[i].addr;
+    remote[i].iov_len = reqs[i].len;
+  }
+
+  /* Issue all of the reads in a single system call. */
+  return process_vm_readv(pid, local, n, remote, n, 0);
+}
+
+/* Open /proc/<pid>/mem files are kept around, so that sampling many processes
+   in turn doesn't reopen them each time. */
+#define MEM_FD_SLOTS 256
 
-  struct iovec remote[1];
-  remote[0].iov_base = addr;
-  remote[0].iov_len = len;
+static struct {
+  pid_t pid;
+  int fd;
+} mem_fds[MEM_FD_SLOTS];
+static int mem_fds_init = 0;
+
+static int get_mem_fd(pid_t pid) {
+  if (!mem_fds_init) {
+    for (int i = 0; i < MEM_FD_SLOTS; i++) {
+      mem_fds[i].pid = -1;
+      mem_fds[i].fd = -1;
+    }
+    mem_fds_init = 1;
+  }
+  int slot = pid % MEM_FD_SLOTS;
+  if (mem_fds[slot].pid != pid) {
+    char mem_file[32];
+    snprintf(mem_file, sizeof(mem_file), "/proc/%d/mem", pid);
+    if (mem_fds[slot].fd >= 0) {
+      close(mem_fds[slot].fd);
+    }
+    mem_fds[slot].pid = -1;
+    if ((mem_fds[slot].fd = open(mem_file, O_RDONLY)) < 0) {
+      return -1;
+    }
+    mem_fds[slot].pid = pid;
+  }
+  return mem_fds[slot].fd;
+}
+
+void copy_release(phandle pid) {
+  int slot = pid % MEM_FD_SLOTS;
+  if (mem_fds_init && mem_fds[slot].pid == pid) {
+    close(mem_fds[slot].fd);
+    mem_fds[slot].pid = -1;
+    mem_fds[slot].fd = -1;
+  }
+}
+
+static ssize_t copy_procmem(phandle pid, struct copy_req *reqs, int n) {
+  int mem_fd = get_mem_fd(pid);
+  if (mem_fd < 0) {
+    return -1;
+  }
+
+  ssize_t total = 0;
+  for (int i = 0; i < n; i++) {
+    ssize_t bytes = pread(mem_fd, reqs[i].data, reqs[i].len,
+                          (off_t) reqs[i].addr);
+    if (bytes < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += bytes;
+    if (bytes < reqs[i].len) {
+      break;
+    }
+  }
+  return total;
+}
+
+static ssize_t copy_ptrace(phandle pid, struct copy_req *reqs, int n) {
+  ssize_t total = 0;
+  for (int i = 0; i < n; i++) {
+    uintptr_t addr = (uintptr_t) reqs[i].addr;
+    char *data = reqs[i].data;
+    size_t done = 0;
+
+    /* PTRACE_PEEKDATA reads a single aligned word at a time. */
+    while (done < reqs[i].len) {
+      uintptr_t word_addr = (addr + done) & ~((uintptr_t) sizeof(long) - 1);
+      size_t skip = addr + done - word_addr;
+      size_t chunk = sizeof(long) - skip;
+      if (chunk > reqs[i].len - done) {
+        chunk = reqs[i].len - done;
+      }
+      errno = 0;
+      long word = ptrace(PTRACE_PEEKDATA, pid, (void *) word_addr, NULL);
+      if (errno != 0) {
+        return total > 0 ? total : -1;
+      }
+      memcpy(data + done, (char *) &word + skip, chunk);
+      done += chunk;
+      total += chunk;
+    }
+  }
+  return total;
+}
+
+static const struct {
+  const char *name;
+  ssize_t (*copy)(phandle pid, struct copy_req *reqs, int n);
+} backends[] = {
+  {"vm", copy_vm},
+  {"mem", copy_procmem},
+  {"ptrace", copy_ptrace}
+};
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static int backend = 0;
+static int fallback = 1;
+
+int copy_set_backend(const char *name, int allow_fallback) {
+  for (int i = 0; i < NUM_BACKENDS; i++) {
+    if (strcmp(name, backends[i].name) == 0) {
+      backend = i;
+      fallback = allow_fallback;
+      return 0;
+    }
+  }
+  fprintf(stderr, "error: Unknown memory backend '%s'.\n", name);
+  return -1;
+}
+
+const char *copy_get_backend(void) {
+  return backends[backend].name;
+}
+
+static ssize_t copy_batch(phandle pid, struct copy_req *reqs, int n) {
+  ssize_t bytes = backends[backend].copy(pid, reqs, n);
+
+  /* Fall back on the other backends when this one is not permitted or not
+     available at all, e.g. due to a seccomp policy. */
+  for (int i = 1; bytes < 0 && fallback && i < NUM_BACKENDS &&
+         (errno == EPERM || errno == ENOSYS || errno == EACCES); i++) {
+    int next = (backend + 1) % NUM_BACKENDS;
+    fprintf(stderr, "warning: Reading memory with '%s' failed (%s), falling back on '%s'.\n",
+            backends[backend].name, strerror(errno), backends[next].name);
+    backend = next;
+    bytes = backends[backend].copy(pid, reqs, n);
+  }
+
+  if (bytes > 0) {
+    stats.reads++;
+    stats.bytes += bytes;
+  }
+  return bytes;
+}
 
-  ssize_t bytes = process_vm_readv(pid, local, 1, remote, 1, 0);
+ssize_t copy_address(phandle pid, void *addr, void *data, size_t len) {
+  struct copy_req req = {addr, data, len};
+  ssize_t bytes = copy_batch(pid, &req, 1);
   if (bytes < 0) {
     perror("error: Failed to read memory in the remote process");
   } else if (bytes < len) {
@@ -34,6 +201,30 @@ ssize_t copy_address(phandle pid, void *addr, void *data, size_t len) {
   }
   return bytes;
 }
+
+int copy_addresses(phandle pid, struct copy_req *reqs, int n) {
+  size_t len = 0;
+
+  if (n <= 0 || n > MAX_COPY_REQS) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!reqs[i].addr) {
+      return -1;
+    }
+    len += reqs[i].len;
+  }
+
+  ssize_t bytes = copy_batch(pid, reqs, n);
+  if (bytes < 0) {
+    perror("error: Failed to read memory in the remote process");
+    return -2;
+  } else if (bytes < len) {
+    fprintf(stderr, "error: Partial read of memory in remote process.\n");
+    return -2;
+  }
+  return 0;
+}
 #elif defined(__WIN32)
 #include <windows.h> /* for ReadProcessMemory, GetLastError */
 
@@ -43,6 +234,8 @@ ssize_t copy_address(phandle pid, void *addr, void *data, size_t len) {
             GetLastError());
     return -1;
   }
+  stats.reads++;
+  stats.bytes += len;
   return len;
 }
 #elif defined(__MACH__) // macOS support.
@@ -55,18 +248,71 @@ ssize_t copy_address(phandle task, void *addr, void *data, size_t len)
 #error "No support for this platform."
 #endif
 
-int copy_context(phandle pid, void *addr, RCNTXT *data) {
-  if (!addr) {
-    return -1;
+#ifndef __linux
+int copy_set_backend(const char *name, int allow_fallback) {
+  fprintf(stderr, "error: Memory backends are not supported on this platform.\n");
+  return -1;
+}
+
+const char *copy_get_backend(void) {
+  return "default";
+}
+
+int copy_addresses(phandle pid, struct copy_req *reqs, int n) {
+  /* No vectored reads on this platform, so fall back to one at a time. */
+  for (int i = 0; i < n; i++) {
+    if (!reqs[i].addr) {
+      return -1;
+    }
+    if (copy_address(pid, reqs[i].addr, reqs[i].data, reqs[i].len) < reqs[i].len) {
+      return -2;
+    }
   }
+  return 0;
+}
 
-  size_t len = sizeof(RCNTXT);
-  ssize_t bytes = copy_address(pid, addr, data, len);
-  if (bytes < len) {
-    return -2;
+void copy_release(phandle pid) {
+  return;
+}
+#endif
+
+void copy_context_layout(struct rcntxt_layout *out, ptrdiff_t prstack_shift,
+                         ptrdiff_t srcref_shift) {
+  out->evaldepth = offsetof(RCNTXT, evaldepth);
+  out->prstack = offsetof(RCNTXT, prstack) + prstack_shift;
+  out->srcref = offsetof(RCNTXT, srcref) + srcref_shift;
+}
+
+int copy_context_reqs(void *addr, const struct rcntxt_layout *layout,
+                      RCNTXT *data, struct copy_req *reqs) {
+  char *remote = (char *) addr;
+
+  /* Only the fields we actually use are read, which avoids copying (among
+     other things) the sizeable cjmpbuf. */
+  reqs[0].addr = remote;
+  reqs[0].data = data;
+  reqs[0].len = offsetof(RCNTXT, callflag) + sizeof(int);
+  reqs[1].addr = remote + layout->evaldepth;
+  reqs[1].data = &data->evaldepth;
+  reqs[1].len = offsetof(RCNTXT, cloenv) + sizeof(SEXP) -
+    offsetof(RCNTXT, evaldepth);
+  reqs[2].addr = remote + layout->prstack;
+  reqs[2].data = &data->prstack;
+  reqs[2].len = sizeof(struct RPRSTACK *);
+
+  return MAX_CONTEXT_REQS;
+}
+
+int copy_context(phandle pid, void *addr, const struct rcntxt_layout *layout,
+                 RCNTXT *data) {
+  struct copy_req reqs[MAX_CONTEXT_REQS];
+
+  if (!addr) {
+    return -1;
   }
 
-  return 0;
+  int n = copy_context_reqs(addr, layout, data, reqs);
+  return copy_addresses(pid, reqs, n);
 }
 
 int copy_sexp(phandle pid, void *addr, SEXP data) {
@@ -102,7 +348,8 @@ int copy_char(phandle pid, void *addr, char *data, size_t max_len) {
     return -2;
   }
 
-  len = vec.s.vecsxp.length + 1 > max_len ? max_len : vec.s.vecsxp.length + 1;
+  /* Leave room for the trailing '\0' if the string is truncated. */
+  len = vec.s.vecsxp.length + 1 > max_len - 1 ? max_len - 1 : vec.s.vecsxp.length + 1;
 
   data[len] = '\0';
   bytes = copy_address(pid, str_addr, data, len);
@@ -4,8 +4,44 @@
 #include "process.h" /* for phandle */
 #include "rdefs.h"  /* for RCNTXT, SEXP */
 
+/* One of several reads issued together by copy_addresses(). */
+struct copy_req {
+  void *addr;
+  void *data;
+  size_t len;
+};
+
+/* Running totals of the reads made by the functions below. */
+struct copy_stats {
+  unsigned long reads;
+  unsigned long bytes;
+};
+
+int copy_set_backend(const char *name, int allow_fallback);
+const char *copy_get_backend(void);
+void copy_get_stats(struct copy_stats *out);
+
 ssize_t copy_address(phandle pid, void *addr, void *data, size_t len);
-int copy_context(phandle pid, void *addr, RCNTXT *data);
+int copy_addresses(phandle pid, struct copy_req *reqs, int n);
+/* Release anything held open for reading the memory of a process that has
+   gone away. */
+void copy_release(phandle pid);
+/* Offsets of the RCNTXT fields we read, which vary with the version of R. */
+struct rcntxt_layout {
+  size_t evaldepth;     /* Followed by promargs, callfun, sysparent, call, and
+                           cloenv in all versions. */
+  size_t prstack;
+  size_t srcref;
+};
+
+#define MAX_CONTEXT_REQS 3
+
+void copy_context_layout(struct rcntxt_layout *out, ptrdiff_t prstack_shift,
+                         ptrdiff_t srcref_shift);
+int copy_context_reqs(void *addr, const struct rcntxt_layout *layout,
+                      RCNTXT *data, struct copy_req *reqs);
+int copy_context(phandle pid, void *addr, const struct rcntxt_layout *layout,
+                 RCNTXT *data);
 int copy_sexp(phandle pid, void *addr, SEXP data);
 int copy_char(phandle pid, void *addr, char *data, size_t max_len);
 
@@ -0,0 +1,393 @@
+#include <stdio.h>      /* for fprintf, snprintf */
+#include <stdlib.h>     /* for calloc, free */
+
+#include "native.h"
+
+#ifdef __linux
+#include <string.h>     /* for memcpy, strcmp, strlen, strncmp */
+#include <sys/ptrace.h> /* for ptrace */
+#include <sys/user.h>   /* for user_regs_struct */
+#include <libunwind-ptrace.h>
+
+#include "maps.h"
+#include "memory.h"
+#include "symbols.h"
+
+/* How much of the stack is read at a time when following frame pointers. */
+#define STACK_WINDOW 16384
+
+#define UNWIND_DWARF 0
+#define UNWIND_FP 1
+
+static int unwinder = UNWIND_DWARF;
+
+struct native_cursor {
+  phandle pid;
+  unw_addr_space_t as;
+  void *upt;
+  unw_cursor_t cursor;
+  struct proc_maps *maps;
+  struct symbol_table *symbols;
+  int depth;
+  /* The current frame, while following frame pointers. */
+  int use_fp;
+  uintptr_t ip;
+  uintptr_t sp;
+  uintptr_t fp;
+  uintptr_t stack_start;
+  size_t stack_len;
+  char stack[STACK_WINDOW];
+};
+
+int native_set_unwinder(const char *name) {
+  if (strcmp(name, "dwarf") == 0) {
+    unwinder = UNWIND_DWARF;
+    return 0;
+  }
+  if (strcmp(name, "fp") == 0) {
+#ifdef __x86_64__
+    unwinder = UNWIND_FP;
+    return 0;
+#else
+    fprintf(stderr, "error: Frame pointer unwinding is not supported on this architecture.\n");
+    return -1;
+#endif
+  }
+  fprintf(stderr, "error: Unknown native unwinder '%s'.\n", name);
+  return -1;
+}
+
+/* Functions that implement R's evaluator. Time spent in these is attributed to
+   the R frames instead, so they are elided from interleaved stacks. */
+static const char *eval_functions[] = {
+  "Rf_eval",
+  "bcEval",
+  "bcEval_loop",
+  "forcePromise",
+  "applyClosure",
+  "Rf_applyClosure",
+  "R_execClosure",
+  "R_execMethod",
+  "R_forceAndCall",
+  "Rf_evalList",
+  "Rf_evalListKeepMissing",
+  "Rf_promiseArgs",
+  "dispatchMethod",
+  "Rf_usemethod",
+  "do_usemethod",
+  "Rf_DispatchOrEval",
+  "Rf_DispatchGroup",
+  "do_begin",
+  "do_if",
+  "do_for",
+  "do_while",
+  "do_repeat",
+  "do_set",
+  "do_internal",
+  "do_dotcall",
+  "do_dotCode",
+  "do_External",
+  NULL
+};
+
+/* No R code runs outside of these. */
+static const char *toplevel_functions[] = {
+  "Rf_ReplIteration",
+  "R_ReplDLLdo1",
+  "R_ReplFile",
+  NULL
+};
+
+/* Compilers sometimes add suffixes like ".lto_priv.0" to local symbols. */
+static int match_function(const char *sym, const char **names) {
+  for (int i = 0; names[i]; i++) {
+    size_t len = strlen(names[i]);
+    if (strncmp(sym, names[i], len) == 0 &&
+        (sym[len] == '\0' || sym[len] == '.')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+struct native_cursor *native_create(phandle pid) {
+  struct native_cursor *out = calloc(1, sizeof(struct native_cursor));
+  if (!out) {
+    return NULL;
+  }
+  out->pid = pid;
+  out->as = unw_create_addr_space(&_UPT_accessors, 0);
+  if (!out->as) {
+    fprintf(stderr, "error: Failed to create libunwind address space.\n");
+    free(out);
+    return NULL;
+  }
+  unw_set_caching_policy(out->as, UNW_CACHE_GLOBAL);
+  out->upt = _UPT_create(pid);
+  if (!out->upt || !(out->maps = maps_create(pid)) ||
+      !(out->symbols = symbols_create(pid, out->maps))) {
+    native_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+void native_destroy(struct native_cursor *cursor) {
+  if (!cursor) {
+    return;
+  }
+  if (cursor->upt) {
+    _UPT_destroy(cursor->upt);
+  }
+  unw_destroy_addr_space(cursor->as);
+  symbols_destroy(cursor->symbols);
+  maps_destroy(cursor->maps);
+  return free(cursor);
+}
+
+/* Start from the registers of the (stopped) thread. */
+static int fp_init(struct native_cursor *cursor) {
+#ifdef __x86_64__
+  struct user_regs_struct regs;
+  if (ptrace(PTRACE_GETREGS, cursor->pid, NULL, &regs) < 0) {
+    perror("error: Failed to read registers");
+    return -1;
+  }
+  cursor->ip = regs.rip;
+  cursor->sp = regs.rsp;
+  cursor->fp = regs.rbp;
+  cursor->stack_len = 0;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Read the saved frame pointer and return address at fp, reading the stack a
+   window at a time so that most frames don't need a read of their own. */
+static int read_frame_record(struct native_cursor *cursor, uintptr_t fp,
+                             uintptr_t *record) {
+  size_t len = 2 * sizeof(uintptr_t);
+  if (fp < cursor->stack_start ||
+      fp + len > cursor->stack_start + cursor->stack_len) {
+    const struct proc_map *map = maps_find(cursor->maps, fp);
+    if (!map || map->exec || fp + len > map->end) {
+      return -1;
+    }
+    size_t window = map->end - fp < STACK_WINDOW ? map->end - fp : STACK_WINDOW;
+    if (copy_address(cursor->pid, (void *) fp, cursor->stack, window) <
+        (ssize_t) window) {
+      cursor->stack_len = 0;
+      return -1;
+    }
+    cursor->stack_start = fp;
+    cursor->stack_len = window;
+  }
+  memcpy(record, cursor->stack + (fp - cursor->stack_start), len);
+  return 0;
+}
+
+/* Move to the caller by following the frame pointer. Returns zero at the end
+   of the chain, or a negative value if it looks broken. */
+static int fp_step(struct native_cursor *cursor) {
+  uintptr_t record[2], fp = cursor->fp;
+  if (fp == 0) {
+    return 0;
+  }
+  if (fp % sizeof(uintptr_t) != 0 || fp < cursor->sp ||
+      read_frame_record(cursor, fp, record) < 0) {
+    return -1;
+  }
+  /* Frames must move up the stack and return to executable code. */
+  if (record[0] != 0 && record[0] <= fp) {
+    return -1;
+  }
+  const struct proc_map *map = maps_find(cursor->maps, record[1]);
+  if (!map || !map->exec) {
+    return -1;
+  }
+  cursor->ip = record[1];
+  cursor->sp = fp + 2 * sizeof(uintptr_t);
+  cursor->fp = record[0];
+  return 1;
+}
+
+/* Hand the rest of the walk over to libunwind, e.g. when a library built
+   without frame pointers breaks the chain, skipping the frames we have already
+   seen. */
+static int fp_fallback(struct native_cursor *cursor) {
+  unw_word_t sp;
+  int ret;
+  cursor->use_fp = 0;
+  if ((ret = unw_init_remote(&cursor->cursor, cursor->as, cursor->upt)) < 0) {
+    fprintf(stderr, "error: Failed to initialize libunwind cursor: %d.\n", ret);
+    return ret;
+  }
+  do {
+    if ((ret = unw_get_reg(&cursor->cursor, UNW_REG_SP, &sp)) < 0) {
+      fprintf(stderr, "error: Failed to get SP register via libunwind: %d.\n",
+              ret);
+      return ret;
+    }
+    if (sp > cursor->sp) {
+      return 1;
+    }
+  } while ((ret = unw_step(&cursor->cursor)) > 0);
+  if (ret < 0) {
+    fprintf(stderr, "error: Failed to step libunwind cursor: %d.\n", ret);
+  }
+  return ret;
+}
+
+int native_init(struct native_cursor *cursor) {
+  int ret;
+  cursor->depth = 0;
+  cursor->use_fp = unwinder == UNWIND_FP;
+  if (cursor->use_fp) {
+    return fp_init(cursor);
+  }
+  if ((ret = unw_init_remote(&cursor->cursor, cursor->as, cursor->upt)) < 0) {
+    fprintf(stderr, "error: Failed to initialize libunwind cursor: %d.\n", ret);
+    return ret;
+  }
+  return 0;
+}
+
+/* Identify native code we can't name by its module and file offset, which
+   (unlike the raw address) is stable and can be symbolized later. */
+static void format_ip(struct native_cursor *cursor, unw_word_t ip, char *buff,
+                      size_t len) {
+  const struct proc_map *map = maps_find(cursor->maps, (uintptr_t) ip);
+  if (map && map->path) {
+    snprintf(buff, len, "<Native:%s+0x%lx>", map->name,
+             (unsigned long) (ip - map->start + map->offset));
+  } else {
+    snprintf(buff, len, "<Native:0x%lx>", (unsigned long) ip);
+  }
+}
+
+static int classify_frame(const char *sym, char *buff, size_t len) {
+  if (match_function(sym, toplevel_functions)) {
+    return NATIVE_TOPLEVEL;
+  }
+  /* TODO: Not sure what's going on here. */
+  if (match_function(sym, eval_functions) || strncmp(sym, "do_Rprof", 8) == 0) {
+    return NATIVE_EVAL;
+  }
+
+  snprintf(buff, len, "<Native:%s>", sym);
+  return NATIVE_FRAME;
+}
+
+int native_get_frame(struct native_cursor *cursor, char *buff, size_t len,
+                     uintptr_t *sp) {
+  char sym[256];
+  unw_word_t offset, ip, reg;
+  unw_proc_info_t info;
+  int ret, have_info = 1;
+
+  if (cursor->use_fp) {
+    *sp = cursor->sp;
+    const char *name = symbols_lookup(cursor->symbols,
+                                      cursor->ip - (cursor->depth > 0));
+    if (name) {
+      return classify_frame(name, buff, len);
+    }
+    format_ip(cursor, cursor->ip, buff, len);
+    return NATIVE_FRAME;
+  }
+
+  if ((ret = unw_get_reg(&cursor->cursor, UNW_REG_IP, &ip)) < 0) {
+    fprintf(stderr, "error: Failed to get IP register via libunwind: %d.\n",
+            ret);
+    return ret;
+  }
+  if ((ret = unw_get_reg(&cursor->cursor, UNW_REG_SP, &reg)) < 0) {
+    fprintf(stderr, "error: Failed to get SP register via libunwind: %d.\n",
+            ret);
+    return ret;
+  }
+  *sp = (uintptr_t) reg;
+
+  /* Prefer our own index of the module's symbols, which doesn't need to read
+     anything from the process. Return addresses in outer frames can point just
+     past the end of the calling function, so look up the call itself. */
+  const char *name = symbols_lookup(cursor->symbols,
+                                    (uintptr_t) ip - (cursor->depth > 0));
+  if (name) {
+    return classify_frame(name, buff, len);
+  }
+
+  /* Otherwise fall back to libunwind, e.g. for JIT-compiled code. */
+  if ((ret = unw_get_proc_info(&cursor->cursor, &info)) < 0) {
+    if (ret != -UNW_ENOINFO) {
+      fprintf(stderr, "error: Failed to get proc info via libunwind: %d.\n",
+              ret);
+      return ret;
+    }
+    have_info = 0;
+  }
+
+  sym[0] = '\0';
+  if ((ret = unw_get_proc_name(&cursor->cursor, sym, sizeof(sym), &offset)) < 0) {
+    if (ret == -UNW_EUNSPEC || ret == -UNW_ENOINFO) {
+      format_ip(cursor, ip, buff, len);
+      return NATIVE_FRAME;
+    } else if (ret != -UNW_ENOMEM) {
+      fprintf(stderr, "error: Failed to get proc symbol via libunwind: %d.\n",
+              ret);
+      return ret;
+    }
+    /* Symbol is truncated but otherwise fine. */
+  }
+
+  /* We're not actually in the named procedure, but nearby. */
+  if (have_info && ip > info.end_ip) {
+    format_ip(cursor, ip, buff, len);
+    return NATIVE_FRAME;
+  }
+
+  return classify_frame(sym, buff, len);
+}
+
+int native_step(struct native_cursor *cursor) {
+  int ret;
+  cursor->depth++;
+  if (cursor->use_fp) {
+    ret = fp_step(cursor);
+    return ret < 0 ? fp_fallback(cursor) : ret;
+  }
+  ret = unw_step(&cursor->cursor);
+  if (ret < 0) {
+    fprintf(stderr, "error: Failed to step libunwind cursor: %d.\n", ret);
+  }
+  return ret;
+}
+#else
+int native_set_unwinder(const char *name) {
+  fprintf(stderr, "error: Native stacks are not supported on this platform.\n");
+  return -1;
+}
+
+struct native_cursor *native_create(phandle pid) {
+  fprintf(stderr, "error: Native stacks are not supported on this platform.\n");
+  return NULL;
+}
+
+void native_destroy(struct native_cursor *cursor) {
+  return;
+}
+
+int native_init(struct native_cursor *cursor) {
+  return -1;
+}
+
+int native_get_frame(struct native_cursor *cursor, char *buff, size_t len,
+                     uintptr_t *sp) {
+  return -1;
+}
+
+int native_step(struct native_cursor *cursor) {
+  return -1;
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef XRPROF_NATIVE_H
+#define XRPROF_NATIVE_H
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uintptr_t */
+#include "process.h"
+
+/* Kinds of native frame returned by native_get_frame(). */
+#define NATIVE_FRAME 1    /* An ordinary frame. */
+#define NATIVE_EVAL 2     /* Part of R's evaluator, which R frames stand for. */
+#define NATIVE_TOPLEVEL 3 /* The REPL; the R stack ends here. */
+
+/* A cursor for walking the native stack of a (suspended) process. */
+struct native_cursor;
+
+/* Choose how native stacks are walked: "dwarf" (the default) uses libunwind,
+   while "fp" follows frame pointers, falling back on libunwind where the chain
+   is broken. */
+int native_set_unwinder(const char *name);
+
+struct native_cursor *native_create(phandle pid);
+void native_destroy(struct native_cursor *cursor);
+int native_init(struct native_cursor *cursor);
+/* Write the name of the current frame to buff as "<Native:...>" and its stack
+   pointer to sp. Returns one of the kinds above, or a negative value on
+   error. */
+int native_get_frame(struct native_cursor *cursor, char *buff, size_t len,
+                     uintptr_t *sp);
+int native_step(struct native_cursor *cursor);
+
+#endif /* XRPROF_NATIVE_H */
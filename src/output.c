@@ -0,0 +1,416 @@
+#include <errno.h>    /* for ETIMEDOUT */
+#include <pthread.h>
+#include <stdarg.h>   /* for va_list */
+#include <stdio.h>    /* for fopen, fwrite, fflush, vsnprintf */
+#include <stdlib.h>   /* for malloc, realloc, free */
+#include <string.h>   /* for memcpy, strlen, strcmp */
+#include <time.h>     /* for clock_gettime */
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __WIN32
+#include <fcntl.h>    /* for _O_BINARY */
+#include <io.h>       /* for _setmode */
+#endif
+
+#include "output.h"
+
+/* Wake the writer thread once this much output is pending. */
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+/* Make output_wait() block once this much output is pending. */
+#define OUTPUT_MAX_PENDING (16 * OUTPUT_CHUNK_SIZE)
+/* Compressed output is written out in chunks of this size. */
+#define OUTPUT_SCRATCH_SIZE (64 * 1024)
+/* How often (in seconds) everything written so far is made durable. For the
+   compressed formats, this ends the current gzip member or zstd frame, so that
+   the file can be decompressed in full even if xrprof dies partway through. */
+#define OUTPUT_FLUSH_INTERVAL 2
+
+enum output_format {
+  OUTPUT_NONE,
+  OUTPUT_GZIP,
+  OUTPUT_ZSTD
+};
+
+struct buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct output {
+  FILE *file;
+  enum output_format format;
+  z_stream gz;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd;
+#endif
+  char *scratch;
+  int dirty;            /* Output written since the last flush. */
+  int failed;           /* Set by the writer thread on error. */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  /* Signalled when pending is taken, and when a flush is done. */
+  pthread_cond_t drained;
+  struct buffer pending; /* Filled by output_write(), under the lock. */
+  struct buffer work;    /* Owned by the writer thread. */
+  int flush;
+  int closing;
+  /* Counts of flushes asked for by output_flush() and those done since. */
+  unsigned long flushes_requested;
+  unsigned long flushes_done;
+};
+
+static int buffer_reserve(struct buffer *buf, size_t len) {
+  if (buf->len + len <= buf->cap) {
+    return 0;
+  }
+  size_t cap = buf->cap ? buf->cap : OUTPUT_CHUNK_SIZE;
+  while (cap < buf->len + len) {
+    cap *= 2;
+  }
+  char *data = realloc(buf->data, cap);
+  if (!data) {
+    return -1;
+  }
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+static int write_plain(struct output *out, const char *data, size_t len,
+                       int end) {
+  if (len > 0 && fwrite(data, 1, len, out->file) < len) {
+    return -1;
+  }
+  return 0;
+}
+
+static int write_gzip(struct output *out, const char *data, size_t len,
+                      int end) {
+  int ret;
+  out->gz.next_in = (Bytef *) data;
+  out->gz.avail_in = len;
+  do {
+    out->gz.next_out = (Bytef *) out->scratch;
+    out->gz.avail_out = OUTPUT_SCRATCH_SIZE;
+    ret = deflate(&out->gz, end ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_ERROR) {
+      return -1;
+    }
+    size_t have = OUTPUT_SCRATCH_SIZE - out->gz.avail_out;
+    if (have > 0 && fwrite(out->scratch, 1, have, out->file) < have) {
+      return -1;
+    }
+  } while (out->gz.avail_out == 0 || (end && ret != Z_STREAM_END));
+
+  /* Concatenated gzip members are still a valid gzip file. */
+  if (end && deflateReset(&out->gz) != Z_OK) {
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int write_zstd(struct output *out, const char *data, size_t len,
+                      int end) {
+  ZSTD_inBuffer in = {data, len, 0};
+  size_t remaining;
+  do {
+    ZSTD_outBuffer buf = {out->scratch, OUTPUT_SCRATCH_SIZE, 0};
+    remaining = ZSTD_compressStream2(out->zstd, &buf, &in,
+                                     end ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(remaining)) {
+      return -1;
+    }
+    if (buf.pos > 0 && fwrite(out->scratch, 1, buf.pos, out->file) < buf.pos) {
+      return -1;
+    }
+  } while (end ? remaining != 0 : in.pos < in.size);
+  return 0;
+}
+#endif
+
+static int output_emit(struct output *out, const char *data, size_t len,
+                       int end) {
+  int ret = 0;
+  end = end && (out->dirty || len > 0);
+  switch (out->format) {
+  case OUTPUT_GZIP:
+    ret = write_gzip(out, data, len, end);
+    break;
+#ifdef HAVE_ZSTD
+  case OUTPUT_ZSTD:
+    ret = write_zstd(out, data, len, end);
+    break;
+#endif
+  default:
+    ret = write_plain(out, data, len, end);
+    break;
+  }
+  out->dirty = !end && (out->dirty || len > 0);
+  if (ret == 0 && end && fflush(out->file) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+static void *output_thread(void *data) {
+  struct output *out = (struct output *) data;
+  int done = 0;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += OUTPUT_FLUSH_INTERVAL;
+
+  pthread_mutex_lock(&out->lock);
+  while (!done) {
+    while (!out->closing && !out->flush &&
+           out->pending.len < OUTPUT_CHUNK_SIZE) {
+      if (pthread_cond_timedwait(&out->wake, &out->lock, &deadline) ==
+          ETIMEDOUT) {
+        out->flush = 1;
+      }
+    }
+    int flush = out->flush || out->closing;
+    unsigned long requested = out->flushes_requested;
+    done = out->closing;
+    out->flush = 0;
+
+    /* Swap buffers so that writers are not blocked while we compress. */
+    struct buffer tmp = out->work;
+    out->work = out->pending;
+    out->pending = tmp;
+    out->pending.len = 0;
+    pthread_cond_broadcast(&out->drained);
+    pthread_mutex_unlock(&out->lock);
+
+    int failed = out->failed;
+    if (!failed && output_emit(out, out->work.data, out->work.len, flush) < 0) {
+      failed = 1;
+    }
+
+    if (flush) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += OUTPUT_FLUSH_INTERVAL;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    out->failed = failed;
+    if (flush) {
+      out->flushes_done = requested;
+      pthread_cond_broadcast(&out->drained);
+    }
+  }
+  pthread_mutex_unlock(&out->lock);
+
+  return NULL;
+}
+
+static enum output_format output_format_from_path(const char *path) {
+  size_t len = path ? strlen(path) : 0;
+  if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+    return OUTPUT_GZIP;
+  } else if ((len > 4 && strcmp(path + len - 4, ".zst") == 0) ||
+             (len > 5 && strcmp(path + len - 5, ".zstd") == 0)) {
+    return OUTPUT_ZSTD;
+  }
+  return OUTPUT_NONE;
+}
+
+struct output *output_open(const char *path, const char *format) {
+  enum output_format fmt;
+  if (!format) {
+    fmt = output_format_from_path(path);
+  } else if (strcmp(format, "none") == 0) {
+    fmt = OUTPUT_NONE;
+  } else if (strcmp(format, "gzip") == 0) {
+    fmt = OUTPUT_GZIP;
+  } else if (strcmp(format, "zstd") == 0) {
+    fmt = OUTPUT_ZSTD;
+  } else {
+    fprintf(stderr, "error: Unknown output format '%s'.\n", format);
+    return NULL;
+  }
+#ifndef HAVE_ZSTD
+  if (fmt == OUTPUT_ZSTD) {
+    fprintf(stderr, "error: xrprof was built without zstd support.\n");
+    return NULL;
+  }
+#endif
+
+  struct output *out = calloc(1, sizeof(struct output));
+  if (!out) {
+    return NULL;
+  }
+  out->format = fmt;
+
+  if (fmt == OUTPUT_GZIP) {
+    /* The extra 16 window bits request a gzip header and trailer. */
+    if (deflateInit2(&out->gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      fprintf(stderr, "error: Failed to initialize gzip compression.\n");
+      free(out);
+      return NULL;
+    }
+  }
+#ifdef HAVE_ZSTD
+  if (fmt == OUTPUT_ZSTD && !(out->zstd = ZSTD_createCCtx())) {
+    fprintf(stderr, "error: Failed to initialize zstd compression.\n");
+    free(out);
+    return NULL;
+  }
+#endif
+
+  if (fmt != OUTPUT_NONE && !(out->scratch = malloc(OUTPUT_SCRATCH_SIZE))) {
+    goto fail;
+  }
+
+  if (!path) {
+    out->file = stdout;
+#ifdef __WIN32
+    if (fmt != OUTPUT_NONE) {
+      _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+  } else if (!(out->file = fopen(path, fmt == OUTPUT_NONE ? "w" : "wb"))) {
+    perror("error: Failed to open output file");
+    goto fail;
+  }
+
+  pthread_mutex_init(&out->lock, NULL);
+  pthread_cond_init(&out->wake, NULL);
+  pthread_cond_init(&out->drained, NULL);
+  if (pthread_create(&out->thread, NULL, output_thread, out) != 0) {
+    fprintf(stderr, "error: Failed to start output thread.\n");
+    pthread_cond_destroy(&out->wake);
+    pthread_cond_destroy(&out->drained);
+    pthread_mutex_destroy(&out->lock);
+    if (out->file != stdout) {
+      fclose(out->file);
+    }
+    goto fail;
+  }
+
+  return out;
+
+ fail:
+  if (fmt == OUTPUT_GZIP) {
+    deflateEnd(&out->gz);
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(out->zstd);
+#endif
+  free(out->scratch);
+  free(out);
+  return NULL;
+}
+
+int output_write(struct output *out, const char *data, size_t len) {
+  int ret = 0;
+  pthread_mutex_lock(&out->lock);
+  if (out->failed || buffer_reserve(&out->pending, len) < 0) {
+    ret = -1;
+  } else {
+    memcpy(out->pending.data + out->pending.len, data, len);
+    out->pending.len += len;
+    if (out->pending.len >= OUTPUT_CHUNK_SIZE) {
+      pthread_cond_signal(&out->wake);
+    }
+  }
+  pthread_mutex_unlock(&out->lock);
+  return ret;
+}
+
+int output_printf(struct output *out, const char *fmt, ...) {
+  va_list args;
+  int ret = 0, len;
+  size_t avail = 256;
+
+  /* Format directly into the pending buffer, growing it if needed. */
+  pthread_mutex_lock(&out->lock);
+  while (1) {
+    if (out->failed || buffer_reserve(&out->pending, avail) < 0) {
+      ret = -1;
+      break;
+    }
+    avail = out->pending.cap - out->pending.len;
+    va_start(args, fmt);
+    len = vsnprintf(out->pending.data + out->pending.len, avail, fmt, args);
+    va_end(args);
+    if (len < 0) {
+      ret = -1;
+      break;
+    } else if (len < avail) {
+      out->pending.len += len;
+      break;
+    }
+    avail = len + 1;
+  }
+  if (out->pending.len >= OUTPUT_CHUNK_SIZE) {
+    pthread_cond_signal(&out->wake);
+  }
+  pthread_mutex_unlock(&out->lock);
+  return ret;
+}
+
+int output_wait(struct output *out) {
+  pthread_mutex_lock(&out->lock);
+  while (!out->failed && out->pending.len > OUTPUT_MAX_PENDING) {
+    pthread_cond_signal(&out->wake);
+    pthread_cond_wait(&out->drained, &out->lock);
+  }
+  int ret = out->failed ? -1 : 0;
+  pthread_mutex_unlock(&out->lock);
+  return ret;
+}
+
+int output_flush(struct output *out) {
+  pthread_mutex_lock(&out->lock);
+  unsigned long requested = ++out->flushes_requested;
+  out->flush = 1;
+  pthread_cond_signal(&out->wake);
+  while (!out->failed && out->flushes_done < requested) {
+    pthread_cond_wait(&out->drained, &out->lock);
+  }
+  int ret = out->failed ? -1 : 0;
+  pthread_mutex_unlock(&out->lock);
+  return ret;
+}
+
+int output_close(struct output *out) {
+  if (!out) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&out->lock);
+  out->closing = 1;
+  pthread_cond_signal(&out->wake);
+  pthread_mutex_unlock(&out->lock);
+  pthread_join(out->thread, NULL);
+
+  int ret = out->failed ? -1 : 0;
+  if (ret < 0) {
+    fprintf(stderr, "error: Failed to write output; some samples were lost.\n");
+  }
+  if (out->file != stdout && fclose(out->file) != 0) {
+    ret = -1;
+  }
+
+  if (out->format == OUTPUT_GZIP) {
+    deflateEnd(&out->gz);
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(out->zstd);
+#endif
+  pthread_cond_destroy(&out->wake);
+  pthread_cond_destroy(&out->drained);
+  pthread_mutex_destroy(&out->lock);
+  free(out->pending.data);
+  free(out->work.data);
+  free(out->scratch);
+  free(out);
+  return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef XRPROF_OUTPUT_H
+#define XRPROF_OUTPUT_H
+
+#include <stddef.h> /* for size_t */
+
+/* Output is buffered in memory and written out (and possibly compressed) on a
+   separate thread, so that writing samples never blocks on the disk, a full
+   pipe, or the compressor. How much is buffered is bounded by output_wait()
+   instead, which can be called when blocking is harmless. */
+struct output;
+
+/* Open the file at path (or standard output, if path is NULL) for writing.
+   The format is one of "none", "gzip", or "zstd"; when it is NULL, the format
+   is inferred from the file extension instead. */
+struct output *output_open(const char *path, const char *format);
+int output_printf(struct output *out, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+int output_write(struct output *out, const char *data, size_t len);
+/* Block while more than a bounded amount of output is waiting to be written
+   out, such as when the disk or a pipe can't keep up. Returns a negative value
+   if output has failed. */
+int output_wait(struct output *out);
+/* Write out (but do not close) everything written so far, and wait until that
+   is done. Returns a negative value if output has failed. */
+int output_flush(struct output *out);
+/* Flush any remaining output, stop the writer thread, and close the file.
+   Returns a negative value if any output was lost. */
+int output_close(struct output *out);
+
+#endif /* XRPROF_OUTPUT_H */
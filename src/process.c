@@ -1,11 +1,18 @@
+#ifdef __linux
+#define _GNU_SOURCE  /* for pipe2 */
+#endif
+
 #include <stdio.h>      /* for fprintf */
 
 #include "process.h"
 
 #ifdef __linux
+#include <errno.h>      /* for errno */
+#include <fcntl.h>      /* for O_CLOEXEC */
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>     /* for fork, execvp, pipe2 */
 
 int proc_create(phandle *out, void *data) {
   pid_t *pid = (pid_t *) data;
@@ -61,6 +68,43 @@ int proc_destroy(phandle pid) {
   ptrace(PTRACE_DETACH, pid, NULL, NULL);
   return 0;
 }
+
+int proc_spawn(phandle *out, char **argv) {
+  int fds[2], err;
+
+  /* The child reports a failure to exec through this pipe, which is otherwise
+     closed by a successful exec. */
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("fatal: Failed to create pipe");
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fatal: Failed to start program");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  } else if (pid == 0) {
+    close(fds[0]);
+    execvp(argv[0], argv);
+    err = errno;
+    if (write(fds[1], &err, sizeof(err)) < 0) {
+      /* Nothing we can do. */
+    }
+    _exit(127);
+  }
+
+  close(fds[1]);
+  ssize_t bytes = read(fds[0], &err, sizeof(err));
+  close(fds[0]);
+  if (bytes == sizeof(err)) {
+    waitpid(pid, NULL, 0);
+    errno = err;
+    perror("fatal: Failed to start program");
+    return -1;
+  }
+  return proc_create(out, (void *) &pid);
+}
 #elif defined(__WIN32)
 #include <unistd.h>  /* for pid_t */
 #include <windows.h>
@@ -128,6 +172,11 @@ int proc_destroy(phandle pid) {
   }
   return 0;
 }
+
+int proc_spawn(phandle *out, char **argv) {
+  fprintf(stderr, "fatal: Starting programs is not supported on Windows.\n");
+  return -1;
+}
 #elif defined(__MACH__) // macOS support.
 int proc_create(phandle *out, void *data)
 {
@@ -152,6 +201,12 @@ int proc_destroy(phandle pid)
 {
   return 0;
 }
+
+int proc_spawn(phandle *out, char **argv)
+{
+  fprintf(stderr, "fatal: Starting programs is not supported on macOS.\n");
+  return -1;
+}
 #else
 #error "No support for this platform."
 #endif
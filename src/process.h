@@ -12,5 +12,8 @@ int proc_create(phandle *out, void *data);
 int proc_suspend(phandle pid);
 int proc_resume(phandle pid);
 int proc_destroy(phandle pid);
+/* Start a program (with the arguments in argv, which ends in NULL) and attach
+   to it, as proc_create() does. */
+int proc_spawn(phandle *out, char **argv);
 
 #endif /* XRPROF_PROCESS_H */
@@ -32,19 +32,31 @@
 /* From Rinternals.h: */
 
 typedef unsigned int SEXPTYPE;
+#define NILSXP 0
 #define SYMSXP 1
+#define LISTSXP 2
+#define CLOSXP 3
+#define ENVSXP 4
+#define PROMSXP 5
 #define LANGSXP 6
+#define CHARSXP 9
+#define INTSXP 13
+#define STRSXP 16
+#define VECSXP 19
 
 typedef struct SEXPREC *SEXP;
 
 struct sxpinfo_struct {
   SEXPTYPE type      :  5;
-  /* We don't need any of the other fields at the moment. */
+  /* We don't need most of the other fields at the moment. */
 #ifdef R344_COMPAT
   unsigned int pad   : 27;
 #else
   /* This header changed from 32 bits to 64 after R 3.4.4. */
-  unsigned long long pad  : 59;
+  unsigned long long scalar : 1;
+  unsigned long long obj    : 1;
+  unsigned long long alt    : 1;
+  unsigned long long pad  : 56;
 #endif
 };
 
@@ -75,6 +87,24 @@ struct listsxp_struct {
   struct SEXPREC *tagval;
 };
 
+struct closxp_struct {
+  struct SEXPREC *formals;
+  struct SEXPREC *body;
+  struct SEXPREC *env;
+};
+
+struct envsxp_struct {
+  struct SEXPREC *frame;
+  struct SEXPREC *enclos;
+  struct SEXPREC *hashtab;
+};
+
+struct promsxp_struct {
+  struct SEXPREC *value;
+  struct SEXPREC *expr;
+  struct SEXPREC *env;
+};
+
 #define SEXPREC_HEADER \
   struct sxpinfo_struct sxpinfo; \
   struct SEXPREC *attrib; \
@@ -83,9 +113,13 @@ struct listsxp_struct {
 typedef struct SEXPREC {
   SEXPREC_HEADER;
   union {
-    /* We only need symbols and lists right now. */
+    /* We only need symbols, lists, closures, environments, and promises right
+       now. */
     struct symsxp_struct symsxp;
     struct listsxp_struct listsxp;
+    struct closxp_struct closxp;
+    struct envsxp_struct envsxp;
+    struct promsxp_struct promsxp;
   } u;
 } SEXPREC;
 
@@ -97,9 +131,25 @@ typedef struct VECTOR_SEXPREC {
 typedef union { VECTOR_SEXPREC s; double align; } SEXPREC_ALIGN;
 
 #define TYPEOF(x) ((x)->sxpinfo.type)
+/* ALTREP vectors (R 3.5.0 and later) keep their data elsewhere. */
+#ifdef R344_COMPAT
+#define ALTREP(x) 0
+#else
+#define ALTREP(x) ((x)->sxpinfo.alt)
+#endif
+#define ATTRIB(x) ((x)->attrib)
 #define CAR(x) ((x)->u.listsxp.carval)
 #define CDR(x) ((x)->u.listsxp.cdrval)
+#define TAG(x) ((x)->u.listsxp.tagval)
+#define BODY(x) ((x)->u.closxp.body)
+#define CLOENV(x) ((x)->u.closxp.env)
+#define FRAME(x) ((x)->u.envsxp.frame)
+#define ENCLOS(x) ((x)->u.envsxp.enclos)
+#define HASHTAB(x) ((x)->u.envsxp.hashtab)
+#define PRCODE(x) ((x)->u.promsxp.expr)
+#define PRVALUE(x) ((x)->u.promsxp.value)
 #define PRINTNAME(x) ((x)->u.symsxp.pname)
+#define SYMVALUE(x) ((x)->u.symsxp.value)
 #define STDVEC_DATAPTR(x) ((void *) (((SEXPREC_ALIGN *) (x)) + 1))
 
 /* From gnuwin32/fixed/h/psignal.h */
@@ -127,6 +177,12 @@ typedef struct {
   } u;
 } R_bcstack_t;
 
+/* Pending promises, as in eval.c's forcePromise(). */
+typedef struct RPRSTACK {
+  SEXP promise;
+  struct RPRSTACK *next;
+} RPRSTACK;
+
 /* Evaluation Context Structure */
 typedef struct RCNTXT {
   struct RCNTXT *nextcontext;   /* The next context up the chain */
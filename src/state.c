@@ -0,0 +1,201 @@
+#include <stdio.h>      /* for fprintf, snprintf */
+#include <stdlib.h>     /* for calloc, free */
+
+#include "state.h"
+
+#ifdef __linux
+#include <fcntl.h>      /* for open */
+#include <string.h>     /* for strrchr */
+#include <sys/syscall.h> /* for SYS_* */
+#include <unistd.h>     /* for pread, close */
+
+struct proc_state {
+  int stat_fd;
+  int syscall_fd;
+  char state;           /* As of the last call to state_read(). */
+};
+
+/* Names for the system calls an R process is most likely to be blocked in.
+   Others are reported by number. */
+static const struct {
+  long nr;
+  const char *name;
+} syscall_names[] = {
+  {SYS_read, "read"},
+  {SYS_write, "write"},
+  {SYS_readv, "readv"},
+  {SYS_writev, "writev"},
+  {SYS_pread64, "pread64"},
+  {SYS_pwrite64, "pwrite64"},
+  {SYS_openat, "openat"},
+  {SYS_close, "close"},
+  {SYS_fsync, "fsync"},
+  {SYS_fdatasync, "fdatasync"},
+  {SYS_ppoll, "ppoll"},
+  {SYS_pselect6, "pselect6"},
+  {SYS_epoll_pwait, "epoll_pwait"},
+  {SYS_futex, "futex"},
+  {SYS_nanosleep, "nanosleep"},
+  {SYS_clock_nanosleep, "clock_nanosleep"},
+  {SYS_wait4, "wait4"},
+  {SYS_waitid, "waitid"},
+  {SYS_connect, "connect"},
+  {SYS_accept4, "accept4"},
+  {SYS_recvfrom, "recvfrom"},
+  {SYS_sendto, "sendto"},
+  {SYS_recvmsg, "recvmsg"},
+  {SYS_sendmsg, "sendmsg"},
+  {SYS_mmap, "mmap"},
+  {SYS_munmap, "munmap"},
+  {SYS_brk, "brk"},
+  {SYS_madvise, "madvise"},
+  /* Sleeps that were interrupted (including by xrprof) resume with this. */
+  {SYS_restart_syscall, "restart_syscall"},
+#ifdef SYS_open
+  {SYS_open, "open"},
+#endif
+#ifdef SYS_poll
+  {SYS_poll, "poll"},
+#endif
+#ifdef SYS_select
+  {SYS_select, "select"},
+#endif
+#ifdef SYS_epoll_wait
+  {SYS_epoll_wait, "epoll_wait"},
+#endif
+#ifdef SYS_accept
+  {SYS_accept, "accept"},
+#endif
+#ifdef SYS_pause
+  {SYS_pause, "pause"},
+#endif
+};
+
+static int open_proc_file(phandle pid, const char *name) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  return open(path, O_RDONLY);
+}
+
+struct proc_state *state_create(phandle pid) {
+  struct proc_state *out = calloc(1, sizeof(struct proc_state));
+  if (!out) {
+    return NULL;
+  }
+
+  /* These are kept open and re-read with pread(), which regenerates their
+     contents, rather than being opened again for every sample. */
+  out->syscall_fd = -1;
+  if ((out->stat_fd = open_proc_file(pid, "stat")) < 0) {
+    perror("error: Cannot open process stat file");
+    state_destroy(out);
+    return NULL;
+  }
+  /* Not all kernels have this file. */
+  if ((out->syscall_fd = open_proc_file(pid, "syscall")) < 0) {
+    perror("warning: System calls will not be reported");
+  }
+  return out;
+}
+
+void state_destroy(struct proc_state *state) {
+  if (!state) {
+    return;
+  }
+  if (state->stat_fd >= 0) {
+    close(state->stat_fd);
+  }
+  if (state->syscall_fd >= 0) {
+    close(state->syscall_fd);
+  }
+  return free(state);
+}
+
+int state_read(struct proc_state *state) {
+  char buff[512];
+  state->state = '\0';
+
+  /* The state is only needed when the system call can't be read. */
+  if (state->syscall_fd >= 0) {
+    return 0;
+  }
+
+  ssize_t bytes = pread(state->stat_fd, buff, sizeof(buff) - 1, 0);
+  if (bytes <= 0) {
+    return -1;
+  }
+  buff[bytes] = '\0';
+
+  /* The format is "pid (comm) state ...", but comm can contain anything,
+     including spaces and parentheses. */
+  char *end = strrchr(buff, ')');
+  if (!end || end[1] != ' ' || end[2] == '\0') {
+    return -1;
+  }
+  state->state = end[2];
+  return 0;
+}
+
+int state_get_frame(struct proc_state *state, char *buff, size_t len) {
+  char data[256];
+  long nr;
+
+  /* The format is "nr arg1 ... arg6 sp pc" inside a system call, "-1 sp pc"
+     outside of one, or "running" (which we won't see while it is stopped). */
+  ssize_t bytes = -1;
+  if (state->syscall_fd >= 0) {
+    bytes = pread(state->syscall_fd, data, sizeof(data) - 1, 0);
+  }
+  if (bytes > 0) {
+    data[bytes] = '\0';
+    if (sscanf(data, "%ld", &nr) != 1) {
+      return 0;
+    } else if (nr < 0) {
+      /* Interrupted in user space, so it must have been running. */
+      snprintf(buff, len, "<Runnable>");
+      return 1;
+    } else {
+      for (int i = 0; i < sizeof(syscall_names) / sizeof(syscall_names[0]); i++) {
+        if (syscall_names[i].nr == nr) {
+          snprintf(buff, len, "<Syscall:%s>", syscall_names[i].name);
+          return 1;
+        }
+      }
+      snprintf(buff, len, "<Syscall:%ld>", nr);
+      return 1;
+    }
+  }
+
+  /* Otherwise, fall back on the scheduler state. */
+  switch (state->state) {
+  case 'R':
+    snprintf(buff, len, "<Runnable>");
+    return 1;
+  case 'S':
+    snprintf(buff, len, "<Sleeping>");
+    return 1;
+  case 'D':
+    snprintf(buff, len, "<DiskSleep>");
+    return 1;
+  default:
+    return 0;
+  }
+}
+#else
+struct proc_state *state_create(phandle pid) {
+  fprintf(stderr, "error: Process states are not supported on this platform.\n");
+  return NULL;
+}
+
+void state_destroy(struct proc_state *state) {
+  return;
+}
+
+int state_read(struct proc_state *state) {
+  return -1;
+}
+
+int state_get_frame(struct proc_state *state, char *buff, size_t len) {
+  return 0;
+}
+#endif
@@ -0,0 +1,21 @@
+#ifndef XRPROF_STATE_H
+#define XRPROF_STATE_H
+
+#include <stddef.h> /* for size_t */
+#include "process.h"
+
+/* The scheduler state and current system call (if any) of a process, which
+   tell apart time spent computing from time spent blocked. */
+struct proc_state;
+
+struct proc_state *state_create(phandle pid);
+void state_destroy(struct proc_state *state);
+/* Record the scheduler state. This must be called just *before* the process is
+   suspended, since afterwards it will only ever appear to be stopped. */
+int state_read(struct proc_state *state);
+/* Write a pseudo-frame name such as "<Syscall:read>" or "<Runnable>" to buff.
+   Must be called while the process is suspended. Returns zero when there is
+   nothing to report. */
+int state_get_frame(struct proc_state *state, char *buff, size_t len);
+
+#endif /* XRPROF_STATE_H */
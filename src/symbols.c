@@ -0,0 +1,302 @@
+#include <stdio.h>      /* for fprintf, snprintf */
+#include <stdlib.h>     /* for calloc, free, qsort */
+
+#include "symbols.h"
+
+#ifdef __linux
+#include <fcntl.h>      /* for open */
+#include <string.h>     /* for strcmp, strdup */
+#include <unistd.h>     /* for close */
+
+#include <libelf.h>
+#include <gelf.h>
+
+#include "addrmap.h"
+
+/* The memo of IPs is cleared when it grows past this many entries. */
+#define MAX_MEMO_ENTRIES 65536
+#define MAX_SEGMENTS 16
+
+struct symbol {
+  uintptr_t addr;       /* The ELF virtual address. */
+  uintptr_t size;
+  const char *name;
+};
+
+/* A loadable segment, which maps file offsets to ELF virtual addresses. */
+struct segment {
+  uintptr_t offset;
+  uintptr_t vaddr;
+  uintptr_t filesz;
+};
+
+struct module {
+  char *path;
+  struct symbol *symbols;  /* Sorted by address. */
+  size_t len;
+  struct segment segments[MAX_SEGMENTS];
+  int nsegments;
+  char *strings;           /* Where symbol names live. */
+  struct module *next;
+};
+
+struct symbol_table {
+  phandle pid;
+  struct proc_maps *maps;
+  struct module *modules;
+  /* Maps IPs to names, or to NULL when there isn't one. */
+  struct addr_map *memo;
+};
+
+struct symbol_table *symbols_create(phandle pid, struct proc_maps *maps) {
+  if (elf_version(EV_CURRENT) == EV_NONE) {
+    fprintf(stderr, "error: Can't set the ELF version. %s\n",
+            elf_errmsg(elf_errno()));
+    return NULL;
+  }
+  struct symbol_table *out = calloc(1, sizeof(struct symbol_table));
+  if (!out) {
+    return NULL;
+  }
+  out->pid = pid;
+  out->maps = maps;
+  if (!(out->memo = addrmap_create())) {
+    symbols_destroy(out);
+    return NULL;
+  }
+  return out;
+}
+
+static void module_destroy(struct module *module) {
+  free(module->path);
+  free(module->symbols);
+  free(module->strings);
+  return free(module);
+}
+
+void symbols_destroy(struct symbol_table *symbols) {
+  if (!symbols) {
+    return;
+  }
+  struct module *module = symbols->modules, *next;
+  while (module) {
+    next = module->next;
+    module_destroy(module);
+    module = next;
+  }
+  addrmap_destroy(symbols->memo);
+  return free(symbols);
+}
+
+static int compare_symbols(const void *a, const void *b) {
+  const struct symbol *x = a, *y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Add the function symbols in a symbol table section. */
+static int load_section(struct module *module, Elf *elf, Elf_Scn *scn,
+                        GElf_Shdr *shdr, size_t *cap, size_t *strings_len,
+                        size_t *strings_cap) {
+  Elf_Data *data = elf_getdata(scn, NULL);
+  GElf_Sym sym;
+  if (!data || shdr->sh_entsize == 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < shdr->sh_size / shdr->sh_entsize; i++) {
+    if (!gelf_getsym(data, i, &sym) || sym.st_value == 0 ||
+        sym.st_shndx == SHN_UNDEF ||
+        (GELF_ST_TYPE(sym.st_info) != STT_FUNC &&
+         GELF_ST_TYPE(sym.st_info) != STT_GNU_IFUNC)) {
+      continue;
+    }
+    const char *name = elf_strptr(elf, shdr->sh_link, sym.st_name);
+    if (!name || !name[0]) {
+      continue;
+    }
+
+    if (module->len == *cap) {
+      size_t newcap = *cap ? 2 * *cap : 1024;
+      struct symbol *symbols = realloc(module->symbols,
+                                       newcap * sizeof(struct symbol));
+      if (!symbols) {
+        return -1;
+      }
+      module->symbols = symbols;
+      *cap = newcap;
+    }
+    /* Names are stored as offsets until the string table stops moving. */
+    size_t len = strlen(name) + 1;
+    if (*strings_len + len > *strings_cap) {
+      size_t newcap = *strings_cap ? 2 * *strings_cap : 65536;
+      while (newcap < *strings_len + len) {
+        newcap *= 2;
+      }
+      char *strings = realloc(module->strings, newcap);
+      if (!strings) {
+        return -1;
+      }
+      module->strings = strings;
+      *strings_cap = newcap;
+    }
+    memcpy(module->strings + *strings_len, name, len);
+
+    struct symbol *entry = &module->symbols[module->len++];
+    entry->addr = sym.st_value;
+    entry->size = sym.st_size;
+    entry->name = (const char *) *strings_len;
+    *strings_len += len;
+  }
+  return 0;
+}
+
+/* Build the index for a module, which is opened through the process's view of
+   the filesystem (as in the case of a container). Modules without any symbols
+   get an empty index, so that they are not tried again. */
+static struct module *module_load(struct symbol_table *symbols,
+                                  const char *path) {
+  char file[512];
+  struct module *out = calloc(1, sizeof(struct module));
+  if (!out || !(out->path = strdup(path))) {
+    free(out);
+    return NULL;
+  }
+  out->next = symbols->modules;
+  symbols->modules = out;
+
+  snprintf(file, sizeof(file), "/proc/%d/root%s", symbols->pid, path);
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return out;
+  }
+  Elf *elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+  if (!elf) {
+    close(fd);
+    return out;
+  }
+
+  size_t nphdrs = 0;
+  GElf_Phdr phdr;
+  elf_getphdrnum(elf, &nphdrs);
+  for (size_t i = 0; i < nphdrs && out->nsegments < MAX_SEGMENTS; i++) {
+    if (gelf_getphdr(elf, i, &phdr) && phdr.p_type == PT_LOAD) {
+      out->segments[out->nsegments].offset = phdr.p_offset;
+      out->segments[out->nsegments].vaddr = phdr.p_vaddr;
+      out->segments[out->nsegments].filesz = phdr.p_filesz;
+      out->nsegments++;
+    }
+  }
+
+  /* Stripped libraries still have a .dynsym, which covers exported
+     functions. Duplicates from having both are harmless. */
+  size_t cap = 0, strings_len = 0, strings_cap = 0;
+  Elf_Scn *scn = NULL;
+  GElf_Shdr shdr;
+  int ret = 0;
+  while (ret == 0 && (scn = elf_nextscn(elf, scn)) != NULL) {
+    if (gelf_getshdr(scn, &shdr) &&
+        (shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM)) {
+      ret = load_section(out, elf, scn, &shdr, &cap, &strings_len,
+                         &strings_cap);
+    }
+  }
+  elf_end(elf);
+  close(fd);
+
+  if (ret < 0) {
+    out->len = 0;
+    return out;
+  }
+  for (size_t i = 0; i < out->len; i++) {
+    out->symbols[i].name = out->strings + (size_t) out->symbols[i].name;
+  }
+  qsort(out->symbols, out->len, sizeof(struct symbol), compare_symbols);
+  return out;
+}
+
+static struct module *get_module(struct symbol_table *symbols,
+                                 const char *path) {
+  for (struct module *module = symbols->modules; module;
+       module = module->next) {
+    if (strcmp(module->path, path) == 0) {
+      return module;
+    }
+  }
+  return module_load(symbols, path);
+}
+
+static const char *module_lookup(struct module *module, uintptr_t offset) {
+  uintptr_t vaddr = 0;
+  int i;
+  for (i = 0; i < module->nsegments; i++) {
+    struct segment *segment = &module->segments[i];
+    if (offset >= segment->offset &&
+        offset < segment->offset + segment->filesz) {
+      vaddr = offset - segment->offset + segment->vaddr;
+      break;
+    }
+  }
+  if (i == module->nsegments) {
+    return NULL;
+  }
+
+  /* Find the last symbol starting at or before the address. */
+  size_t lo = 0, hi = module->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (module->symbols[mid].addr <= vaddr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return NULL;
+  }
+  struct symbol *symbol = &module->symbols[lo - 1];
+  /* Symbols without a size are assumed to extend to the next one. */
+  if (symbol->size && vaddr >= symbol->addr + symbol->size) {
+    return NULL;
+  }
+  return symbol->name;
+}
+
+const char *symbols_lookup(struct symbol_table *symbols, uintptr_t ip) {
+  uintptr_t value;
+  if (addrmap_get(symbols->memo, ip, &value)) {
+    return (const char *) value;
+  }
+
+  const char *name = NULL;
+  const struct proc_map *map = maps_find(symbols->maps, ip);
+  /* The address may be in code mapped since the maps were last refreshed,
+     which a later lookup will find, so a miss is not remembered. */
+  if (!map) {
+    return NULL;
+  }
+  if (map->path && map->path[0] == '/') {
+    struct module *module = get_module(symbols, map->path);
+    if (module) {
+      name = module_lookup(module, ip - map->start + map->offset);
+    }
+  }
+
+  if (addrmap_size(symbols->memo) >= MAX_MEMO_ENTRIES) {
+    addrmap_clear(symbols->memo);
+  }
+  addrmap_put(symbols->memo, ip, (uintptr_t) name);
+  return name;
+}
+#else
+struct symbol_table *symbols_create(phandle pid, struct proc_maps *maps) {
+  fprintf(stderr, "error: Symbol lookup is not supported on this platform.\n");
+  return NULL;
+}
+
+void symbols_destroy(struct symbol_table *symbols) {
+  return;
+}
+
+const char *symbols_lookup(struct symbol_table *symbols, uintptr_t ip) {
+  return NULL;
+}
+#endif
@@ -0,0 +1,18 @@
+#ifndef XRPROF_SYMBOLS_H
+#define XRPROF_SYMBOLS_H
+
+#include <stdint.h> /* for uintptr_t */
+#include "maps.h"
+#include "process.h"
+
+/* An index of the function symbols in each module mapped by a process, which
+   is built (from the files on disk) the first time the module is seen, so that
+   native frames can be named without reading the process's memory. */
+struct symbol_table;
+
+struct symbol_table *symbols_create(phandle pid, struct proc_maps *maps);
+void symbols_destroy(struct symbol_table *symbols);
+/* Find the name of the function containing ip, or NULL if it is unknown. */
+const char *symbols_lookup(struct symbol_table *symbols, uintptr_t ip);
+
+#endif /* XRPROF_SYMBOLS_H */
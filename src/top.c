@@ -0,0 +1,176 @@
+#include <stdlib.h>     /* for calloc, free, qsort */
+#include <time.h>       /* for clock_gettime */
+
+#include "top.h"
+#include "addrmap.h"
+
+/* How often the table is redrawn and the counts decayed, in nanoseconds. */
+#define TOP_REFRESH_NS 1000000000L
+/* Counts are multiplied by this on every refresh, which gives a half-life of
+   about five seconds. */
+#define TOP_DECAY 0.87
+/* Functions whose total count decays below this are forgotten. */
+#define TOP_MIN_WEIGHT 0.05
+/* An upper bound on the number of functions tracked at once. */
+#define TOP_MAX_ENTRIES 4096
+#define TOP_ROWS 25
+#define MAX_FRAMES 16384
+
+struct top_entry {
+  int id;
+  double self;
+  double total;
+  unsigned long seen;   /* The last sample this function appeared in. */
+};
+
+struct top_table {
+  struct xrprof_cursor *cursor;
+  /* Maps frame IDs to indices in entries. */
+  struct addr_map *index;
+  struct top_entry *entries;
+  int len;
+  double samples;       /* Decayed, like the per-function counts. */
+  unsigned long sample; /* Raw sample count. */
+  unsigned long last_sample;
+  unsigned long dropped;
+  struct timespec refreshed;
+};
+
+/* Frame IDs start at zero, but addrmap keys must not. */
+#define TOP_KEY(id) ((uintptr_t) (id) + 1)
+
+struct top_table *top_create(struct xrprof_cursor *cursor) {
+  struct top_table *out = calloc(1, sizeof(struct top_table));
+  if (!out) {
+    return NULL;
+  }
+  out->cursor = cursor;
+  out->index = addrmap_create();
+  out->entries = calloc(TOP_MAX_ENTRIES, sizeof(struct top_entry));
+  if (!out->index || !out->entries) {
+    top_destroy(out);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &out->refreshed);
+  return out;
+}
+
+void top_destroy(struct top_table *top) {
+  if (!top) {
+    return;
+  }
+  addrmap_destroy(top->index);
+  free(top->entries);
+  return free(top);
+}
+
+static struct top_entry *top_entry(struct top_table *top, int id) {
+  uintptr_t i;
+  if (addrmap_get(top->index, TOP_KEY(id), &i)) {
+    return &top->entries[i];
+  }
+  if (top->len == TOP_MAX_ENTRIES ||
+      addrmap_put(top->index, TOP_KEY(id), top->len) < 0) {
+    return NULL;
+  }
+  struct top_entry *entry = &top->entries[top->len++];
+  entry->id = id;
+  entry->self = 0;
+  entry->total = 0;
+  entry->seen = 0;
+  return entry;
+}
+
+int top_add_sample(struct top_table *top) {
+  struct top_entry *entry;
+  int ret, id, innermost = 1;
+
+  top->sample++;
+  top->samples += 1;
+
+  for (int i = 0; i < MAX_FRAMES; i++) {
+    if ((ret = xrprof_get_fun_id(top->cursor, &id)) < 0) {
+      return ret;
+    }
+    /* Skip the top level, which would always be at 100%. */
+    if (ret > 0) {
+      if (!(entry = top_entry(top, id))) {
+        top->dropped++;
+      } else {
+        entry->self += innermost;
+        /* Count recursive functions only once per sample. */
+        if (entry->seen != top->sample) {
+          entry->total += 1;
+          entry->seen = top->sample;
+        }
+      }
+      innermost = 0;
+    }
+    if ((ret = xrprof_step(top->cursor)) <= 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct top_entry *x = a, *y = b;
+  if (x->self != y->self) {
+    return x->self < y->self ? 1 : -1;
+  }
+  return (x->total < y->total) - (x->total > y->total);
+}
+
+/* Decay all counts and forget functions that have not been seen in a while,
+   which keeps memory use bounded. */
+static void top_decay(struct top_table *top) {
+  int len = 0;
+  addrmap_clear(top->index);
+  for (int i = 0; i < top->len; i++) {
+    struct top_entry *entry = &top->entries[i];
+    entry->self *= TOP_DECAY;
+    entry->total *= TOP_DECAY;
+    if (entry->total < TOP_MIN_WEIGHT) {
+      continue;
+    }
+    top->entries[len] = *entry;
+    addrmap_put(top->index, TOP_KEY(entry->id), len);
+    len++;
+  }
+  top->len = len;
+  top->samples *= TOP_DECAY;
+}
+
+int top_tick(struct top_table *top, FILE *out) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - top->refreshed.tv_sec) * 1000000000L +
+    (now.tv_nsec - top->refreshed.tv_nsec);
+  if (elapsed < TOP_REFRESH_NS) {
+    return 0;
+  }
+
+  /* Sorting changes the indices, so the index is rebuilt in top_decay(). */
+  qsort(top->entries, top->len, sizeof(struct top_entry), compare_entries);
+
+  /* Clear the screen and move the cursor to the top left. */
+  fprintf(out, "\033[H\033[2J");
+  fprintf(out, "%.0f samples/s, %d functions", (top->sample - top->last_sample) /
+          (elapsed / 1e9), top->len);
+  if (top->dropped) {
+    fprintf(out, " (%lu frames dropped)", top->dropped);
+  }
+  fprintf(out, "\n\n%7s %7s  %s\n", "SELF%", "TOTAL%", "FUNCTION");
+  for (int i = 0; i < top->len && i < TOP_ROWS; i++) {
+    struct top_entry *entry = &top->entries[i];
+    fprintf(out, "%6.1f%% %6.1f%%  %s\n", 100 * entry->self / top->samples,
+            100 * entry->total / top->samples,
+            xrprof_lookup_name(top->cursor, entry->id));
+  }
+  fflush(out);
+
+  top_decay(top);
+  top->last_sample = top->sample;
+  top->refreshed = now;
+  return 1;
+}
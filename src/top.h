@@ -0,0 +1,19 @@
+#ifndef XRPROF_TOP_H
+#define XRPROF_TOP_H
+
+#include <stdio.h> /* for FILE */
+#include "cursor.h"
+
+/* In-memory aggregation of samples into per-function self and total counts,
+   for a live "top"-style display. Counts decay over time, so that the table
+   reflects what the program is doing now rather than since it started. */
+struct top_table;
+
+struct top_table *top_create(struct xrprof_cursor *cursor);
+void top_destroy(struct top_table *top);
+/* Add the stack most recently walked by the cursor. */
+int top_add_sample(struct top_table *top);
+/* Print the table to out (and decay the counts) if it is due a refresh. */
+int top_tick(struct top_table *top, FILE *out);
+
+#endif /* XRPROF_TOP_H */
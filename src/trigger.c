@@ -0,0 +1,188 @@
+#include <stdio.h>      /* for fprintf, snprintf */
+#include <stdlib.h>     /* for calloc, free, strtod */
+#include <string.h>     /* for strncmp */
+
+#include "trigger.h"
+
+#ifdef __linux
+#include <fcntl.h>      /* for open */
+#include <time.h>       /* for clock_gettime */
+#include <unistd.h>     /* for pread, close, sysconf */
+
+#define DEFAULT_COOLDOWN 5
+
+struct trigger {
+  int stat_fd;
+  double cpu_threshold;         /* Percent of one core; zero when unused. */
+  double rss_threshold;         /* MB per second; zero when unused. */
+  double cooldown;
+  int active;
+  double quiet_since;           /* When the conditions last stopped holding. */
+  /* The previous reading. */
+  double last_time;
+  unsigned long last_ticks;
+  long last_rss;
+  /* Rates over the last interval. */
+  double cpu;
+  double rss_growth;
+};
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Read the CPU time (in clock ticks) and resident set size (in pages). */
+static int read_stat(struct trigger *trigger, unsigned long *ticks, long *rss) {
+  char buff[1024];
+  unsigned long utime, stime;
+
+  ssize_t bytes = pread(trigger->stat_fd, buff, sizeof(buff) - 1, 0);
+  if (bytes <= 0) {
+    return -1;
+  }
+  buff[bytes] = '\0';
+
+  /* The command name can contain anything, so start after its last ')'. */
+  char *end = strrchr(buff, ')');
+  if (!end || sscanf(end + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                     "%lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                     &utime, &stime, rss) != 3) {
+    return -1;
+  }
+  *ticks = utime + stime;
+  return 0;
+}
+
+static int parse_spec(struct trigger *trigger, const char *spec) {
+  const char *p = spec;
+  char *end;
+  while (*p) {
+    double *field;
+    if (strncmp(p, "cpu=", 4) == 0) {
+      field = &trigger->cpu_threshold;
+      p += 4;
+    } else if (strncmp(p, "rss=", 4) == 0) {
+      field = &trigger->rss_threshold;
+      p += 4;
+    } else if (strncmp(p, "cooldown=", 9) == 0) {
+      field = &trigger->cooldown;
+      p += 9;
+    } else {
+      return -1;
+    }
+    *field = strtod(p, &end);
+    if (end == p || *field <= 0 || (*end != ',' && *end != '\0')) {
+      return -1;
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (trigger->cpu_threshold == 0 && trigger->rss_threshold == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+struct trigger *trigger_create(phandle pid, const char *spec) {
+  char path[64];
+  struct trigger *out = calloc(1, sizeof(struct trigger));
+  if (!out) {
+    return NULL;
+  }
+  out->cooldown = DEFAULT_COOLDOWN;
+  out->stat_fd = -1;
+  if (parse_spec(out, spec) < 0) {
+    fprintf(stderr, "error: Invalid trigger '%s'.\n", spec);
+    trigger_destroy(out);
+    return NULL;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((out->stat_fd = open(path, O_RDONLY)) < 0) {
+    perror("error: Cannot open process stat file");
+    trigger_destroy(out);
+    return NULL;
+  }
+  if (read_stat(out, &out->last_ticks, &out->last_rss) < 0) {
+    fprintf(stderr, "error: Failed to parse %s.\n", path);
+    trigger_destroy(out);
+    return NULL;
+  }
+  out->last_time = now_seconds();
+  return out;
+}
+
+void trigger_destroy(struct trigger *trigger) {
+  if (!trigger) {
+    return;
+  }
+  if (trigger->stat_fd >= 0) {
+    close(trigger->stat_fd);
+  }
+  return free(trigger);
+}
+
+int trigger_poll(struct trigger *trigger) {
+  unsigned long ticks;
+  long rss;
+  double now = now_seconds(), dt = now - trigger->last_time;
+
+  if (dt < TRIGGER_INTERVAL) {
+    return trigger->active ? TRIGGER_ACTIVE : TRIGGER_IDLE;
+  }
+  if (read_stat(trigger, &ticks, &rss) < 0) {
+    return -1;
+  }
+  trigger->cpu = 100.0 * (ticks - trigger->last_ticks) /
+    sysconf(_SC_CLK_TCK) / dt;
+  trigger->rss_growth = (double) (rss - trigger->last_rss) *
+    sysconf(_SC_PAGESIZE) / (1024 * 1024) / dt;
+  trigger->last_time = now;
+  trigger->last_ticks = ticks;
+  trigger->last_rss = rss;
+
+  int met = (trigger->cpu_threshold > 0 &&
+             trigger->cpu >= trigger->cpu_threshold) ||
+    (trigger->rss_threshold > 0 &&
+     trigger->rss_growth >= trigger->rss_threshold);
+
+  if (met) {
+    trigger->quiet_since = 0;
+    if (!trigger->active) {
+      trigger->active = 1;
+      return TRIGGER_START;
+    }
+  } else if (trigger->active) {
+    if (trigger->quiet_since == 0) {
+      trigger->quiet_since = now;
+    } else if (now - trigger->quiet_since >= trigger->cooldown) {
+      trigger->active = 0;
+      return TRIGGER_STOP;
+    }
+  }
+  return trigger->active ? TRIGGER_ACTIVE : TRIGGER_IDLE;
+}
+
+int trigger_describe(struct trigger *trigger, char *buff, size_t len) {
+  return snprintf(buff, len, "cpu=%.0f%% rss=%+.1fMB/s", trigger->cpu,
+                  trigger->rss_growth);
+}
+#else
+struct trigger *trigger_create(phandle pid, const char *spec) {
+  fprintf(stderr, "error: Triggers are not supported on this platform.\n");
+  return NULL;
+}
+
+void trigger_destroy(struct trigger *trigger) {
+  return;
+}
+
+int trigger_poll(struct trigger *trigger) {
+  return -1;
+}
+
+int trigger_describe(struct trigger *trigger, char *buff, size_t len) {
+  return -1;
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef XRPROF_TRIGGER_H
+#define XRPROF_TRIGGER_H
+
+#include <stddef.h> /* for size_t */
+#include "process.h"
+
+/* What trigger_poll() found. */
+#define TRIGGER_IDLE 0
+#define TRIGGER_ACTIVE 1
+#define TRIGGER_START 2   /* A condition was just met. */
+#define TRIGGER_STOP 3    /* None have been met for the cooldown period. */
+
+/* How often (in seconds) the process is checked while idle. */
+#define TRIGGER_INTERVAL 0.25
+
+/* Conditions on a process's CPU usage or memory growth, read cheaply from
+   /proc without stopping it, that decide when to take samples. */
+struct trigger;
+
+/* Parse a spec like "cpu=80,rss=50,cooldown=10", where cpu is a percentage of
+   one core, rss is growth in MB per second, and cooldown is how long (in
+   seconds) to keep sampling after neither condition holds. */
+struct trigger *trigger_create(phandle pid, const char *spec);
+void trigger_destroy(struct trigger *trigger);
+/* Check the process, at most once every TRIGGER_INTERVAL seconds. Returns one
+   of the values above, or a negative value when the process is gone. */
+int trigger_poll(struct trigger *trigger);
+/* Write the most recent readings to buff, as in "cpu=97% rss=+1.2MB/s". */
+int trigger_describe(struct trigger *trigger, char *buff, size_t len);
+
+#endif /* XRPROF_TRIGGER_H */
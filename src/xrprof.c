@@ -14,19 +14,96 @@
 
 #ifdef __linux
 #define HAVE_LIBUNWIND
-#include <libunwind-ptrace.h>
 #endif
 
+#include "calls.h"
+#include "control.h"
 #include "cursor.h"
+#include "fleet.h"
+#include "flight.h"
+#include "heavy.h"
+#include "locate.h"
+#include "memory.h"
+#include "native.h"
+#include "output.h"
 #include "process.h"
+#include "state.h"
+#include "top.h"
+#include "trigger.h"
 
 #define MAX_STACK_DEPTH 100
 #define DEFAULT_FREQ 1
 #define MAX_FREQ 1000
 #define DEFAULT_DURATION 3600 // One hour.
+#define PAUSE_BUCKETS 10000 // In microseconds.
+
+/* A histogram of how long the tracee was stopped for each sample. */
+struct pause_stats {
+  unsigned long counts[PAUSE_BUCKETS + 1]; /* The last is for longer pauses. */
+  unsigned long total;
+  unsigned long truncated;
+  unsigned long overruns;
+  long max_us;
+};
+
+static struct pause_stats pauses;
+
+static long elapsed_us(const struct timespec *start,
+                       const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000L +
+    (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void pause_record(struct pause_stats *stats, long us, long max_us) {
+  stats->counts[us < PAUSE_BUCKETS ? us : PAUSE_BUCKETS]++;
+  stats->total++;
+  if (max_us > 0 && us > max_us) {
+    stats->overruns++;
+  }
+  if (us > stats->max_us) {
+    stats->max_us = us;
+  }
+}
+
+static long pause_percentile(struct pause_stats *stats, double q) {
+  unsigned long seen = 0, target = (unsigned long) (q * stats->total);
+  for (long us = 0; us < PAUSE_BUCKETS; us++) {
+    seen += stats->counts[us];
+    if (seen > target) {
+      return us;
+    }
+  }
+  return stats->max_us;
+}
+
+static void print_pause_summary(int verbose, long max_pause) {
+  if (pauses.total == 0 || !(verbose || pauses.overruns || pauses.truncated)) {
+    return;
+  }
+  fprintf(stderr, "Paused the process %lu times: p50 %ldus, p99 %ldus, max %ldus.\n",
+          pauses.total, pause_percentile(&pauses, 0.5),
+          pause_percentile(&pauses, 0.99), pauses.max_us);
+  if (max_pause) {
+    fprintf(stderr, "%lu samples were truncated and %lu pauses exceeded %ldus.\n",
+            pauses.truncated, pauses.overruns, max_pause);
+  }
+}
+
+/* Set a deadline max_pause microseconds after start. */
+static void set_deadline(struct timespec *deadline, const struct timespec *start,
+                         long max_pause) {
+  deadline->tv_sec = start->tv_sec + max_pause / 1000000;
+  deadline->tv_nsec = start->tv_nsec + (max_pause % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
 
 static volatile int should_trace = 1;
+static volatile int should_dump = 0;
 int install_ctrl_c_handler();
+int install_dump_handler();
 
 #ifdef __unix
 #include <signal.h>
@@ -39,6 +116,15 @@ int install_ctrl_c_handler() {
   signal(SIGINT, handle_sigint);
   return 0;
 }
+
+void handle_sigusr1(int _sig) {
+  should_dump = 1;
+}
+
+int install_dump_handler() {
+  signal(SIGUSR1, handle_sigusr1);
+  return 0;
+}
 #elif defined(__WIN32)
 #include <windows.h>  /* for BOOL, DWORD, SetConsoleCtrlHandler, TRUE */
 
@@ -56,15 +142,409 @@ int install_ctrl_c_handler() {
   }
   return 0;
 }
+
+int install_dump_handler() {
+  fprintf(stderr, "warning: The flight recorder cannot be dumped by signal on this platform.\n");
+  return 0;
+}
 #else
 int install_ctrl_c_handler() {
   return 0;
 }
+
+int install_dump_handler() {
+  fprintf(stderr, "warning: The flight recorder cannot be dumped by signal on this platform.\n");
+  return 0;
+}
 #endif
 
+/* Where samples go: either straight to the output, or into the flight
+   recorder until it is dumped, or into a fixed-size table of the most common
+   stacks. R frames can also be followed from sample to
+   sample to estimate call durations. */
+struct sink {
+  struct output *out;
+  struct flight_recorder *flight;
+  struct heavy_table *heavy;
+  struct call_table *calls;
+  /* The sample being written to the output, which is only passed on once it
+     is done, so that one that fails part of the way through can be dropped. */
+  char *sample;
+  size_t sample_len;
+  size_t sample_cap;
+  int sample_lost;
+};
+
+static void emit_frame(struct sink *sink, const char *name) {
+  if (sink->flight) {
+    flight_add_frame(sink->flight, name);
+  } else if (sink->heavy) {
+    heavy_add_frame(sink->heavy, name);
+  } else {
+    size_t len = strlen(name) + 3;
+    if (sink->sample_len + len + 1 > sink->sample_cap) {
+      size_t cap = sink->sample_cap ? 2 * sink->sample_cap : 4096;
+      while (cap < sink->sample_len + len + 1) {
+        cap *= 2;
+      }
+      char *sample = realloc(sink->sample, cap);
+      if (!sample) {
+        sink->sample_lost = 1;
+        return;
+      }
+      sink->sample = sample;
+      sink->sample_cap = cap;
+    }
+    sink->sample_len += sprintf(sink->sample + sink->sample_len, "\"%s\" ",
+                                name);
+  }
+}
+
+/* Forget the frames of the current sample. Only samples written straight to
+   the output can be dropped, which are all that fleet mode takes. */
+static void drop_sample(struct sink *sink) {
+  sink->sample_len = 0;
+  sink->sample_lost = 0;
+}
+
+static int end_sample(struct sink *sink) {
+  if (sink->flight) {
+    return flight_end_sample(sink->flight);
+  } else if (sink->heavy) {
+    return heavy_end_sample(sink->heavy);
+  } else if (sink->sample_lost) {
+    drop_sample(sink);
+    return -1;
+  } else if (sink->sample_len == 0) {
+    return output_write(sink->out, "\n", 1);
+  }
+  /* emit_frame() leaves room for the newline. */
+  sink->sample[sink->sample_len++] = '\n';
+  int ret = output_write(sink->out, sink->sample, sink->sample_len);
+  drop_sample(sink);
+  return ret;
+}
+
+/* Write the contents of the flight recorder or the heavy hitters seen so far
+   to a new, timestamped file. */
+static int dump_sink(struct sink *sink, pid_t pid, int freq,
+                     const char *format) {
+  char path[128], stamp[32];
+  time_t now = time(NULL);
+  const char *ext = "";
+  int ret;
+  if (format && strcmp(format, "gzip") == 0) {
+    ext = ".gz";
+  } else if (format && strcmp(format, "zstd") == 0) {
+    ext = ".zst";
+  }
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  snprintf(path, sizeof(path), "xrprof-%d-%s.%s%s", (int) pid, stamp,
+           sink->flight ? "out" : "tsv", ext);
+
+  struct output *out = output_open(path, format);
+  if (!out) {
+    return -1;
+  }
+  if (sink->flight) {
+    output_printf(out, "sample.interval=%d\n", 1000000 / freq);
+    ret = flight_dump(sink->flight, out);
+  } else {
+    ret = heavy_report(sink->heavy, out);
+  }
+  if (output_close(out) < 0 || ret < 0) {
+    return -1;
+  }
+  if (sink->flight) {
+    fprintf(stderr, "Wrote %lu samples to %s.\n",
+            (unsigned long) flight_size(sink->flight), path);
+  } else {
+    fprintf(stderr, "Wrote the most common stacks to %s.\n", path);
+  }
+  return 0;
+}
+
+static void set_interval(struct timespec *spec, int freq) {
+  spec->tv_sec = freq == 1 ? 1 : 0;
+  spec->tv_nsec = freq == 1 ? 0 : 1000000000 / freq;
+}
+
+/* What can be changed over the control socket while profiling. */
+struct control_state {
+  struct control *control;
+  int freq;
+  int stopped;
+  int fixed_freq;       /* The flight recorder and call durations assume it. */
+  const char *format;
+};
+
+/* Note a change in the output, as triggers do, if it is a profile. */
+static void note_control(struct sink *sink, const char *what, float elapsed,
+                         int freq) {
+  if (sink->out && !sink->heavy) {
+    output_printf(sink->out, "#Control %s t=%.2f interval=%d\n", what,
+                  elapsed, 1000000 / freq);
+  }
+}
+
+static void handle_command(struct control_state *ctl,
+                           const struct control_command *cmd,
+                           struct sink *sink, pid_t pid, float elapsed) {
+  struct output *out;
+
+  switch (cmd->type) {
+  case CONTROL_START:
+  case CONTROL_STOP:
+    if (ctl->stopped != (cmd->type == CONTROL_STOP)) {
+      ctl->stopped = cmd->type == CONTROL_STOP;
+      note_control(sink, ctl->stopped ? "stop" : "start", elapsed, ctl->freq);
+    }
+    control_reply(ctl->control, "ok");
+    break;
+  case CONTROL_FREQ:
+    if (ctl->fixed_freq) {
+      control_reply(ctl->control, "error: The frequency cannot be changed with -R or -D.");
+    } else if (cmd->freq > MAX_FREQ) {
+      control_reply(ctl->control, "error: Frequency cannot exceed %d.", MAX_FREQ);
+    } else {
+      ctl->freq = cmd->freq;
+      note_control(sink, "freq", elapsed, ctl->freq);
+      control_reply(ctl->control, "ok");
+    }
+    break;
+  case CONTROL_FLUSH:
+    if (sink->flight || sink->heavy) {
+      if (dump_sink(sink, pid, ctl->freq, ctl->format) < 0) {
+        control_reply(ctl->control, "error: Failed to dump samples.");
+      } else {
+        control_reply(ctl->control, "ok");
+      }
+    } else if (sink->out) {
+      control_reply(ctl->control, output_flush(sink->out) < 0 ?
+                    "error: Failed to write samples." : "ok");
+    } else {
+      control_reply(ctl->control, "error: There is no output to flush.");
+    }
+    break;
+  case CONTROL_ROTATE:
+    if (!sink->out || sink->heavy) {
+      control_reply(ctl->control, "error: There is no profile to rotate.");
+    } else if (!(out = output_open(cmd->path, ctl->format))) {
+      control_reply(ctl->control, "error: Failed to open %s.", cmd->path);
+    } else {
+      int ret = output_close(sink->out);
+      sink->out = out;
+      output_printf(out, "sample.interval=%d\n", 1000000 / ctl->freq);
+      control_reply(ctl->control, ret < 0 ?
+                    "error: Samples were lost from the previous output." :
+                    "ok");
+    }
+    break;
+  case CONTROL_STATS:
+    control_reply(ctl->control, "ok state=%s freq=%d elapsed=%.2f samples=%lu truncated=%lu overruns=%lu p50=%ldus p99=%ldus max=%ldus",
+                  ctl->stopped ? "stopped" : "running", ctl->freq, elapsed,
+                  pauses.total, pauses.truncated, pauses.overruns,
+                  pause_percentile(&pauses, 0.5),
+                  pause_percentile(&pauses, 0.99), pauses.max_us);
+    break;
+  }
+}
+
+/* Sleep for the given interval, answering commands on the control socket (if
+   any) in the meantime. Returns a negative value when interrupted. */
+static int serve_control(struct control_state *ctl, struct sink *sink,
+                         pid_t pid, float elapsed,
+                         const struct timespec *interval) {
+  struct control_command cmd;
+  struct timespec deadline;
+  int ret;
+
+  if (!ctl->control) {
+    return nanosleep(interval, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += interval->tv_sec;
+  deadline.tv_nsec += interval->tv_nsec;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while ((ret = control_wait(ctl->control, &deadline, &cmd)) > 0) {
+    handle_command(ctl, &cmd, sink, pid, elapsed);
+  }
+  return ret;
+}
+
+/* Print the current R frame and step to the next one. Returns zero when there
+   are no more. */
+static int print_r_frame(struct sink *sink, struct xrprof_cursor *cursor) {
+  char rsym[256];
+  int ret;
+
+  rsym[0] = '\0';
+  if (sink->calls && (ret = calls_add_frame(sink->calls)) < 0) {
+    return ret;
+  }
+  if ((ret = xrprof_get_fun_name(cursor, rsym, sizeof(rsym))) < 0) {
+    return ret;
+  } else if (ret == 0) {
+    emit_frame(sink, "<TopLevel>");
+  } else {
+    emit_frame(sink, rsym);
+  }
+  return xrprof_step(cursor);
+}
+
+#ifdef HAVE_LIBUNWIND
+/* Print the native stack with R frames interleaved. R's contexts live on the
+   native stack, so each R frame is printed before the first native frame
+   whose stack pointer is above it. The top level is left for last. Returns
+   whether any R frames remain, or a negative value on error. Sets truncated
+   when past the deadline. */
+static int print_mixed_frames(struct sink *sink, struct native_cursor *native,
+                              struct xrprof_cursor *cursor,
+                              const struct timespec *deadline,
+                              int *truncated) {
+  char sym[256];
+  uintptr_t sp;
+  int ret, kind, id, more = 1;
+
+  if ((ret = native_init(native)) < 0) {
+    return ret;
+  }
+  do {
+    if (deadline) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (elapsed_us(deadline, &now) >= 0) {
+        emit_frame(sink, "<Truncated>");
+        *truncated = 1;
+        return 0;
+      }
+    }
+    if ((kind = native_get_frame(native, sym, sizeof(sym), &sp)) < 0) {
+      return kind;
+    }
+    while (more && xrprof_get_fun_id(cursor, &id) > 0 &&
+           xrprof_get_frame_addr(cursor) < sp) {
+      if ((more = print_r_frame(sink, cursor)) < 0) {
+        return more;
+      }
+    }
+    if (kind == NATIVE_TOPLEVEL) {
+      break;
+    } else if (kind == NATIVE_FRAME) {
+      emit_frame(sink, sym);
+    }
+  } while ((ret = native_step(native)) > 0);
+
+  return ret < 0 ? ret : more;
+}
+#endif
+
+/* Tag the sample with the value of a variable (if any), as a pseudo-frame
+   outside the R ones. */
+static void print_tag(struct sink *sink, struct xrprof_cursor *cursor) {
+  char value[128], frame[160];
+  if (xrprof_get_tag(cursor, value, sizeof(value)) > 0) {
+    snprintf(frame, sizeof(frame), "<Tag:%s>", value);
+    emit_frame(sink, frame);
+  }
+}
+
+/* Sample each process in the fleet in turn, with its pid as the outermost
+   frame, looking for new ones every so often. Returns a negative value on a
+   fatal error. */
+static int run_fleet(struct fleet *fleet, struct sink *sink,
+                     const struct timespec *sleep_spec, float duration,
+                     long max_pause) {
+  /* A round of samples takes longer than the interval with many processes,
+     so time is kept by the clock rather than by counting rounds. */
+  struct timespec start, now;
+  float elapsed = 0, scanned = -FLEET_SCAN_INTERVAL;
+  char tag[32];
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (should_trace && elapsed <= duration) {
+    if (elapsed - scanned >= FLEET_SCAN_INTERVAL) {
+      if (fleet_scan(fleet) < 0) {
+        return -1;
+      }
+      scanned = elapsed;
+    }
+
+    for (size_t i = 0; i < fleet_size(fleet); i++) {
+      struct fleet_tracee *tracee = fleet_get(fleet, i);
+      struct timespec stopped, deadline, resumed;
+      if (tracee->drop) {
+        continue;
+      }
+      /* This fails when the process has exited, among other things. Either
+         way, stop tracing it. */
+      if (proc_suspend(tracee->pid) < 0) {
+        tracee->drop = 1;
+        continue;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &stopped);
+      if (max_pause) {
+        set_deadline(&deadline, &stopped, max_pause);
+        xrprof_set_deadline(tracee->cursor, &deadline);
+      }
+
+      if ((ret = xrprof_init(tracee->cursor)) >= 0) {
+        int truncated = ret;
+        pauses.truncated += truncated;
+        ret = 1;
+        while (ret > 0) {
+          ret = print_r_frame(sink, tracee->cursor);
+        }
+        if (ret == 0 && !truncated) {
+          print_tag(sink, tracee->cursor);
+        }
+      }
+      if (ret < 0) {
+        fprintf(stderr, "error: Failed to walk the stack of process %d: %d.\n",
+                tracee->pid, ret);
+        tracee->drop = 1;
+        drop_sample(sink);
+        proc_resume(tracee->pid);
+        continue;
+      }
+      snprintf(tag, sizeof(tag), "<Pid:%d>", tracee->pid);
+      emit_frame(sink, tag);
+      if (end_sample(sink) < 0) {
+        fprintf(stderr, "fatal: Failed to write samples.\n");
+        proc_resume(tracee->pid);
+        return -1;
+      }
+
+      if (proc_resume(tracee->pid) < 0) {
+        tracee->drop = 1;
+        continue;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &resumed);
+      pause_record(&pauses, elapsed_us(&stopped, &resumed), max_pause);
+      /* Wait on a slow disk or pipe now, rather than while stopped. */
+      if (sink->out && output_wait(sink->out) < 0) {
+        fprintf(stderr, "fatal: Failed to write samples.\n");
+        return -1;
+      }
+    }
+
+    /* Exited processes are noticed (and cleaned up) while we sleep. */
+    if (fleet_wait(fleet, sleep_spec) < 0) {
+      break; // Interupted.
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = elapsed_us(&start, &now) / 1e6;
+  }
+  return 0;
+}
+
 void usage(const char *name) {
   // TODO: Add a long help message.
-  printf("Usage: %s [-v] [-m] [-F <freq>] [-d <duration>] [-o file] -p <pid>\n", name);
+  printf("Usage: %s [-v] [-m] [-t] [-s] [-P] [-n] [-i] [-b <backend>] [-u <unwinder>] [-F <freq>] [-d <duration>] [-o file] [-z <format>] [-w <usec>] [-R <secs>] [-H <stacks>] [-c <trigger>] [-a] [-f <filter>] [-D <file>] [-S <socket>] [-g <var>] (-p <pid> | -- <command>)\n", name);
   return;
 }
 
@@ -73,13 +553,35 @@ int main(int argc, char **argv) {
   int freq = DEFAULT_FREQ;
   float duration = DEFAULT_DURATION;
   int verbose = 0;
-  FILE *outfile = stdout;
+  long max_pause = 0;
+  int have_duration = 0;
+  long flight_window = 0;
+  long heavy_stacks = 0;
+  struct sink sink = {NULL, NULL, NULL, NULL, NULL, 0, 0, 0};
+  const char *outpath = NULL;
+  const char *format = NULL;
+  struct output *out = NULL;
+  int top_mode = 0;
+  struct top_table *top = NULL;
+  int state_mode = 0;
+  struct proc_state *state = NULL;
+  const char *trigger_spec = NULL;
+  struct trigger *trigger = NULL;
+  int fleet_mode = 0;
+  const char *calls_path = NULL;
+  FILE *calls_file = NULL;
+  const char *fleet_filter = NULL;
+  const char *control_path = NULL;
+  const char *tag_var = NULL;
+  struct control_state ctl = {NULL, 0, 0, 0, NULL};
+  int flags = 0;
 #ifdef HAVE_LIBUNWIND
   int mixed_mode = 0;
+  struct native_cursor *native = NULL;
 #endif
 
   int opt;
-  while ((opt = getopt(argc, argv, "hvmF:d:o:p:")) != -1) {
+  while ((opt = getopt(argc, argv, "+hvmtsPniab:u:F:d:o:z:w:R:H:c:f:D:S:g:p:")) != -1) {
     switch (opt) {
     case 'h':
       usage(argv[0]);
@@ -93,6 +595,33 @@ int main(int argc, char **argv) {
       mixed_mode = 1;
 #else
       /* TODO: We should probably warn the user. */
+#endif
+      break;
+    case 't':
+      top_mode = 1;
+      break;
+    case 's':
+      state_mode = 1;
+      break;
+    case 'P':
+      flags |= XRPROF_PROMISES;
+      break;
+    case 'n':
+      flags |= XRPROF_NAMESPACES;
+      break;
+    case 'i':
+      flags |= XRPROF_CLOSURES;
+      break;
+    case 'b':
+      if (copy_set_backend(optarg, 1) < 0) {
+        return 1;
+      }
+      break;
+    case 'u':
+#ifdef HAVE_LIBUNWIND
+      if (native_set_unwinder(optarg) < 0) {
+        return 1;
+      }
 #endif
       break;
     case 'p':
@@ -120,6 +649,7 @@ int main(int argc, char **argv) {
       }
       break;
     case 'd':
+      have_duration = 1;
       duration = strtof(optarg, NULL);
       if (errno != 0 && duration == 0) {
         perror("warning: Failed to decode duration argument");
@@ -131,12 +661,51 @@ int main(int argc, char **argv) {
       }
       break;
     case 'o':
-      outfile = fopen(optarg, "w");
-      if (!outfile) {
-        perror("fatal: Failed to open output file");
+      outpath = optarg;
+      break;
+    case 'z':
+      format = optarg;
+      break;
+    case 'R':
+      flight_window = strtol(optarg, NULL, 10);
+      if (flight_window <= 0) {
+        fprintf(stderr, "fatal: Invalid flight recorder window.\n");
+        return 1;
+      }
+      break;
+    case 'H':
+      heavy_stacks = strtol(optarg, NULL, 10);
+      if (heavy_stacks <= 0) {
+        fprintf(stderr, "fatal: Invalid number of stacks to keep.\n");
         return 1;
       }
       break;
+    case 'c':
+      trigger_spec = optarg;
+      break;
+    case 'D':
+      calls_path = optarg;
+      break;
+    case 'S':
+      control_path = optarg;
+      break;
+    case 'g':
+      tag_var = optarg;
+      break;
+    case 'a':
+      fleet_mode = 1;
+      break;
+    case 'f':
+      fleet_mode = 1;
+      fleet_filter = optarg;
+      break;
+    case 'w':
+      max_pause = strtol(optarg, NULL, 10);
+      if (max_pause <= 0) {
+        max_pause = 0;
+        fprintf(stderr, "warning: Invalid maximum pause, ignoring it.\n");
+      }
+      break;
     default: /* '?' */
       usage(argv[0]);
       return 1;
@@ -144,40 +713,196 @@ int main(int argc, char **argv) {
     }
   }
 
-  // A PID is required.
-  if (pid == -1) {
+  // Anything left over is a program to start and profile.
+  char **command = optind < argc ? argv + optind : NULL;
+
+  // A PID is required, unless we're starting or looking for processes.
+  if (pid == -1 && !fleet_mode && !command) {
     usage(argv[0]);
     return 1;
   }
+  if ((pid != -1) + fleet_mode + (command != NULL) > 1) {
+    fprintf(stderr, "fatal: Only one of a pid, a command, or -a can be given.\n");
+    return 1;
+  }
+  if (top_mode && outpath) {
+    fprintf(stderr, "fatal: Top mode writes to the terminal, so it cannot be combined with -o.\n");
+    return 1;
+  }
+  /* The program will probably write to stdout itself. */
+  if (command && !outpath && !flight_window && !top_mode) {
+    outpath = "Rprof.out";
+  }
 
   struct timespec sleep_spec;
-  sleep_spec.tv_sec = freq == 1 ? 1 : 0;
-  sleep_spec.tv_nsec = freq == 1 ? 0 : 1000000000 / freq;
+  set_interval(&sleep_spec, freq);
+
+  if (top_mode && flight_window) {
+    fprintf(stderr, "fatal: Top mode and the flight recorder cannot be combined.\n");
+    return 1;
+  }
+  if (heavy_stacks && (top_mode || flight_window || fleet_mode)) {
+    fprintf(stderr, "fatal: Top mode, the flight recorder, and profiling all R processes cannot be combined with -H.\n");
+    return 1;
+  }
+  if (trigger_spec && (top_mode || flight_window)) {
+    fprintf(stderr, "fatal: Triggers cannot be combined with top mode or the flight recorder.\n");
+    return 1;
+  }
+  if (fleet_mode && (top_mode || flight_window || trigger_spec)) {
+    fprintf(stderr, "fatal: Top mode, the flight recorder, and triggers are not supported when profiling all R processes.\n");
+    return 1;
+  }
+  if (control_path && fleet_mode) {
+    fprintf(stderr, "fatal: The control socket is not supported when profiling all R processes.\n");
+    return 1;
+  }
+  if (calls_path && (top_mode || fleet_mode)) {
+    fprintf(stderr, "fatal: Call durations cannot be estimated in top mode or when profiling all R processes.\n");
+    return 1;
+  }
+  if (calls_path && !(calls_file = fopen(calls_path, "w"))) {
+    perror("fatal: Failed to open call duration file");
+    return 1;
+  }
+  if (fleet_mode && state_mode) {
+    fprintf(stderr, "warning: Process states are not shown when profiling all R processes.\n");
+    state_mode = 0;
+  }
+#ifdef HAVE_LIBUNWIND
+  if (fleet_mode && mixed_mode) {
+    fprintf(stderr, "warning: Native frames are not shown when profiling all R processes.\n");
+    mixed_mode = 0;
+  }
+#endif
+  if (flight_window && outpath) {
+    fprintf(stderr, "warning: The flight recorder writes to timestamped files; ignoring -o.\n");
+  }
+
+  if (top_mode && tag_var) {
+    fprintf(stderr, "warning: Tags are not shown in top mode.\n");
+    tag_var = NULL;
+  }
+  if (top_mode && state_mode) {
+    fprintf(stderr, "warning: Process states are not shown in top mode.\n");
+    state_mode = 0;
+  }
+#ifdef HAVE_LIBUNWIND
+  if (top_mode && mixed_mode) {
+    fprintf(stderr, "warning: Native frames are not shown in top mode.\n");
+    mixed_mode = 0;
+  }
+#endif
+
+  /* Compression (if any) happens on a separate thread, so that it never
+     lengthens the time the tracee is stopped. */
+  if (!top_mode && !flight_window && !(out = output_open(outpath, format))) {
+    fprintf(stderr, "fatal: Failed to open output.\n");
+    return 1;
+  }
+  sink.out = out;
 
   phandle proc;
   int code = 0;
 
+  /* Fleet mode finds (and attaches to) processes itself. */
+  if (fleet_mode) {
+    struct fleet *fleet = fleet_create(fleet_filter, flags, tag_var);
+    if (!fleet || install_ctrl_c_handler() < 0) {
+      fprintf(stderr, "fatal: Failed to start profiling R processes.\n");
+      code = 1;
+    } else {
+      output_printf(out, "sample.interval=%d\n", 1000000 / freq);
+      code = run_fleet(fleet, &sink, &sleep_spec, duration, max_pause) < 0;
+    }
+    fleet_destroy(fleet);
+    print_pause_summary(verbose, max_pause);
+    if (output_close(out) < 0 && code == 0) {
+      code++;
+    }
+    free(sink.sample);
+    return code;
+  }
+
   /* First, check that we can attach to the process. */
 
-  if ((code = proc_create(&proc, (void *) &pid)) < 0) {
+  if (command) {
+    if ((code = proc_spawn(&proc, command)) == 0) {
+      pid = proc;
+      /* Sampling starts as soon as R is ready, before any R code runs. */
+      if ((code = locate_wait_for_R(proc)) < 0) {
+        fprintf(stderr, "fatal: %s.\n", code == -2 ?
+                "The program exited before starting R" :
+                "Failed to wait for the program to start R");
+        proc_destroy(proc);
+        code = -1;
+      }
+    }
+  } else {
+    code = proc_create(&proc, (void *) &pid);
+  }
+  if (code != 0) {
+    output_close(out);
+    if (calls_file) {
+      fclose(calls_file);
+    }
     return -code;
   }
 
-  struct xrprof_cursor *cursor = xrprof_create(proc);
+  struct xrprof_cursor *cursor = xrprof_create(proc, flags);
   if (!cursor) {
     fprintf(stderr, "fatal: Failed to initialize R stack cursor.\n");
     code++;
     goto done;
   }
 
+  if (tag_var && xrprof_set_tag(cursor, tag_var) < 0) {
+    fprintf(stderr, "fatal: Failed to set up tags.\n");
+    code++;
+    goto done;
+  }
+
+  if (top_mode && !(top = top_create(cursor))) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    code++;
+    goto done;
+  }
+
+  if (flight_window && !(sink.flight = flight_create(flight_window * freq))) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    code++;
+    goto done;
+  }
+
+  if (heavy_stacks && !(sink.heavy = heavy_create(heavy_stacks))) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    code++;
+    goto done;
+  }
+
+  if (calls_file && !(sink.calls = calls_create(cursor, freq))) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    code++;
+    goto done;
+  }
+
+  if (state_mode && !(state = state_create(proc))) {
+    fprintf(stderr, "fatal: Failed to read process state.\n");
+    code++;
+    goto done;
+  }
+
+  if (trigger_spec && !(trigger = trigger_create(proc, trigger_spec))) {
+    fprintf(stderr, "fatal: Failed to set up the trigger.\n");
+    code++;
+    goto done;
+  }
+
 #ifdef HAVE_LIBUNWIND
-  unw_addr_space_t uw_as;
-  void *uw_cxt;
-  unw_cursor_t uw_cursor;
-  if (mixed_mode) {
-    uw_as = unw_create_addr_space(&_UPT_accessors, 0);
-    unw_set_caching_policy(uw_as, UNW_CACHE_GLOBAL);
-    uw_cxt = _UPT_create(proc);
+  if (mixed_mode && !(native = native_create(proc))) {
+    fprintf(stderr, "fatal: Failed to initialize native stack cursor.\n");
+    code++;
+    goto done;
   }
 #endif
 
@@ -185,15 +910,96 @@ int main(int argc, char **argv) {
 
   // Allow the user to stop the tracing with Ctrl-C.
   if ((code = install_ctrl_c_handler()) < 0) {
-    return -code;
+    code = -code;
+    goto done;
+  }
+  // Dump the flight recorder (or heavy hitters) on SIGUSR1.
+  if ((flight_window || heavy_stacks) && (code = install_dump_handler()) < 0) {
+    code = -code;
+    goto done;
+  }
+
+  /* Accept commands between samples, once everything else is ready. */
+  ctl.freq = freq;
+  ctl.fixed_freq = flight_window || calls_file;
+  ctl.format = format;
+  if (control_path && !(ctl.control = control_create(control_path))) {
+    fprintf(stderr, "fatal: Failed to set up the control socket.\n");
+    code++;
+    goto done;
   }
 
   float elapsed = 0;
 
   // Write the Rprof.out header.
-  fprintf(outfile, "sample.interval=%d\n", 1000000 / freq);
+  if (sink.out && !heavy_stacks) {
+    output_printf(sink.out, "sample.interval=%d\n", 1000000 / freq);
+  }
 
-  while (should_trace && elapsed <= duration) {
+  /* The flight recorder and heavy hitters run until stopped, unless told
+     otherwise. */
+  while (should_trace && (elapsed <= duration ||
+                          ((flight_window || heavy_stacks) &&
+                           !have_duration))) {
+    int ret;
+    char rsym[256];
+
+    if (should_dump) {
+      should_dump = 0;
+      if (dump_sink(&sink, pid, freq, format) < 0) {
+        fprintf(stderr, "error: Failed to dump samples.\n");
+      }
+    }
+
+    /* Leave the tracee alone while stopped over the control socket. */
+    if (ctl.stopped) {
+      if (serve_control(&ctl, &sink, pid, elapsed, &sleep_spec) < 0 &&
+          !should_dump) {
+        break; // Interupted.
+      }
+      elapsed = elapsed + 1.0 / freq;
+      freq = ctl.freq;
+      set_interval(&sleep_spec, freq);
+      continue;
+    }
+
+    /* Leave the tracee alone until a trigger condition is met, and note when
+       they start and stop in the output. */
+    if (trigger) {
+      if ((ret = trigger_poll(trigger)) < 0) {
+        fprintf(stderr, "Process %d finished.\n", pid);
+        break;
+      }
+      if (ret == TRIGGER_START || ret == TRIGGER_STOP) {
+        trigger_describe(trigger, rsym, sizeof(rsym));
+        /* The report written under -H has no room for annotations. */
+        if (!sink.heavy) {
+          output_printf(sink.out, "#Trigger %s t=%.2f %s\n",
+                        ret == TRIGGER_START ? "start" : "stop", elapsed,
+                        rsym);
+        }
+        if (verbose) {
+          fprintf(stderr, "Trigger %s: %s.\n",
+                  ret == TRIGGER_START ? "started" : "stopped", rsym);
+        }
+      }
+      if (ret == TRIGGER_IDLE || ret == TRIGGER_STOP) {
+        struct timespec idle_spec = {0, TRIGGER_INTERVAL * 1000000000L};
+        if (serve_control(&ctl, &sink, pid, elapsed, &idle_spec) < 0 &&
+            !should_dump) {
+          break; // Interupted.
+        }
+        elapsed = elapsed + TRIGGER_INTERVAL;
+        freq = ctl.freq;
+        set_interval(&sleep_spec, freq);
+        continue;
+      }
+    }
+
+    /* Once the tracee is stopped, that is the only state we'd see. */
+    if (state_mode) {
+      state_read(state);
+    }
     if ((code = proc_suspend(proc)) < 0) {
       if (code == -2) {
         code = 0;
@@ -203,118 +1009,120 @@ int main(int argc, char **argv) {
       goto done;
     }
 
-    int ret;
-    char rsym[256];
+    struct timespec stopped, deadline, resumed;
+    clock_gettime(CLOCK_MONOTONIC, &stopped);
+    if (max_pause) {
+      set_deadline(&deadline, &stopped, max_pause);
+      xrprof_set_deadline(cursor, &deadline);
+    }
+    if (sink.calls) {
+      calls_start_sample(sink.calls, &stopped);
+    }
+
+    /* Whether we're on CPU or blocked is a leaf pseudo-frame. */
+    if (state_mode && state_get_frame(state, rsym, sizeof(rsym)) > 0) {
+      emit_frame(&sink, rsym);
+    }
     if ((ret = xrprof_init(cursor)) < 0) {
       code++;
       fprintf(stderr, "fatal: Failed to initialize R stack cursor: %d.\n", ret);
       goto done;
     }
+    int truncated = ret;
 
+    if (top_mode) {
+      ret = top_add_sample(top);
+    } else {
+      ret = 1;
 #ifdef HAVE_LIBUNWIND
-    if (mixed_mode && unw_init_remote(&uw_cursor, uw_as, uw_cxt) != 0) {
-      perror("fatal: Failed to initialize libunwind cursor.");
-      code++;
-      goto done;
-    } else if (mixed_mode) {
-      char sym[256];
-      unw_word_t offset, ip;
-      unw_proc_info_t info;
-
-      do {
-        sym[0] = '\0';
-        if ((ret = unw_get_proc_info(&uw_cursor, &info)) < 0) {
-          code++;
-          fprintf(stderr, "fatal: Failed to get proc info via libunwind: %d.\n",
-                  ret);
-          goto done;
-        }
-
-        if ((ret = unw_get_reg(&uw_cursor, UNW_REG_IP, &ip)) < 0) {
-          code++;
-          fprintf(stderr, "fatal: Failed to get IP register via libunwind: %d.\n",
-                  ret);
-          goto done;
-        }
-
-        if ((ret = unw_get_proc_name(&uw_cursor, sym, sizeof(sym), &offset)) < 0) {
-          if (ret == -UNW_EUNSPEC || ret == -UNW_ENOINFO) {
-            fprintf(outfile, "\"<Native:0x%lx>\" ", ip);
-            continue;
-          } else if (ret != -UNW_ENOINFO) {
-            code++;
-            fprintf(stderr, "fatal: Failed to get proc symbol via libunwind: %d.\n",
-                    ret);
-            goto done;
-          }
-          /* Symbol is truncated but otherwise fine. */
-        }
-
-        /* We're not actually in the named procedure, but nearby.
-           TODO: The printed address is wrong; it does not account for ASLR. */
-        if (ip > info.end_ip) {
-          fprintf(outfile, "\"<Native:0x%lx>\" ", ip);
-          continue;
-        }
-
-        /* TODO: Not sure what's going on here. */
-        if (strncmp(sym, "do_Rprof", 8) == 0) {
-          continue;
-        }
-
-        /* Look for the first eval call and jump into the R stack. */
-        if (strncmp(sym, "Rf_eval", 7) == 0) {
-          break;
-        }
-
-        /* Bail if we get to what looks like the REPL loop. */
-        if (strncmp(sym, "Rf_ReplIteration", 16) == 0) {
-          break;
-        }
-
-        fprintf(outfile, "\"<Native:%s>\" ", sym);
-      } while ((ret = unw_step(&uw_cursor)) > 0);
-
-      if (ret < 0) {
-        code++;
-        fprintf(stderr, "fatal: Failed to step libunwind cursor: %d.\n", ret);
-        goto done;
+      /* Past the deadline already, so don't walk the native stack too. */
+      if (mixed_mode && !truncated) {
+        ret = print_mixed_frames(&sink, native, cursor,
+                                 max_pause ? &deadline : NULL, &truncated);
       }
-    }
 #endif
-
-    do {
-      rsym[0] = '\0';
-      if ((ret = xrprof_get_fun_name(cursor, rsym, sizeof(rsym))) < 0) {
-        code++;
-        goto done;
-      } else if (ret == 0) {
-        fprintf(outfile, "\"<TopLevel>\" ");
-      } else {
-        fprintf(outfile, "\"%s\" ", rsym);
+      while (ret > 0) {
+        ret = print_r_frame(&sink, cursor);
       }
-    } while ((ret = xrprof_step(cursor)) > 0);
+      /* Past the deadline already, so leave the tag out too. */
+      if (ret == 0 && !truncated) {
+        print_tag(&sink, cursor);
+      }
+    }
 
     if (ret < 0) {
       code++;
-      fprintf(stderr, "fatal: Failed to step R stack cursor: %d.\n", ret);
+      fprintf(stderr, "fatal: Failed to walk the stack: %d.\n", ret);
+      goto done;
+    }
+    pauses.truncated += truncated;
+    if (sink.calls && calls_end_sample(sink.calls, truncated) < 0) {
+      code++;
+      fprintf(stderr, "fatal: Failed to allocate memory.\n");
+      goto done;
+    }
+    if (!top_mode && end_sample(&sink) < 0) {
+      code++;
+      fprintf(stderr, "fatal: Failed to write samples.\n");
       goto done;
     }
-    fprintf(outfile, "\n");
 
     if ((code = proc_resume(proc)) < 0) {
       code = -code;
       goto done;
     }
-    if (nanosleep(&sleep_spec, NULL) < 0) {
+    clock_gettime(CLOCK_MONOTONIC, &resumed);
+    pause_record(&pauses, elapsed_us(&stopped, &resumed), max_pause);
+    /* Wait on a slow disk or pipe now, rather than while stopped. */
+    if (sink.out && output_wait(sink.out) < 0) {
+      code++;
+      fprintf(stderr, "fatal: Failed to write samples.\n");
+      goto done;
+    }
+    if (top_mode) {
+      top_tick(top, stdout);
+    }
+    if (sink.flight) {
+      flight_tick(sink.flight);
+    }
+    if (serve_control(&ctl, &sink, pid, elapsed, &sleep_spec) < 0 &&
+        !should_dump) {
       break; // Interupted.
     }
     elapsed = elapsed + 1.0 / freq;
+    freq = ctl.freq;
+    set_interval(&sleep_spec, freq);
   }
 
  done:
   proc_destroy(proc);
+  print_pause_summary(verbose, max_pause);
+  if (sink.heavy && heavy_report(sink.heavy, sink.out) < 0) {
+    fprintf(stderr, "error: Failed to write the most common stacks.\n");
+  }
+  if (output_close(sink.out) < 0 && code == 0) {
+    code++;
+  }
+  if (calls_file) {
+    if (sink.calls && calls_report(sink.calls, calls_file) < 0) {
+      fprintf(stderr, "error: Failed to estimate call durations.\n");
+    }
+    if (fclose(calls_file) != 0 && code == 0) {
+      code++;
+    }
+  }
+  calls_destroy(sink.calls);
+  top_destroy(top);
+  flight_destroy(sink.flight);
+  heavy_destroy(sink.heavy);
+  free(sink.sample);
+  trigger_destroy(trigger);
+  control_destroy(ctl.control);
+  state_destroy(state);
   xrprof_destroy(cursor);
+#ifdef HAVE_LIBUNWIND
+  native_destroy(native);
+#endif
 
   return code;
 }
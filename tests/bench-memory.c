@@ -0,0 +1,144 @@
+/* Compare the latency and throughput of the memory backends for full R stack
+   walks against a running R process. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cursor.h"
+#include "../src/memory.h"
+#include "../src/process.h"
+
+#define DEFAULT_WALKS 1000
+
+static const char *backends[] = {"vm", "mem", "ptrace"};
+
+static int compare_longs(const void *a, const void *b) {
+  long x = *((const long *) a), y = *((const long *) b);
+  return (x > y) - (x < y);
+}
+
+static long elapsed_ns(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000L +
+    (end->tv_nsec - start->tv_nsec);
+}
+
+/* Returns the number of frames walked, or a negative value on error. */
+static int walk(struct xrprof_cursor *cursor) {
+  char rsym[256];
+  int ret, frames = 0;
+  if ((ret = xrprof_init(cursor)) < 0) {
+    return ret;
+  }
+  do {
+    if ((ret = xrprof_get_fun_name(cursor, rsym, sizeof(rsym))) < 0) {
+      return ret;
+    }
+    frames++;
+  } while ((ret = xrprof_step(cursor)) > 0);
+  return ret < 0 ? ret : frames;
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [-P] [-n <walks>] -p <pid>\n", name);
+}
+
+int main(int argc, char **argv) {
+  pid_t pid = -1;
+  int walks = DEFAULT_WALKS;
+  int flags = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hPn:p:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'P':
+      flags |= XRPROF_PROMISES;
+      break;
+    case 'n':
+      walks = strtol(optarg, NULL, 10);
+      break;
+    case 'p':
+      pid = strtol(optarg, NULL, 10);
+      break;
+    default: /* '?' */
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (pid <= 0 || walks <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  phandle proc;
+  if (proc_create(&proc, (void *) &pid) < 0) {
+    return 1;
+  }
+  struct xrprof_cursor *cursor = xrprof_create(proc, flags);
+  if (!cursor) {
+    fprintf(stderr, "fatal: Failed to initialize R stack cursor.\n");
+    proc_destroy(proc);
+    return 1;
+  }
+
+  long *latency = malloc(walks * sizeof(long));
+  struct timespec pause = {0, 1000000}; /* Let the tracee make progress. */
+
+  printf("backend\twalks\tframes\treads\tbytes\tmean_us\tp50_us\tp99_us\tmax_us\tMB_per_s\n");
+  for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+    struct copy_stats before, after;
+    long total_ns = 0, frames = 0;
+    int done = 0, code = 0, exited = 0;
+
+    copy_set_backend(backends[b], 0);
+    copy_get_stats(&before);
+
+    for (; done < walks; done++) {
+      struct timespec start, end;
+      if ((code = proc_suspend(proc)) < 0) {
+        exited = code == -2;
+        break;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      code = walk(cursor);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      proc_resume(proc);
+      if (code < 0) {
+        break;
+      }
+      frames += code;
+      latency[done] = elapsed_ns(&start, &end);
+      total_ns += latency[done];
+      nanosleep(&pause, NULL);
+    }
+
+    if (exited && done == 0) {
+      break;
+    } else if (done == 0) {
+      fprintf(stderr, "warning: The '%s' backend is not usable here.\n",
+              backends[b]);
+      continue;
+    }
+
+    copy_get_stats(&after);
+    qsort(latency, done, sizeof(long), compare_longs);
+    printf("%s\t%d\t%.1f\t%.1f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+           backends[b], done, (double) frames / done,
+           (double) (after.reads - before.reads) / done,
+           (double) (after.bytes - before.bytes) / done,
+           total_ns / 1000.0 / done, latency[done / 2] / 1000.0,
+           latency[(done * 99) / 100] / 1000.0, latency[done - 1] / 1000.0,
+           (after.bytes - before.bytes) / (total_ns / 1e9) / 1e6);
+  }
+
+  free(latency);
+  xrprof_destroy(cursor);
+  proc_destroy(proc);
+  return 0;
+}
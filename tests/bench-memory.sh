@@ -0,0 +1,38 @@
+#!/bin/sh
+
+usage() {
+    echo "Usage: $0 WORKLOAD [OPTIONS...]"
+}
+
+if [ -z "$1" ]; then
+    usage
+    exit 1
+fi
+
+WORKLOAD=$1
+shift
+
+if [ -z "$RSCRIPT" ]; then
+    RSCRIPT=`which Rscript`
+fi
+
+if [ -z "$BENCH" ]; then
+    BENCH="./bench-memory"
+fi
+
+set -e
+
+if [ -z "$SUDO_USER" ]; then
+    $RSCRIPT $WORKLOAD &
+    PID=$!
+else
+    sudo -u $SUDO_USER $RSCRIPT $WORKLOAD &
+    sleep 0.25
+    PID=`ps --ppid $! -o pid=`
+fi
+
+# Give R time to reach the interesting part of the workload.
+sleep 1
+
+$BENCH $@ -p $PID || true
+kill $PID
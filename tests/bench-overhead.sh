@@ -0,0 +1,118 @@
+#!/bin/sh
+
+# Measure how much xrprof slows down the programs it profiles. Each workload
+# is run without xrprof and then under it at several frequencies, in both R
+# and mixed mode, and the results are written as tab-separated values.
+
+usage() {
+    echo "Usage: $0 [WORKLOAD...]"
+}
+
+if [ "$1" = "-h" ]; then
+    usage
+    exit 0
+fi
+
+if [ -z "$RSCRIPT" ]; then
+    RSCRIPT=`which Rscript`
+fi
+
+if [ -z "$BIN" ]; then
+    BIN="./xrprof"
+fi
+
+# Each configuration is run this many times, and the median is reported.
+if [ -z "$RUNS" ]; then
+    RUNS=3
+fi
+
+if [ -z "$FREQS" ]; then
+    FREQS="10 100 1000"
+fi
+
+WORKLOADS="$@"
+if [ -z "$WORKLOADS" ]; then
+    WORKLOADS="overhead-recurse.R overhead-vector.R overhead-reshape.R overhead-rcpp.R"
+fi
+
+# Results are labelled with the version of xrprof, so they can be compared.
+VERSION=`git describe --always --dirty 2>/dev/null || echo unknown`
+TMP=`mktemp -d`
+trap 'rm -rf $TMP' EXIT
+
+set -e
+
+now() {
+    date +%s.%N
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { if (NR == 0) print "NA"; else if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# Run a workload (under the given command prefix, if any) and append its
+# self-reported elapsed time to $TMP/elapsed. Returns 77 if it was skipped.
+run_once() {
+    status=0
+    "$@" > $TMP/stdout 2> $TMP/stderr || status=$?
+    if [ $status -eq 77 ]; then
+        return 77
+    elif [ $status -ne 0 ]; then
+        echo "error: '$*' failed with status $status:" >&2
+        cat $TMP/stderr >&2
+        exit 1
+    fi
+    sed -n 's/^elapsed //p' $TMP/stdout >> $TMP/elapsed
+}
+
+printf "version\tworkload\tmode\tfreq\truns\tbaseline_s\telapsed_s\tslowdown_pct\tsamples\texpected\tp50_us\tp99_us\tmax_us\n"
+
+for WORKLOAD in $WORKLOADS; do
+    NAME=`basename $WORKLOAD .R`
+
+    : > $TMP/elapsed
+    SKIPPED=
+    for RUN in `seq $RUNS`; do
+        run_once $RSCRIPT $WORKLOAD || { SKIPPED=1; break; }
+    done
+    if [ ! -z "$SKIPPED" ]; then
+        echo "Skipping $NAME." >&2
+        continue
+    fi
+    BASELINE=`median < $TMP/elapsed`
+    printf "$VERSION\t$NAME\tnone\t0\t$RUNS\t$BASELINE\t$BASELINE\t0\tNA\tNA\tNA\tNA\tNA\n"
+
+    for MODE in r mixed; do
+        FLAGS=
+        if [ "$MODE" = "mixed" ]; then
+            FLAGS="-m"
+        fi
+        for FREQ in $FREQS; do
+            : > $TMP/elapsed
+            : > $TMP/samples
+            : > $TMP/expected
+            : > $TMP/p50
+            : > $TMP/p99
+            : > $TMP/max
+            for RUN in `seq $RUNS`; do
+                START=`now`
+                run_once $BIN -v $FLAGS -F $FREQ -o $TMP/Rprof.out -- $RSCRIPT $WORKLOAD
+                END=`now`
+                # Don't count the header line.
+                echo $((`wc -l < $TMP/Rprof.out` - 1)) >> $TMP/samples
+                echo "$START $END $FREQ" | awk '{ printf "%d\n", ($2 - $1) * $3 }' >> $TMP/expected
+                # From "Paused the process N times: p50 Xus, p99 Yus, max Zus."
+                sed -n 's/^Paused .* p50 \([0-9]*\)us, p99 \([0-9]*\)us, max \([0-9]*\)us\.$/\1 \2 \3/p' \
+                    $TMP/stderr > $TMP/pauses
+                cut -d ' ' -f 1 $TMP/pauses >> $TMP/p50
+                cut -d ' ' -f 2 $TMP/pauses >> $TMP/p99
+                cut -d ' ' -f 3 $TMP/pauses >> $TMP/max
+            done
+            ELAPSED=`median < $TMP/elapsed`
+            SLOWDOWN=`echo "$ELAPSED $BASELINE" | awk '{ printf "%.1f", 100 * ($1 / $2 - 1) }'`
+            printf "$VERSION\t$NAME\t$MODE\t$FREQ\t$RUNS\t$BASELINE\t$ELAPSED\t$SLOWDOWN\t%s\t%s\t%s\t%s\t%s\n" \
+                   `median < $TMP/samples` `median < $TMP/expected` \
+                   `median < $TMP/p50` `median < $TMP/p99` `median < $TMP/max`
+        done
+    done
+done
@@ -23,7 +23,10 @@ fi
 
 set -e
 
-if [ -z "$SUDO_USER" ]; then
+if [ -z "$SUDO_USER" ] && [ "`uname`" = "Linux" ]; then
+    # Start the script under xrprof, so that nothing is missed.
+    $BIN -F 50 $@ -o $OUTFILE -- $RSCRIPT $TEST
+elif [ -z "$SUDO_USER" ]; then
     $RSCRIPT $TEST &
     PID=$!
     # Try to detect Cygwin. Unixy PIDs will not work for OpenProcess().
@@ -31,6 +34,7 @@ if [ -z "$SUDO_USER" ]; then
     if [ ! -z "$WINPID" ]; then
         PID=$WINPID
     fi
+    $BIN -F 50 $@ -p $PID > $OUTFILE
 else
     # Run the script as the original sudo user (i.e. not root), so that it
     # behaves as expected.
@@ -38,10 +42,9 @@ else
     # Wait a little bit for the fork(s).
     sleep 0.25
     PID=`ps --ppid $! -o pid=`
+    $BIN -F 50 $@ -p $PID > $OUTFILE
 fi
 
-$BIN -F 50 $@ -p $PID > $OUTFILE
-
 if [ ! -z "$SUDO_USER" ]; then
     # Ensure we can actually look at the output.
     chown $SUDO_USER:$SUDO_USER $OUTFILE
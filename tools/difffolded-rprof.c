@@ -0,0 +1,403 @@
+/* Compare two profiles (or two windows of time in one profile) in the
+   Rprof.out format, writing the "folded diff" format understood by Brendan
+   Gregg's FlameGraph tools for red/blue differential flame graphs, along with
+   optional tables of per-stack and per-function deltas. Like
+   stackcollapse-rprof, the input is streamed. */
+
+#include <math.h>       /* for fabs, sqrt */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     /* for getopt */
+
+#include "rprof.h"
+#include "../src/intern.h"
+
+#define NORM_NONE 0
+#define NORM_SAMPLES 1
+#define NORM_INTERVAL 2
+
+/* A time window within a profile, in seconds. */
+struct window {
+  double from;
+  double to;
+};
+
+/* Counts indexed by intern ID, for the "before" and "after" profiles. */
+struct counts {
+  unsigned long *before;
+  unsigned long *after;
+  size_t cap;
+};
+
+struct diff {
+  struct intern_table *stacks;
+  struct counts stack_counts;
+  struct intern_table *functions;
+  struct counts self;
+  struct counts total;
+  unsigned long *seen;  /* The last sample (plus one) counted in total. */
+  size_t seen_cap;
+  unsigned long sample;
+  unsigned long samples[2];
+  long interval[2];
+};
+
+static void usage(const char *name) {
+  printf("Usage: %s [-h] [-n samples|interval|none] [-A <from>:<to>] [-B <from>:<to>] [-s <file>] [-f <file>] before.out [after.out]\n",
+         name);
+}
+
+/* Parse a window like "60:120", where either end may be omitted. */
+static int parse_window(const char *spec, struct window *out) {
+  char *end;
+  out->from = 0;
+  out->to = HUGE_VAL;
+  if (spec[0] != ':') {
+    out->from = strtod(spec, &end);
+    if (end == spec || *end != ':') {
+      return -1;
+    }
+    spec = end;
+  }
+  spec++;
+  if (spec[0] != '\0') {
+    out->to = strtod(spec, &end);
+    if (end == spec || *end != '\0') {
+      return -1;
+    }
+  }
+  return out->from <= out->to ? 0 : -1;
+}
+
+static int grow_array(unsigned long **array, size_t cap, size_t newcap) {
+  unsigned long *grown = realloc(*array, newcap * sizeof(unsigned long));
+  if (!grown) {
+    return -1;
+  }
+  memset(grown + cap, 0, (newcap - cap) * sizeof(unsigned long));
+  *array = grown;
+  return 0;
+}
+
+static int grow_counts(struct counts *counts, int id) {
+  if (id < counts->cap) {
+    return 0;
+  }
+  size_t cap = counts->cap ? 2 * counts->cap : 1024;
+  while (cap <= id) {
+    cap *= 2;
+  }
+  if (grow_array(&counts->before, counts->cap, cap) < 0 ||
+      grow_array(&counts->after, counts->cap, cap) < 0) {
+    return -1;
+  }
+  counts->cap = cap;
+  return 0;
+}
+
+static void count(struct counts *counts, int id, int side) {
+  if (side == 0) {
+    counts->before[id]++;
+  } else {
+    counts->after[id]++;
+  }
+}
+
+/* Count each function in a folded stack once towards its total, and the
+   innermost towards its self count. */
+static int add_functions(struct diff *diff, char *folded, int side) {
+  int id = -1;
+  char *name = folded, *end;
+  diff->sample++;
+  while (name) {
+    if ((end = strchr(name, ';'))) {
+      *end = '\0';
+    }
+    if ((id = intern_string(diff->functions, name)) < 0 ||
+        grow_counts(&diff->self, id) < 0 || grow_counts(&diff->total, id) < 0) {
+      return -1;
+    }
+    if (id >= diff->seen_cap) {
+      if (grow_array(&diff->seen, diff->seen_cap, diff->total.cap) < 0) {
+        return -1;
+      }
+      diff->seen_cap = diff->total.cap;
+    }
+    if (diff->seen[id] != diff->sample) {
+      diff->seen[id] = diff->sample;
+      count(&diff->total, id, side);
+    }
+    name = end ? end + 1 : NULL;
+  }
+  count(&diff->self, id, side);
+  return 0;
+}
+
+/* Read the samples within a window of a profile. */
+static int read_profile(struct diff *diff, const char *path,
+                        const struct window *window, int side) {
+  struct rprof_reader *in = rprof_open(path);
+  const char *folded;
+  char *copy = NULL;
+  size_t copy_cap = 0;
+  long len;
+  int code = 0;
+  if (!in) {
+    return -1;
+  }
+
+  while ((len = rprof_read_sample(in, &folded)) >= 0) {
+    /* Times are estimated from the number of samples so far. */
+    double t = rprof_time(in);
+    if (window && rprof_interval(in) == 0) {
+      fprintf(stderr, "fatal: %s has no sampling interval, so it can't be split into windows.\n",
+              path);
+      rprof_close(in);
+      return -1;
+    }
+    if (window && (t < window->from || t >= window->to)) {
+      if (t >= window->to) {
+        break;
+      }
+      continue;
+    }
+
+    int id = intern_string(diff->stacks, folded);
+    if (id < 0 || grow_counts(&diff->stack_counts, id) < 0) {
+      code = -1;
+      break;
+    }
+    count(&diff->stack_counts, id, side);
+    diff->samples[side]++;
+    diff->interval[side] = rprof_interval(in);
+
+    if (len + 1 > copy_cap) {
+      char *buff = realloc(copy, len + 1);
+      if (!buff) {
+        code = -1;
+        break;
+      }
+      copy = buff;
+      copy_cap = len + 1;
+    }
+    memcpy(copy, folded, len + 1);
+    if (add_functions(diff, copy, side) < 0) {
+      code = -1;
+      break;
+    }
+  }
+  if (code < 0) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+  }
+  if (len == -2 || rprof_close(in) < 0) {
+    code = -1;
+  }
+  free(copy);
+  return code;
+}
+
+/* A two-proportion z-test of whether a stack or function is more (or less)
+   common afterwards. Samples are not really independent, so this overstates
+   significance, but it is useful for ranking. */
+static double z_score(unsigned long before, unsigned long after,
+                      unsigned long n_before, unsigned long n_after) {
+  if (n_before == 0 || n_after == 0) {
+    return 0;
+  }
+  double p1 = (double) before / n_before, p2 = (double) after / n_after;
+  double p = (double) (before + after) / (n_before + n_after);
+  double se = sqrt(p * (1 - p) * (1.0 / n_before + 1.0 / n_after));
+  return se > 0 ? (p2 - p1) / se : 0;
+}
+
+struct row {
+  int id;
+  double z;
+};
+
+static int compare_rows(const void *a, const void *b) {
+  double x = fabs(((const struct row *) a)->z),
+    y = fabs(((const struct row *) b)->z);
+  return (x < y) - (x > y);
+}
+
+/* Rows are sorted by significance, most significant first. */
+static struct row *sorted_rows(struct counts *counts, size_t len,
+                               unsigned long *samples) {
+  struct row *rows = malloc((len + 1) * sizeof(struct row));
+  if (!rows) {
+    return NULL;
+  }
+  for (size_t id = 0; id < len; id++) {
+    rows[id].id = id;
+    rows[id].z = z_score(counts->before[id], counts->after[id], samples[0],
+                         samples[1]);
+  }
+  qsort(rows, len, sizeof(struct row), compare_rows);
+  return rows;
+}
+
+static double percent(unsigned long count, unsigned long samples) {
+  return samples ? 100.0 * count / samples : 0;
+}
+
+static int write_stacks(struct diff *diff, const char *path) {
+  FILE *out = fopen(path, "w");
+  size_t len = intern_size(diff->stacks);
+  struct row *rows;
+  if (!out) {
+    perror("fatal: Failed to open stack table");
+    return -1;
+  }
+  if (!(rows = sorted_rows(&diff->stack_counts, len, diff->samples))) {
+    fclose(out);
+    return -1;
+  }
+  fprintf(out, "stack\tbefore\tafter\tbefore_pct\tafter_pct\tdelta_pct\tz\n");
+  for (size_t i = 0; i < len; i++) {
+    int id = rows[i].id;
+    double p1 = percent(diff->stack_counts.before[id], diff->samples[0]),
+      p2 = percent(diff->stack_counts.after[id], diff->samples[1]);
+    fprintf(out, "%s\t%lu\t%lu\t%.2f\t%.2f\t%+.2f\t%.2f\n",
+            intern_lookup(diff->stacks, id), diff->stack_counts.before[id],
+            diff->stack_counts.after[id], p1, p2, p2 - p1, rows[i].z);
+  }
+  free(rows);
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+static int write_functions(struct diff *diff, const char *path) {
+  FILE *out = fopen(path, "w");
+  size_t len = intern_size(diff->functions);
+  struct row *rows;
+  if (!out) {
+    perror("fatal: Failed to open function table");
+    return -1;
+  }
+  if (!(rows = sorted_rows(&diff->total, len, diff->samples))) {
+    fclose(out);
+    return -1;
+  }
+  fprintf(out, "function\tbefore_self\tafter_self\tbefore_total\tafter_total\tbefore_pct\tafter_pct\tdelta_pct\tz\n");
+  for (size_t i = 0; i < len; i++) {
+    int id = rows[i].id;
+    double p1 = percent(diff->total.before[id], diff->samples[0]),
+      p2 = percent(diff->total.after[id], diff->samples[1]);
+    fprintf(out, "%s\t%lu\t%lu\t%lu\t%lu\t%.2f\t%.2f\t%+.2f\t%.2f\n",
+            intern_lookup(diff->functions, id), diff->self.before[id],
+            diff->self.after[id], diff->total.before[id],
+            diff->total.after[id], p1, p2, p2 - p1, rows[i].z);
+  }
+  free(rows);
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  struct window windows[2];
+  int have_window[2] = {0, 0};
+  int norm = NORM_SAMPLES;
+  const char *stacks_path = NULL, *functions_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:A:B:s:f:")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'n':
+      if (strcmp(optarg, "samples") == 0) {
+        norm = NORM_SAMPLES;
+      } else if (strcmp(optarg, "interval") == 0) {
+        norm = NORM_INTERVAL;
+      } else if (strcmp(optarg, "none") == 0) {
+        norm = NORM_NONE;
+      } else {
+        fprintf(stderr, "fatal: Unknown normalization '%s'.\n", optarg);
+        return 1;
+      }
+      break;
+    case 'A':
+    case 'B':
+      if (parse_window(optarg, &windows[opt == 'B']) < 0) {
+        fprintf(stderr, "fatal: Invalid window '%s'.\n", optarg);
+        return 1;
+      }
+      have_window[opt == 'B'] = 1;
+      break;
+    case 's':
+      stacks_path = optarg;
+      break;
+    case 'f':
+      functions_path = optarg;
+      break;
+    default: /* '?' */
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 1 || argc - optind > 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  /* A single profile is split into two windows. */
+  if (argc - optind == 1 && (!have_window[0] || !have_window[1])) {
+    fprintf(stderr, "fatal: Both -A and -B are required to compare windows of one profile.\n");
+    return 1;
+  }
+  const char *paths[2] = {argv[optind], argv[argc - 1]};
+
+  struct diff diff;
+  int code = 0;
+  memset(&diff, 0, sizeof(struct diff));
+  diff.stacks = intern_create();
+  diff.functions = intern_create();
+  if (!diff.stacks || !diff.functions) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    return 1;
+  }
+
+  for (int side = 0; side < 2 && code == 0; side++) {
+    if (read_profile(&diff, paths[side], have_window[side] ? &windows[side] :
+                     NULL, side) < 0) {
+      code = 1;
+    }
+  }
+  if (code == 0 && (diff.samples[0] == 0 || diff.samples[1] == 0)) {
+    fprintf(stderr, "warning: No samples %s.\n",
+            diff.samples[0] == 0 ? "before" : "after");
+  }
+
+  /* Scale the "before" counts to be comparable with the "after" ones: either
+     to the same number of samples, or (when the sampling frequencies differ)
+     to the same interval, so that they measure time. */
+  double scale = 1;
+  if (norm == NORM_SAMPLES && diff.samples[0] > 0) {
+    scale = (double) diff.samples[1] / diff.samples[0];
+  } else if (norm == NORM_INTERVAL && diff.interval[0] > 0 &&
+             diff.interval[1] > 0) {
+    scale = (double) diff.interval[0] / diff.interval[1];
+  }
+  for (size_t id = 0; code == 0 && id < intern_size(diff.stacks); id++) {
+    printf("%s %.0f %lu\n", intern_lookup(diff.stacks, id),
+           diff.stack_counts.before[id] * scale, diff.stack_counts.after[id]);
+  }
+
+  if (code == 0 && stacks_path && write_stacks(&diff, stacks_path) < 0) {
+    code = 1;
+  }
+  if (code == 0 && functions_path &&
+      write_functions(&diff, functions_path) < 0) {
+    code = 1;
+  }
+
+  intern_destroy(diff.stacks);
+  intern_destroy(diff.functions);
+  free(diff.stack_counts.before);
+  free(diff.stack_counts.after);
+  free(diff.self.before);
+  free(diff.self.after);
+  free(diff.total.before);
+  free(diff.total.after);
+  free(diff.seen);
+  return code;
+}
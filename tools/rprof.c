@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     /* for access */
+#include <zlib.h>       /* for gzopen, gzgets */
+
+#include "rprof.h"
+
+#define MAX_FRAMES 16384
+
+struct srcfiles {
+  char **names;         /* Indexed by file number, starting at 1. */
+  int len;
+};
+
+struct frame {
+  char *name;
+  size_t len;
+  int file;             /* Zero when there is no srcref. */
+  long line;
+};
+
+/* Read a line of any length into *buff, growing it as needed. Returns the
+   length of the line (without the trailing newline), or -1 at EOF. */
+static long read_line(gzFile in, char **buff, size_t *cap) {
+  size_t len = 0;
+  while (1) {
+    if (*cap - len < 2) {
+      size_t newcap = *cap ? *cap * 2 : 4096;
+      char *newbuff = realloc(*buff, newcap);
+      if (!newbuff) {
+        return -1;
+      }
+      *buff = newbuff;
+      *cap = newcap;
+    }
+    if (!gzgets(in, *buff + len, *cap - len)) {
+      return len > 0 ? (long) len : -1;
+    }
+    len += strlen(*buff + len);
+    if (len > 0 && (*buff)[len - 1] == '\n') {
+      (*buff)[--len] = '\0';
+      return len;
+    }
+  }
+}
+
+/* Files that don't exist here are probably package sources, in which case a
+   path like "/tmp/RtmpXYZ/R.INSTALL/pkg/R/file.R" becomes "pkg:file.R". */
+static char *format_srcfile(const char *path) {
+  char *out;
+  const char *dir = NULL, *pkg, *p;
+  if (access(path, F_OK) == 0) {
+    return strdup(path);
+  }
+  for (p = strstr(path, "/R/"); p; p = strstr(p + 1, "/R/")) {
+    dir = p;
+  }
+  if (!dir) {
+    return strdup(path);
+  }
+  for (pkg = dir; pkg > path && pkg[-1] != '/'; pkg--)
+    ;
+  size_t len = (dir - pkg) + 1 + strlen(dir + 3) + 1;
+  if ((out = malloc(len))) {
+    snprintf(out, len, "%.*s:%s", (int) (dir - pkg), pkg, dir + 3);
+  }
+  return out;
+}
+
+/* Handle "#File N: path" annotations from line profiling. */
+static int add_srcfile(struct srcfiles *files, const char *line) {
+  char *end;
+  long n = strtol(line + 6, &end, 10);
+  if (n <= 0 || end[0] != ':' || end[1] != ' ') {
+    return -1;
+  }
+  if (n > files->len) {
+    char **names = realloc(files->names, n * sizeof(char *));
+    if (!names) {
+      return -1;
+    }
+    memset(names + files->len, 0, (n - files->len) * sizeof(char *));
+    files->names = names;
+    files->len = n;
+  }
+  free(files->names[n - 1]);
+  files->names[n - 1] = format_srcfile(end + 2);
+  return 0;
+}
+
+/* Parse a srcref like "1#23" at *p, advancing past it. */
+static int parse_srcref(char **p, int *file, long *line) {
+  char *end;
+  long f = strtol(*p, &end, 10);
+  if (end == *p || *end != '#') {
+    return -1;
+  }
+  char *start = end + 1;
+  long l = strtol(start, &end, 10);
+  if (end == start) {
+    return -1;
+  }
+  *file = f;
+  *line = l;
+  *p = end;
+  return 0;
+}
+
+/* Split a sample into its (quoted) frames, innermost first. */
+static int parse_frames(char *line, struct frame *frames, int max) {
+  int n = 0, file;
+  long lineno;
+  char *p = line;
+
+  /* Skip the srcref at the start of the line, which belongs to the innermost
+     frame but is for the line being executed there; like the R script, we
+     don't try to represent it. */
+  parse_srcref(&p, &file, &lineno);
+
+  while (n < max && (p = strchr(p, '"'))) {
+    char *start = p + 1, *end = strchr(start, '"');
+    if (!end) {
+      break;
+    }
+    frames[n].name = start;
+    frames[n].len = end - start;
+    frames[n].file = 0;
+    p = end + 1;
+    while (*p == ' ') {
+      p++;
+    }
+    if (parse_srcref(&p, &frames[n].file, &frames[n].line) < 0) {
+      frames[n].file = 0;
+    }
+    n++;
+  }
+  return n;
+}
+
+/* Append a frame to the folded stack in out, annotating it in a way that
+   FlameGraph understands. */
+static size_t format_frame(char *out, size_t cap, struct frame *frame,
+                           struct srcfiles *files) {
+  const char *name = frame->name;
+  int len = frame->len;
+  const char *suffix = "";
+  size_t written;
+
+  if (len > 9 && strncmp(name, "<Native:", 8) == 0 && name[len - 1] == '>') {
+    name += 8;
+    len -= 9;
+    suffix = "_[n]";
+  } else if (len > 11 && strncmp(name, "<Built-in:", 10) == 0 &&
+             name[len - 1] == '>') {
+    name += 10;
+    len -= 11;
+    suffix = "_[i]";
+  }
+
+  if (frame->file > 0 && frame->file <= files->len &&
+      files->names[frame->file - 1]) {
+    written = snprintf(out, cap, "%.*s%s at %s:%ld", len, name, suffix,
+                       files->names[frame->file - 1], frame->line);
+    return written < cap ? written : cap;
+  }
+
+  /* This is by far the most common case, so avoid snprintf(). */
+  written = len + strlen(suffix);
+  if (written >= cap) {
+    return 0;
+  }
+  memcpy(out, name, len);
+  memcpy(out + len, suffix, strlen(suffix) + 1);
+  return written;
+}
+
+struct rprof_reader {
+  gzFile in;
+  struct srcfiles files;
+  struct frame *frames;
+  char *line;
+  size_t line_cap;
+  char *folded;
+  size_t folded_cap;
+  unsigned long lineno;
+  unsigned long samples;
+  long interval;
+  double time;          /* When the last sample was taken, in seconds. */
+  double clock;         /* When the next one is expected. */
+};
+
+struct rprof_reader *rprof_open(const char *path) {
+  struct rprof_reader *out = calloc(1, sizeof(struct rprof_reader));
+  if (!out) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    return NULL;
+  }
+  /* gzopen() reads uncompressed files transparently, too. */
+  out->in = path ? gzopen(path, "rb") : gzdopen(0, "rb");
+  if (!out->in) {
+    perror("fatal: Failed to open input");
+    free(out);
+    return NULL;
+  }
+  gzbuffer(out->in, 1 << 17);
+  if (!(out->frames = malloc(MAX_FRAMES * sizeof(struct frame)))) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    rprof_close(out);
+    return NULL;
+  }
+  return out;
+}
+
+int rprof_close(struct rprof_reader *in) {
+  int errnum, code = 0;
+  const char *msg = gzerror(in->in, &errnum);
+  if (errnum != Z_OK && errnum != Z_BUF_ERROR) {
+    fprintf(stderr, "error: Failed to read input: %s.\n", msg);
+    code = -1;
+  }
+  gzclose(in->in);
+  for (int i = 0; i < in->files.len; i++) {
+    free(in->files.names[i]);
+  }
+  free(in->files.names);
+  free(in->frames);
+  free(in->line);
+  free(in->folded);
+  free(in);
+  return code;
+}
+
+/* Handle "#Control what t=secs interval=usecs" annotations, written when a
+   running profiler is adjusted, and "#Trigger start|stop t=secs ..." ones,
+   written when a trigger condition changes, so that the clock follows changes
+   to the frequency and any time spent not sampling. */
+static void set_clock(struct rprof_reader *in, const char *line) {
+  const char *p;
+  if ((p = strstr(line, " t="))) {
+    in->clock = strtod(p + 3, NULL);
+  }
+  /* A trigger's description is free-form, so only trust this in the other. */
+  if (strncmp(line, "#Control ", 9) == 0 &&
+      (p = strstr(line, " interval="))) {
+    in->interval = strtol(p + 10, NULL, 10);
+  }
+}
+
+long rprof_read_sample(struct rprof_reader *in, const char **folded) {
+  struct frame *frames = in->frames;
+  long len;
+  while ((len = read_line(in->in, &in->line, &in->line_cap)) >= 0) {
+    char *line = in->line;
+    in->lineno++;
+    if (strncmp(line, "#File ", 6) == 0) {
+      if (add_srcfile(&in->files, line) < 0) {
+        fprintf(stderr, "warning: Malformed file annotation on line %lu.\n",
+                in->lineno);
+      }
+      continue;
+    }
+    /* Skip the header and any other comments. */
+    if (in->lineno == 1 && strstr(line, "sample.interval=")) {
+      in->interval = strtol(strstr(line, "sample.interval=") + 16, NULL, 10);
+      continue;
+    }
+    if (strncmp(line, "#Control ", 9) == 0 ||
+        strncmp(line, "#Trigger ", 9) == 0) {
+      set_clock(in, line);
+      continue;
+    }
+    if (line[0] == '#') {
+      continue;
+    }
+
+    in->samples++;
+    in->time = in->clock;
+    in->clock += in->interval / 1e6;
+    int n = parse_frames(line, frames, MAX_FRAMES);
+    if (n == 0) {
+      continue;
+    }
+
+    /* Leave room for the srcref annotations and separators. */
+    size_t needed = len + 1;
+    for (int i = 0; i < n; i++) {
+      if (frames[i].file > 0 && frames[i].file <= in->files.len &&
+          in->files.names[frames[i].file - 1]) {
+        needed += strlen(in->files.names[frames[i].file - 1]) + 32;
+      }
+    }
+    if (needed > in->folded_cap) {
+      char *buff = realloc(in->folded, needed);
+      if (!buff) {
+        fprintf(stderr, "fatal: Failed to allocate memory.\n");
+        return -2;
+      }
+      in->folded = buff;
+      in->folded_cap = needed;
+    }
+
+    /* Folded stacks are outermost first. */
+    size_t pos = 0;
+    for (int i = n - 1; i >= 0; i--) {
+      pos += format_frame(in->folded + pos, in->folded_cap - pos, &frames[i],
+                          &in->files);
+      if (i > 0 && pos < in->folded_cap - 1) {
+        in->folded[pos++] = ';';
+        in->folded[pos] = '\0';
+      }
+    }
+    *folded = in->folded;
+    return pos;
+  }
+  return -1;
+}
+
+long rprof_interval(struct rprof_reader *in) {
+  return in->interval;
+}
+
+unsigned long rprof_samples(struct rprof_reader *in) {
+  return in->samples;
+}
+
+double rprof_time(struct rprof_reader *in) {
+  return in->time;
+}
@@ -0,0 +1,27 @@
+#ifndef XRPROF_TOOLS_RPROF_H
+#define XRPROF_TOOLS_RPROF_H
+
+/* A streaming reader for the Rprof.out format (which may be gzip-compressed),
+   shared by the tools that consume it. Each sample is converted to the
+   "folded" format understood by Brendan Gregg's FlameGraph tools. */
+struct rprof_reader;
+
+/* Open the file at path, or standard input if it is NULL. */
+struct rprof_reader *rprof_open(const char *path);
+/* Returns a negative value if the input could not be read in full. */
+int rprof_close(struct rprof_reader *in);
+/* Read the next sample as a folded stack (outermost first). Returns its
+   length, -1 at the end of the input, or -2 on error. The stack is valid until
+   the next call. */
+long rprof_read_sample(struct rprof_reader *in, const char **folded);
+/* The sampling interval in microseconds, from the header or the last #Control
+   line, or zero. */
+long rprof_interval(struct rprof_reader *in);
+/* How many samples have been read so far, including empty ones. */
+unsigned long rprof_samples(struct rprof_reader *in);
+/* When the last sample was taken, in seconds since the first, estimated from
+   the sampling interval and the times given by any #Control or #Trigger
+   lines. */
+double rprof_time(struct rprof_reader *in);
+
+#endif /* XRPROF_TOOLS_RPROF_H */
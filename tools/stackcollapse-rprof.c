@@ -0,0 +1,88 @@
+/* Convert the Rprof.out format to the "folded" format understood by Brendan
+   Gregg's FlameGraph tools, like stackcollapse-rprof.R but in a single
+   streaming pass. Memory use is bounded by the number of unique stacks rather
+   than the size of the input, which can be gzip-compressed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     /* for getopt */
+
+#include "rprof.h"
+#include "../src/intern.h"
+
+static void usage(const char *name) {
+  printf("Usage: %s [-h] [Rprof.out]\n", name);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "h")) != -1) {
+    switch (opt) {
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default: /* '?' */
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind > 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct rprof_reader *in = rprof_open(optind < argc ? argv[optind] : NULL);
+  if (!in) {
+    return 1;
+  }
+
+  struct intern_table *stacks = intern_create();
+  unsigned long *counts = NULL;
+  size_t ncounts = 0;
+  const char *folded;
+  long len;
+  int code = 0;
+
+  if (!stacks) {
+    fprintf(stderr, "fatal: Failed to allocate memory.\n");
+    return 1;
+  }
+
+  while ((len = rprof_read_sample(in, &folded)) >= 0) {
+    int id = intern_string(stacks, folded);
+    if (id < 0) {
+      fprintf(stderr, "fatal: Failed to allocate memory.\n");
+      code = 1;
+      break;
+    }
+    if (id >= ncounts) {
+      size_t newlen = ncounts ? 2 * ncounts : 1024;
+      unsigned long *newcounts = realloc(counts, newlen * sizeof(unsigned long));
+      if (!newcounts) {
+        fprintf(stderr, "fatal: Failed to allocate memory.\n");
+        code = 1;
+        break;
+      }
+      memset(newcounts + ncounts, 0, (newlen - ncounts) * sizeof(unsigned long));
+      counts = newcounts;
+      ncounts = newlen;
+    }
+    counts[id]++;
+  }
+  if (len == -2) {
+    code = 1;
+  }
+  if (rprof_close(in) < 0) {
+    code = 1;
+  }
+
+  /* Stacks are written in the order they were first seen. */
+  for (size_t id = 0; id < intern_size(stacks); id++) {
+    printf("%s %lu\n", intern_lookup(stacks, id), counts[id]);
+  }
+
+  free(counts);
+  intern_destroy(stacks);
+  return code;
+}